@@ -1,11 +1,629 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <csignal>
+#include <condition_variable>
+#include <random>
+#include <thread>
+#include <filesystem>
+#include <numeric>
+#include <map>
+#include <atomic>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "bencode_helper.h"
 #include "network_helper.h"
 #include "downloader.h"
 #include "magnet_links.h"
+#include "dht.h"
+#include "lsd.h"
+#include "listener.h"
+#include "upload.h"
+#include "utp.h"
+#include "buffer_pool.h"
+#include "disk_io.h"
+#include "web_seed.h"
+#include "lib/http/httplib.h"
+
+#define DISK_BENCH_WINDOW 32 // disk_bench completes pieces in random order within windows of this many, like a swarm does
+
+std::atomic<bool> is_running = true; // cleared by SIGINT / SIGTERM to stop seeding
+
+// --max-peer-download-rate / --max-peer-upload-rate, bytes/s for each connection of a torrent, 0 = unlimited
+int64_t peer_download_limit = 0;
+int64_t peer_upload_limit = 0;
+
+void handle_stop_signal(int)
+{
+	is_running = false;
+}
+
+std::shared_ptr<DHT::Node> start_dht_node()
+{
+	auto dht_node = std::make_shared<DHT::Node>();
+
+	if (dht_node->start("0.0.0.0", DHT_DEFAULT_PORT) != 0)
+	{
+		std::cerr << "DHT disabled, relying on trackers only" << std::endl;
+		return nullptr;
+	}
+
+	return dht_node;
+}
+
+std::shared_ptr<LSD::Service> start_lsd_service()
+{
+	auto lsd_service = std::make_shared<LSD::Service>();
+
+	if (lsd_service->start() != 0)
+	{
+		std::cerr << "LSD disabled, no LAN peer discovery" << std::endl;
+		return nullptr;
+	}
+
+	return lsd_service;
+}
+
+std::shared_ptr<Listener::Peer_Listener> start_peer_listener()
+{
+	auto peer_listener = std::make_shared<Listener::Peer_Listener>();
+
+	if (peer_listener->start(TORRENT_LISTEN_PORT) != 0)
+	{
+		std::cerr << "Not accepting incoming peers, download only" << std::endl;
+		return nullptr;
+	}
+
+	return peer_listener;
+}
+
+// Started after the listener, which serves its incoming connections, and before the DHT: the DHT moves to another port
+// when ours is taken, while peers only look for uTP on the port we announce
+std::shared_ptr<Utp::Utp_Socket> start_utp_socket(const std::shared_ptr<Listener::Peer_Listener>& peer_listener)
+{
+	auto utp_socket = std::make_shared<Utp::Utp_Socket>();
+
+	if (utp_socket->start(TORRENT_LISTEN_PORT) != 0)
+	{
+		std::cerr << "uTP disabled, connecting over TCP only" << std::endl;
+		return nullptr;
+	}
+
+	if (peer_listener)
+	{
+		utp_socket->set_accept_handler([peer_listener](int peer_socket, const Network::Peer_Address& peer_addr) {
+			peer_listener->adopt_connection(peer_socket, peer_addr);
+		});
+	}
+
+	return utp_socket;
+}
+
+// Sends byte_count random bytes from one uTP socket to another over loopback, with every datagram of both sides delayed
+// by delay and loss_rate of them dropped, and checks what arrived. Shows how the transport copes with a bad path.
+int run_utp_loopback(size_t byte_count, std::chrono::milliseconds delay, double loss_rate)
+{
+	Utp::Utp_Socket sender, receiver;
+
+	if (sender.start(0) != 0 || receiver.start(0) != 0)
+		return -1;
+
+	sender.set_impairment(delay, loss_rate);
+	receiver.set_impairment(delay, loss_rate);
+
+	std::mutex accept_mutex;
+	std::condition_variable accept_cv;
+	int accepted_socket = -1;
+
+	receiver.set_accept_handler([&](int peer_socket, const Network::Peer_Address&) {
+		std::unique_lock<std::mutex> lock(accept_mutex);
+
+		if (accepted_socket >= 0)
+		{
+			close(peer_socket);
+			return;
+		}
+
+		accepted_socket = peer_socket;
+		accept_cv.notify_all();
+	});
+
+	Network::Peer_Address receiver_addr;
+	Network::Peer_Address::from_string("127.0.0.1:" + std::to_string(receiver.port()), receiver_addr);
+
+	int peer_socket = sender.connect(receiver_addr, std::chrono::milliseconds(CONNECT_TIMEOUT_MS) + 4 * delay);
+	if (peer_socket < 0)
+	{
+		std::cerr << "uTP loopback connect failed" << std::endl;
+		return -1;
+	}
+
+	std::unique_lock<std::mutex> lock(accept_mutex);
+	accept_cv.wait_for(lock, std::chrono::seconds(10), [&]() { return accepted_socket >= 0; });
+	lock.unlock();
+
+	if (accepted_socket < 0)
+	{
+		std::cerr << "uTP loopback accept failed" << std::endl;
+		close(peer_socket);
+		return -1;
+	}
+
+	std::vector<char> data(byte_count);
+	std::mt19937 generator(byte_count);
+	for (auto& byte : data)
+		byte = static_cast<char>(generator());
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::thread writer([&]() {
+		for (size_t sent = 0; sent < data.size();)
+		{
+			ssize_t result = send(peer_socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (result <= 0)
+				break;
+
+			sent += result;
+		}
+
+		shutdown(peer_socket, SHUT_WR); // the FIN tells the receiver the transfer is complete
+	});
+
+	timeval tv{30, 0};
+	setsockopt(accepted_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	size_t received = 0;
+	bool is_intact = true;
+	std::vector<char> buffer(64 * 1024);
+
+	while (true)
+	{
+		ssize_t result = recv(accepted_socket, buffer.data(), buffer.size(), 0);
+		if (result <= 0)
+			break;
+
+		if (received + result > data.size() || !std::equal(buffer.begin(), buffer.begin() + result, data.begin() + received))
+			is_intact = false;
+
+		received += result;
+	}
+
+	auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	close(accepted_socket);
+	shutdown(peer_socket, SHUT_RDWR); // a writer stuck on a dead connection returns
+	writer.join();
+	close(peer_socket);
+
+	is_intact = is_intact && received == data.size();
+
+	Utp::Stats stats = sender.stats();
+	std::cout << "Received " << received << " of " << data.size() << " bytes in " << elapsed_ms << " ms ("
+			  << received * 1000 / 1024 / std::max<int64_t>(elapsed_ms, 1) << " KiB/s), " << (is_intact ? "intact" : "CORRUPT") << "\n";
+	std::cout << "Sender: " << stats.packets_sent << " packets, " << stats.retransmissions << " retransmitted ("
+			  << stats.fast_resends << " fast), " << stats.dropped << " dropped by the impairment\n";
+
+	return is_intact ? 0 : -1;
+}
+
+// dht_loopback: node_count DHT nodes on 127.0.0.1 with the first one as everybody's bootstrap node. One node announces
+// an info hash, another one has to find it, and a node restarted from its state file has to find it again without
+// reaching its bootstrap node.
+int run_dht_loopback(int node_count)
+{
+	if (node_count < 3)
+		return -1;
+
+	auto state_dir = std::filesystem::temp_directory_path() / ("dht_loopback_" + std::to_string(getpid()));
+	std::filesystem::create_directories(state_dir);
+
+	auto state_file = [&state_dir](int index) { return (state_dir / ("node_" + std::to_string(index))).string(); };
+
+	std::vector<std::unique_ptr<DHT::Node>> nodes;
+	std::string bootstrap_node;
+
+	for (int index = 0; index < node_count; ++index)
+	{
+		auto node = std::make_unique<DHT::Node>(state_file(index));
+
+		// the first node never looks anything up, its bootstrap list only keeps it off the public routers
+		if (node->start("127.0.0.1", 0, {index == 0 ? "127.0.0.1:1" : bootstrap_node}) != 0)
+			return -1;
+
+		if (index == 0)
+			bootstrap_node = "127.0.0.1:" + std::to_string(node->port());
+
+		nodes.push_back(std::move(node));
+	}
+
+	// a second round lets the early nodes learn about the ones that joined after them
+	for (int round = 0; round < 2; ++round)
+	{
+		for (int index = 1; index < node_count; ++index)
+			nodes[index]->bootstrap();
+	}
+
+	std::string info_hash = Encoder::SHA_string("dht_loopback " + std::to_string(getpid()));
+	uint16_t announced_port = 51413;
+
+	auto has_announced_peer = [announced_port](const std::vector<Network::Peer>& peers) {
+		return std::any_of(peers.begin(), peers.end(), [announced_port](const Network::Peer& peer) {
+			return peer.address.to_string() == "127.0.0.1:" + std::to_string(announced_port);
+		});
+	};
+
+	nodes[1]->get_peers(info_hash, announced_port);
+	std::this_thread::sleep_for(std::chrono::milliseconds(200)); // announce_peer replies aren't waited for
+
+	int seeker = node_count - 1;
+	bool is_found = has_announced_peer(nodes[seeker]->get_peers(info_hash));
+	std::cout << "Node " << seeker << " " << (is_found ? "found" : "did NOT find") << " the peer node 1 announced\n";
+
+	// the restarted node gets a dead bootstrap node, only the routing table in its state file can lead it anywhere
+	std::string seeker_id = nodes[seeker]->id();
+	nodes[seeker]->stop();
+	nodes[seeker] = std::make_unique<DHT::Node>(state_file(seeker));
+
+	bool is_restarted = nodes[seeker]->start("127.0.0.1", 0, {"127.0.0.1:1"}) == 0;
+	size_t restored_nodes = nodes[seeker]->routing_table_size();
+	bool is_same_id = nodes[seeker]->id() == seeker_id;
+	bool is_found_again = is_restarted && has_announced_peer(nodes[seeker]->get_peers(info_hash));
+
+	std::cout << "Restarted node " << seeker << " loaded " << restored_nodes << " node(s), " << (is_same_id ? "kept" : "LOST") << " its id and "
+			  << (is_found_again ? "found" : "did NOT find") << " the peer again\n";
+
+	for (auto& node : nodes)
+		node->stop();
+
+	std::filesystem::remove_all(state_dir);
+
+	return is_found && is_restarted && restored_nodes > 0 && is_same_id && is_found_again ? 0 : -1;
+}
+
+// web_seed_loopback: serves a multi-file torrent from a local HTTP server and fetches every piece back through a web seed,
+// pieces that span file boundaries included. Done once against a server that answers Range requests and once against one
+// that ignores them and sends each whole file.
+int run_web_seed_loopback()
+{
+	Torrent::TorrentData torrent_data;
+	torrent_data.is_multi_file = true;
+	torrent_data.name = "web_seed_loopback";
+	torrent_data.piece_length = 16384;
+
+	// odd sizes so most pieces straddle a file, the empty file never gets a request
+	torrent_data.files = {{{"a.bin"}, 40000}, {{"empty"}, 0}, {{"sub", "b.bin"}, 1}, {{"sub", "c.bin"}, 30000}, {{"d.bin"}, 66001}};
+
+	std::string data;
+	std::map<std::string, std::string> file_data; // request path -> content
+	std::mt19937 generator(getpid());
+
+	for (const auto& file_info : torrent_data.files)
+	{
+		std::string content(file_info.length, '\0');
+		for (auto& byte : content)
+			byte = static_cast<char>(generator());
+
+		std::string path = "/" + torrent_data.name;
+		for (const auto& path_component : file_info.path)
+			path += "/" + path_component;
+
+		file_data[path] = content;
+		data += content;
+	}
+
+	torrent_data.length = data.size();
+	int piece_count = (torrent_data.length + torrent_data.piece_length - 1) / torrent_data.piece_length;
+
+	bool is_all_intact = true;
+
+	for (bool honours_range : {true, false})
+	{
+		httplib::Server server;
+		std::atomic<int> request_count = 0;
+		std::atomic<int64_t> bytes_served = 0;
+
+		server.Get("/" + torrent_data.name + "/.*", [&](const httplib::Request& req, httplib::Response& res) {
+			auto file = file_data.find(req.path);
+			if (file == file_data.end())
+			{
+				res.status = 404;
+				return;
+			}
+
+			++request_count;
+			res.set_content(file->second, "application/octet-stream");
+
+			// httplib turns an unset status into 206 and slices the body by the Range header, a set 200 sends it all
+			if (!honours_range)
+				res.status = 200;
+
+			bytes_served += honours_range && !req.ranges.empty() ? req.ranges[0].second - req.ranges[0].first + 1 : file->second.size();
+		});
+
+		int port = server.bind_to_any_port("127.0.0.1");
+		if (port < 0)
+			return -1;
+
+		std::thread server_thread([&server]() { server.listen_after_bind(); });
+		server.wait_until_ready();
+
+		WebSeed::Web_Seed web_seed("http://127.0.0.1:" + std::to_string(port) + "/");
+
+		int intact_pieces = 0, spanning_pieces = 0;
+		std::string piece;
+
+		for (int index = 0; index < piece_count; ++index)
+		{
+			int64_t offset = int64_t(index) * torrent_data.piece_length;
+			int64_t length = std::min<int64_t>(torrent_data.piece_length, torrent_data.length - offset);
+
+			if (WebSeed::map_range(torrent_data, web_seed.url(), offset, length).size() > 1)
+				++spanning_pieces;
+
+			if (web_seed.fetch_range(torrent_data, offset, length, piece) == 0 && piece.compare(0, std::string::npos, data, offset, length) == 0)
+				++intact_pieces;
+		}
+
+		// one range over the whole torrent, every file in a single fetch_range
+		bool is_whole_intact = web_seed.fetch_range(torrent_data, 0, torrent_data.length, piece) == 0 && piece == data;
+
+		server.stop();
+		server_thread.join();
+
+		bool is_intact = intact_pieces == piece_count && is_whole_intact;
+		is_all_intact = is_all_intact && is_intact;
+
+		std::cout << (honours_range ? "Range server: " : "Server without Range: ") << intact_pieces << " of " << piece_count << " pieces ("
+				  << spanning_pieces << " across files) and the whole torrent " << (is_whole_intact ? "intact" : "CORRUPT") << ", "
+				  << request_count << " requests, " << bytes_served << " bytes served, " << (is_intact ? "intact" : "CORRUPT") << "\n";
+	}
+
+	return is_all_intact ? 0 : -1;
+}
+
+// lsd_loopback: two LSD services on 127.0.0.1, each with its own random cookie, announce the same info hash for different
+// listen ports. Each has to add the other to its pool as a LAN peer, and drop its own announce when the multicast loops back.
+int run_lsd_loopback()
+{
+	std::string info_hash = Encoder::SHA_string("lsd_loopback " + std::to_string(getpid()));
+	const uint16_t listen_ports[2] = {51413, 51414};
+
+	Network::Peer_Pool pools[2];
+	LSD::Service services[2];
+
+	for (int index = 0; index < 2; ++index)
+	{
+		if (services[index].start("127.0.0.1") != 0)
+			return -1;
+	}
+
+	for (int index = 0; index < 2; ++index)
+		services[index].add_torrent(info_hash, &pools[index], listen_ports[index]);
+
+	for (auto& pool : pools)
+		pool.wait_for_peers(0, std::chrono::seconds(5));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200)); // the looped back own announces are in by then
+
+	for (auto& service : services)
+		service.stop();
+
+	bool is_passed = true;
+
+	for (int index = 0; index < 2; ++index)
+	{
+		std::string other_peer = "127.0.0.1:" + std::to_string(listen_ports[1 - index]);
+		bool is_found = false, is_self_added = false;
+
+		for (size_t peer_index = 0; peer_index < pools[index].size(); ++peer_index)
+		{
+			const Network::Peer& peer = pools[index][peer_index];
+
+			if (peer.address.to_string() == other_peer && peer.is_local)
+				is_found = true;
+			else if (peer.address.to_string() == "127.0.0.1:" + std::to_string(listen_ports[index]))
+				is_self_added = true;
+		}
+
+		std::cout << "Service " << index << " " << (is_found ? "found" : "did NOT find") << " " << other_peer << " as a LAN peer"
+				  << (is_self_added ? " and ADDED ITSELF" : "") << "\n";
+
+		is_passed = is_passed && is_found && !is_self_added;
+	}
+
+	return is_passed ? 0 : -1;
+}
+
+static int64_t cpu_time_us()
+{
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Writes piece_count synthetic pieces through a disk thread of the given backend, in the order a swarm completes them
+// (shuffled within windows of DISK_BENCH_WINDOW pieces), and reports syscalls and process CPU time per GiB. CPU time
+// includes filling the buffers, which costs the same for both backends.
+int run_disk_bench_backend(const std::string& out_file, int piece_count, int piece_len, bool use_io_uring, bool is_reported = true)
+{
+	const char* backend = use_io_uring ? "io_uring" : "pwritev";
+
+	DiskIo::Disk_Thread writer;
+	writer.start(DiskIo::Options{use_io_uring, DiskIo::default_options.sync_pieces});
+
+	if (use_io_uring && !writer.is_using_io_uring())
+	{
+		std::cout << backend << ": unavailable\n";
+		return 0;
+	}
+
+	Torrent::TorrentData torrent_data;
+	torrent_data.out_file = out_file;
+	torrent_data.piece_length = piece_len;
+	torrent_data.length = static_cast<int64_t>(piece_count) * piece_len;
+	torrent_data.piece_hashes.assign(piece_count, "");
+
+	if (torrent_data.storage.open(torrent_data) != 0)
+		return -1;
+
+	std::vector<int> order(piece_count);
+	std::iota(order.begin(), order.end(), 0);
+
+	std::mt19937 generator(piece_count);
+	for (int window = 0; window < piece_count; window += DISK_BENCH_WINDOW)
+		std::shuffle(order.begin() + window, order.begin() + std::min(window + DISK_BENCH_WINDOW, piece_count), generator);
+
+	std::atomic<int> completed = 0;
+	std::atomic<int> failed = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	int64_t cpu_start_us = cpu_time_us();
+
+	for (int piece_index : order)
+	{
+		BufferPool::Piece_Buffer buffer = BufferPool::piece_buffers().try_acquire(piece_len);
+		while (buffer.empty())
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			buffer = BufferPool::piece_buffers().try_acquire(piece_len);
+		}
+
+		std::fill_n(buffer.data(), piece_len, static_cast<char>(piece_index % 251));
+
+		writer.write_piece(torrent_data.storage, piece_index, std::move(buffer), [&](int result) {
+			if (result != 0)
+				++failed;
+
+			++completed;
+		});
+	}
+
+	while (completed < piece_count)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	double elapsed_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double cpu_ms = (cpu_time_us() - cpu_start_us) / 1000.0;
+	DiskIo::Stats stats = writer.stats();
+	writer.stop();
+
+	// read back after the clock stopped, every byte of a piece is its index mod 251
+	bool is_intact = failed == 0;
+	std::vector<char> piece_data(piece_len);
+
+	for (int piece_index = 0; piece_index < piece_count && is_intact; ++piece_index)
+	{
+		auto spans = torrent_data.storage.map_pieces(piece_index, piece_len);
+		is_intact = spans.size() == 1 && pread(spans[0].fd, piece_data.data(), piece_len, spans[0].file_offset) == piece_len
+					&& std::all_of(piece_data.begin(), piece_data.end(), [piece_index](char byte) { return byte == static_cast<char>(piece_index % 251); });
+	}
+
+	torrent_data.storage.close();
+
+	if (!is_reported)
+		return is_intact ? 0 : -1;
+
+	double gib = static_cast<double>(torrent_data.length) / (1024.0 * 1024 * 1024);
+	std::cout << backend << ": " << torrent_data.length / (1024 * 1024) << " MiB in " << static_cast<int64_t>(elapsed_sec * 1000) << " ms ("
+			  << static_cast<int64_t>(torrent_data.length / (1024 * 1024) / std::max(elapsed_sec, 0.001)) << " MiB/s), "
+			  << static_cast<int64_t>(stats.syscalls / gib) << " syscalls/GiB, " << static_cast<int64_t>(cpu_ms / gib) << " ms CPU/GiB, "
+			  << stats.pieces_written << " pieces in " << stats.runs_written << " writes, " << (is_intact ? "intact" : "CORRUPT") << "\n";
+
+	return is_intact ? 0 : -1;
+}
+
+// disk_bench: the same pieces written with pwritev and with io_uring, the file is removed afterwards
+int run_disk_bench(const std::string& out_file, int64_t size_mb, int piece_kb)
+{
+	int piece_len = piece_kb * 1024;
+	int piece_count = static_cast<int>(size_mb * 1024 / std::max(piece_kb, 1));
+
+	if (piece_len <= 0 || piece_count <= 0)
+		return -1;
+
+	// the first pass faults the pool's buffers in, whichever backend ran first would pay for that
+	int result = run_disk_bench_backend(out_file, piece_count, piece_len, false, false);
+	if (result == 0)
+		result = run_disk_bench_backend(out_file, piece_count, piece_len, false);
+
+	if (result == 0)
+		result = run_disk_bench_backend(out_file, piece_count, piece_len, true);
+
+	std::filesystem::remove(out_file);
+	return result;
+}
+
+// Takes the global options out of argv wherever they appear, so the positional args of every command stay where they
+// are. Rates are in KiB/s, --max-download-rate and --max-upload-rate limit the whole process. --max-piece-memory (MiB)
+// caps the buffers of the pieces being downloaded at once. --io-uring and --sync-pieces (no value) pick how the disk
+// thread writes pieces.
+int take_global_options(int& argc, char* argv[])
+{
+	int kept = 1;
+
+	for (int index = 1; index < argc; ++index)
+	{
+		std::string option = argv[index];
+
+		if (option == "--io-uring")
+		{
+			DiskIo::default_options.use_io_uring = true;
+			continue;
+		}
+
+		if (option == "--sync-pieces")
+		{
+			DiskIo::default_options.sync_pieces = true;
+			continue;
+		}
+
+		bool is_limit_option = option == "--max-download-rate" || option == "--max-upload-rate" || option == "--max-peer-download-rate"
+							   || option == "--max-peer-upload-rate" || option == "--max-piece-memory" || option == "--connect-timeout-ms"
+							   || option == "--max-half-open";
+
+		if (!is_limit_option)
+		{
+			argv[kept++] = argv[index];
+			continue;
+		}
+
+		if (index + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << option << std::endl;
+			return -1;
+		}
+
+		int64_t limit = std::stoll(argv[++index]);
+		int64_t bytes_per_sec = limit * 1024;
+
+		if (option == "--max-piece-memory")
+			BufferPool::piece_buffers().set_memory_cap(static_cast<size_t>(std::max<int64_t>(limit, 0)) * 1024 * 1024);
+		else if (option == "--connect-timeout-ms")
+			Downloader::connector.set_connect_timeout(std::chrono::milliseconds(std::max<int64_t>(limit, 1)));
+		else if (option == "--max-half-open")
+			Downloader::connector.set_max_half_open(static_cast<size_t>(std::max<int64_t>(limit, 1)));
+		else if (option == "--max-download-rate")
+			RateLimit::global_download().set_rate(bytes_per_sec);
+		else if (option == "--max-upload-rate")
+			RateLimit::global_upload().set_rate(bytes_per_sec);
+		else if (option == "--max-peer-download-rate")
+			peer_download_limit = bytes_per_sec;
+		else
+			peer_upload_limit = bytes_per_sec;
+	}
+
+	argc = kept;
+	return 0;
+}
+
+void apply_peer_limits(Torrent::TorrentData& torrent_data)
+{
+	torrent_data.peer_download_limit = peer_download_limit;
+	torrent_data.peer_upload_limit = peer_upload_limit;
+}
 
 int main(int argc, char *argv[])
 {
@@ -13,6 +631,12 @@ int main(int argc, char *argv[])
 	std::cout << std::unitbuf;
 	std::cerr << std::unitbuf;
 
+	// a peer closing the connection mid-upload must not kill us, sendfile() has no MSG_NOSIGNAL
+	std::signal(SIGPIPE, SIG_IGN);
+
+	if (take_global_options(argc, argv) != 0)
+		return 1;
+
 	if (argc < 2)
 	{
 		std::cerr << "Usage: " << argv[0] << " decode <encoded_value>" << std::endl;
@@ -100,10 +724,11 @@ int main(int argc, char *argv[])
 			return 1;
 		}
 
-		auto peers = Network::get_peers(torrent_data.info_hash, torrent_data.tracker, torrent_data.length);
+		// list the merged peers of every tracker, not just the first one to respond
+		torrent_data.announcer.wait_for_announces();
 
-		for (auto peer : peers)
-			std::cout << peer.value() << std::endl;
+		for (size_t i = 0; i < torrent_data.peers.size(); ++i)
+			std::cout << torrent_data.peers[i].value() << std::endl;
 	}
 	else if (command == "handshake")
 	{
@@ -117,7 +742,13 @@ int main(int argc, char *argv[])
 		}
 
 		Network::Peer peer;
-		if (Network::receive_peer_id_with_handshake(torrent_data, argv[3], peer) != 0)
+		if (!Network::Peer_Address::from_string(argv[3], peer.address))
+		{
+			std::cerr << "Invalid peer address: " << argv[3] << std::endl;
+			return 1;
+		}
+
+		if (Network::receive_peer_id_with_handshake(torrent_data, peer) != 0)
 		{
 			std::cerr << "Failed to receive peer id" << std::endl;
 			return 1;
@@ -141,6 +772,12 @@ int main(int argc, char *argv[])
 		if (command == "download_piece")
 			piece_index = std::stoi(argv[5]);
 
+		torrent_data.listener = start_peer_listener();
+		torrent_data.utp = start_utp_socket(torrent_data.listener);
+		torrent_data.dht = start_dht_node();
+		torrent_data.lsd = start_lsd_service();
+		apply_peer_limits(torrent_data);
+
 		if (Torrent::read_torrent_file(torrent_file, torrent_data) != 0)
 		{
 			std::cerr << "Failed to read torrent file: " << torrent_file << std::endl;
@@ -155,6 +792,98 @@ int main(int argc, char *argv[])
 			return 1;
 		}
 	}
+	else if (command == "seed" || command == "super_seed")
+	{
+		if (argc < 5)
+		{
+			std::cerr << "Usage: " << argv[0] << " " << command << " -i <data_path> <torrent_file>" << std::endl;
+			return 1;
+		}
+
+		std::signal(SIGINT, handle_stop_signal);
+		std::signal(SIGTERM, handle_stop_signal);
+
+		Torrent::TorrentData torrent_data;
+		std::string torrent_file = argv[4];
+
+		torrent_data.listener = start_peer_listener();
+		torrent_data.utp = start_utp_socket(torrent_data.listener);
+		torrent_data.dht = start_dht_node();
+		torrent_data.lsd = start_lsd_service();
+		apply_peer_limits(torrent_data);
+
+		if (Torrent::read_torrent_file(torrent_file, torrent_data) != 0)
+		{
+			std::cerr << "Failed to read torrent file: " << torrent_file << std::endl;
+			return 1;
+		}
+
+		torrent_data.out_file = argv[3]; // seeding reads the data from where a download would have written it
+
+		if (Upload::seed_torrent(torrent_data, command == "super_seed", is_running) != 0)
+		{
+			std::cerr << "Failed to seed torrent file: " << torrent_file << std::endl;
+			return 1;
+		}
+	}
+	else if (command == "utp_loopback")
+	{
+		if (argc < 5)
+		{
+			std::cerr << "Usage: " << argv[0] << " utp_loopback <bytes> <delay_ms> <loss_percent>" << std::endl;
+			return 1;
+		}
+
+		if (run_utp_loopback(std::stoull(argv[2]), std::chrono::milliseconds(std::stoi(argv[3])), std::stod(argv[4]) / 100) != 0)
+		{
+			std::cerr << "uTP loopback transfer failed" << std::endl;
+			return 1;
+		}
+	}
+	else if (command == "dht_loopback")
+	{
+		if (argc < 3)
+		{
+			std::cerr << "Usage: " << argv[0] << " dht_loopback <nodes>" << std::endl;
+			return 1;
+		}
+
+		if (run_dht_loopback(std::stoi(argv[2])) != 0)
+		{
+			std::cerr << "DHT loopback swarm failed" << std::endl;
+			return 1;
+		}
+	}
+	else if (command == "lsd_loopback")
+	{
+		if (run_lsd_loopback() != 0)
+		{
+			std::cerr << "LSD loopback discovery failed" << std::endl;
+			return 1;
+		}
+	}
+	else if (command == "web_seed_loopback")
+	{
+		if (run_web_seed_loopback() != 0)
+		{
+			std::cerr << "Web seed loopback failed" << std::endl;
+			return 1;
+		}
+	}
+	else if (command == "disk_bench")
+	{
+		if (argc < 5)
+		{
+			std::cerr << "Usage: " << argv[0] << " disk_bench <output_file> <size_mb> <piece_kb>" << std::endl;
+			return 1;
+		}
+
+		if (run_disk_bench(argv[2], std::stoll(argv[3]), std::stoi(argv[4])) != 0)
+		{
+			std::cerr << "Disk benchmark failed" << std::endl;
+			return 1;
+		}
+	}
 	else if (command == "magnet_parse")
 	{
 		Torrent::TorrentData torrent_data;
@@ -166,6 +895,11 @@ int main(int argc, char *argv[])
 	else if (command == "magnet_handshake" || command == "magnet_info" || command == "magnet_download_piece" || command == "magnet_download")
 	{
 		Torrent::TorrentData torrent_data;
+		torrent_data.listener = start_peer_listener();
+		torrent_data.utp = start_utp_socket(torrent_data.listener);
+		torrent_data.dht = start_dht_node(); // magnet links often come without a working tracker
+		torrent_data.lsd = start_lsd_service();
+		apply_peer_limits(torrent_data);
 		Magnet::parse_magnet_link(command == "magnet_download_piece" || command == "magnet_download" ? argv[4] : argv[2], torrent_data);
 
 		if (torrent_data.peers.empty()) {
@@ -174,7 +908,7 @@ int main(int argc, char *argv[])
 		}
 
 		Network::Peer &peer = torrent_data.peers[0];
-		if (Network::receive_peer_id_with_handshake(torrent_data, peer.value(), peer) != 0)
+		if (Network::receive_peer_id_with_handshake(torrent_data, peer) != 0)
 		{
 			std::cerr << "Failed to receive peer id" << std::endl;
 			return 1;
@@ -24,6 +24,9 @@ namespace Decoder
 
 	json decode_bencoded_value(const std::string &encoded_value, size_t& position)
 	{
+		if (position >= encoded_value.size())
+			throw std::runtime_error("Truncated encoded value");
+
 		if (std::isdigit(encoded_value[position]))
 		{
 			return decode_bencoded_string(encoded_value, position);
@@ -57,6 +60,10 @@ namespace Decoder
 			{
 				std::string string_len_str = encoded_value.substr(position, colon_index - position);
 				int64_t str_len = std::atoll(string_len_str.c_str());
+
+				if (str_len < 0 || colon_index + 1 + str_len > encoded_value.size())
+					throw std::runtime_error("Truncated encoded string");
+
 				std::string str = encoded_value.substr(colon_index + 1, str_len);
 				position = colon_index + 1 + str_len;
 
@@ -79,6 +86,9 @@ namespace Decoder
 		{
 			++position; // 'i'
 			auto e_pos = encoded_value.find('e', position);
+			if (e_pos == std::string::npos)
+				throw std::runtime_error("Truncated encoded int");
+
 			std::string number_string = encoded_value.substr(position, e_pos - position);
 			int64_t number = std::atoll(number_string.c_str());
 			position = e_pos + 1;
@@ -96,9 +106,12 @@ namespace Decoder
 		++position; // 'l'
 
 		json list = json::array();
-		while (encoded_value[position] != 'e')
+		while (position < encoded_value.size() && encoded_value[position] != 'e')
 			list.push_back(decode_bencoded_value(encoded_value, position));
 
+		if (position >= encoded_value.size())
+			throw std::runtime_error("Truncated encoded list");
+
 		++position; // 'e'
 		return list;
 	}
@@ -108,14 +121,20 @@ namespace Decoder
 		++position; // 'd'
 
 		json obj = json::object();
-		while (encoded_value[position] != 'e')
+		while (position < encoded_value.size() && encoded_value[position] != 'e')
 		{
 			json key = decode_bencoded_value(encoded_value, position);
 			json value = decode_bencoded_value(encoded_value, position);
 
-			obj[key] = value;
+			if (!key.is_string())
+				throw std::runtime_error("Dictionary key is not a string");
+
+			obj[key.get<std::string>()] = value;
 		}
 
+		if (position >= encoded_value.size())
+			throw std::runtime_error("Truncated encoded dict");
+
 		++position; // 'e'
 		return obj;
 	}
@@ -170,7 +189,7 @@ namespace Encoder
 		}
 		else if (j.is_number_integer())
 		{
-			os << 'i' << j.get<int>() << 'e';
+			os << 'i' << j.get<int64_t>() << 'e';
 		}
 		else if (j.is_string())
 		{
@@ -181,10 +200,10 @@ namespace Encoder
 		return os.str();
 	}
 
-	std::string SHA_string(const std::string& data)
+	std::string SHA_string(std::string_view data)
 	{
 		std::string hash(20, '\0');
-		SHA1((unsigned char*)data.c_str(), data.size(), (unsigned char*)hash.data());
+		SHA1((const unsigned char*)data.data(), data.size(), (unsigned char*)hash.data());
 
 		return hash;
 	}
@@ -267,6 +286,41 @@ namespace Torrent
 		std::cerr << "Warning: No announce field found in torrent" << std::endl;
 		torrent_data.tracker = ""; // Empty tracker
 	}
+
+	// BEP 12: announce-list is a list of tiers, each tier a list of tracker urls
+	if (decoded_data.contains("announce-list") && decoded_data["announce-list"].is_array()) {
+		for (const auto& tier : decoded_data["announce-list"]) {
+			if (!tier.is_array())
+				continue;
+
+			std::vector<std::string> tier_urls;
+			for (const auto& url : tier) {
+				if (url.is_string())
+					tier_urls.push_back(url.get<std::string>());
+			}
+
+			if (!tier_urls.empty())
+				torrent_data.announce_list.push_back(std::move(tier_urls));
+		}
+	}
+
+	// BEP 19: url-list is either a single url or a list of them
+	if (decoded_data.contains("url-list")) {
+		const auto& url_list = decoded_data["url-list"];
+
+		if (url_list.is_string() && !url_list.get<std::string>().empty())
+			torrent_data.url_list.push_back(url_list.get<std::string>());
+		else if (url_list.is_array()) {
+			for (const auto& url : url_list) {
+				if (url.is_string() && !url.get<std::string>().empty())
+					torrent_data.url_list.push_back(url.get<std::string>());
+			}
+		}
+	}
+
+	if (torrent_data.tracker.empty() && !torrent_data.announce_list.empty()) {
+		torrent_data.tracker = torrent_data.announce_list.front().front();
+	}
 		
 		nlohmann::json info_dict = decoded_data["info"];
 	
@@ -312,11 +366,7 @@ namespace Torrent
 	torrent_data.piece_length = info_dict["piece length"];
 	torrent_data.piece_hashes = std::move(Decoder::get_pieces_list_from_json(decoded_data["info"]["pieces"]));
 	
-	if (!torrent_data.tracker.empty()) {
-		torrent_data.peers = Network::get_peers(torrent_data.info_hash, torrent_data.tracker, torrent_data.length);
-	} else {
-		std::cerr << "Warning: No tracker, skipping peer discovery" << std::endl;
-	}
+	torrent_data.announcer.announce_to_all(torrent_data, std::chrono::milliseconds(TRACKER_TIMEOUT_MS));
 
 	return 0;
 	}
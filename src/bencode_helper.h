@@ -4,12 +4,22 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cctype>
 #include <cstdlib>
+#include <atomic>
 #include <openssl/sha.h>
 
 #include "lib/nlohmann/json.hpp"
+#include "peer_pool.h"
+#include "tracker.h"
+#include "storage.h"
+#include "choker.h"
+#include "super_seed.h"
+#include "rate_limiter.h"
+
+#include <memory>
 
 using json = nlohmann::json;
 
@@ -34,7 +44,7 @@ namespace Encoder
 {
 	std::string json_to_bencode(const json& j);
 
-	std::string SHA_string(const std::string& data);
+	std::string SHA_string(std::string_view data);
 
 	std::string hash_to_hex(const std::string& hash);
 
@@ -48,9 +58,24 @@ namespace Encoder
 
 }
 
-namespace Network
+namespace DHT
+{
+	class Node;
+}
+
+namespace LSD
+{
+	class Service;
+}
+
+namespace Listener
 {
-	struct Peer;
+	class Peer_Listener;
+}
+
+namespace Utp
+{
+	class Utp_Socket;
 }
 
 namespace Torrent
@@ -65,17 +90,41 @@ namespace Torrent
 	{
 		std::string out_file;
 		std::string tracker;
+		std::vector<std::vector<std::string>> announce_list; // BEP 12 tiers of tracker urls
+		std::vector<std::string> url_list; // BEP 19 web seeds
 		int length = 0;
 		std::string info_hash;
 		int piece_length = 0;
 		std::vector<std::string> piece_hashes;
-		std::vector<Network::Peer> peers;
+		Network::Peer_Pool peers;
 		bool is_magnet_download = false;
+
+		// transfer counters reported to the trackers
+		std::atomic<int64_t> uploaded = 0;   // payload bytes sent to peers
+		std::atomic<int64_t> downloaded = 0; // payload bytes received from peers, including pieces that failed the hash check
+		std::atomic<int64_t> verified = 0;   // bytes of pieces that passed the hash check and are on disk
+
+		// bandwidth limits of this torrent below the process wide ones, and of each of its connections (bytes/s, 0 = unlimited)
+		RateLimit::Token_Bucket download_bucket{&RateLimit::global_download()};
+		RateLimit::Token_Bucket upload_bucket{&RateLimit::global_upload()};
+		std::atomic<int64_t> peer_download_limit = 0;
+		std::atomic<int64_t> peer_upload_limit = 0;
 		
 		// Multi-file torrent support
 		bool is_multi_file = false;
 		std::vector<FileInfo> files;  // list of files in multi-file torrent
 		std::string name;             // torrent name (directory name for multi-file)
+
+		Storage::File_Storage storage; // output file(s), verified pieces are readable for uploads right away
+		Choker::Choker choker;         // decides which incoming peers we upload to
+		SuperSeed::Super_Seeder super_seeder; // only enabled by the super_seed command
+
+		std::shared_ptr<DHT::Node> dht; // optional trackerless peer source, shared by every torrent of the process
+		std::shared_ptr<LSD::Service> lsd; // optional LAN peer source, shared like dht
+		std::shared_ptr<Listener::Peer_Listener> listener; // accepts incoming connections while the download runs
+		std::shared_ptr<Utp::Utp_Socket> utp; // optional second transport, tried before TCP and accepting into listener
+
+		Tracker::Announcer announcer; // declared after peers, joins the announce threads that fill them
 	};
 
 	int read_torrent_file(const std::string& torrent_file, TorrentData& torrent_data);
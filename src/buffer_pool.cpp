@@ -0,0 +1,170 @@
+
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <bit>
+#include <iostream>
+#include <utility>
+#include <sys/mman.h>
+
+namespace BufferPool
+{
+	Piece_Buffer::Piece_Buffer(Piece_Buffer&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	Piece_Buffer& Piece_Buffer::operator=(Piece_Buffer&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+
+			pool = std::exchange(other.pool, nullptr);
+			memory = std::exchange(other.memory, nullptr);
+			len = std::exchange(other.len, 0);
+			slot_size = std::exchange(other.slot_size, 0);
+		}
+
+		return *this;
+	}
+
+	Piece_Buffer::~Piece_Buffer()
+	{
+		reset();
+	}
+
+	void Piece_Buffer::reset()
+	{
+		if (memory)
+			pool->release(memory, slot_size);
+
+		pool = nullptr;
+		memory = nullptr;
+		len = 0;
+		slot_size = 0;
+	}
+
+	Pool::~Pool()
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		trim(0);
+	}
+
+	void Pool::set_memory_cap(size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+
+		cap_bytes = bytes;
+		trim(std::max(cap_bytes, in_use_bytes));
+	}
+
+	size_t Pool::memory_cap() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return cap_bytes;
+	}
+
+	Piece_Buffer Pool::try_acquire(size_t len)
+	{
+		Piece_Buffer buffer;
+
+		if (len == 0)
+			return buffer;
+
+		size_t slot_size = std::bit_ceil(len);
+
+		std::unique_lock<std::mutex> lock(pool_mutex);
+
+		if (in_use_bytes > 0 && in_use_bytes + slot_size > cap_bytes)
+			return buffer;
+
+		auto& free_list = free_buffers[slot_size];
+		char* memory = nullptr;
+
+		if (!free_list.empty())
+		{
+			memory = free_list.back();
+			free_list.pop_back();
+		}
+		else
+		{
+			// a new size class takes the room of free buffers of the others
+			trim(cap_bytes > slot_size ? cap_bytes - slot_size : 0);
+
+			void* mapped = mmap(nullptr, slot_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mapped == MAP_FAILED)
+			{
+				std::cerr << "Failed to map a piece buffer of " << slot_size << " bytes" << std::endl;
+				return buffer;
+			}
+
+			// fewer TLB misses while blocks are copied in and the piece is hashed, the kernel ignores it where unsupported
+			if (slot_size >= PIECE_BUFFER_HUGE_PAGE)
+				madvise(mapped, slot_size, MADV_HUGEPAGE);
+
+			memory = static_cast<char*>(mapped);
+			reserved_bytes += slot_size;
+		}
+
+		in_use_bytes += slot_size;
+
+		buffer.pool = this;
+		buffer.memory = memory;
+		buffer.len = len;
+		buffer.slot_size = slot_size;
+
+		return buffer;
+	}
+
+	size_t Pool::in_use() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return in_use_bytes;
+	}
+
+	size_t Pool::reserved() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return reserved_bytes;
+	}
+
+	uint64_t Pool::mapping_generation() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return unmap_generation;
+	}
+
+	void Pool::release(char* memory, size_t slot_size)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+
+		in_use_bytes -= slot_size;
+		free_buffers[slot_size].push_back(memory);
+
+		// the cap may have been lowered while the buffer was in use
+		if (reserved_bytes > cap_bytes)
+			trim(std::max(cap_bytes, in_use_bytes));
+	}
+
+	void Pool::trim(size_t wanted_reserved)
+	{
+		for (auto& [slot_size, free_list] : free_buffers)
+		{
+			while (reserved_bytes > wanted_reserved && !free_list.empty())
+			{
+				munmap(free_list.back(), slot_size);
+				free_list.pop_back();
+				reserved_bytes -= slot_size;
+				++unmap_generation;
+			}
+		}
+	}
+
+	Pool& piece_buffers()
+	{
+		// never destroyed: pieces left in static work queues give their buffers back during static destruction
+		static Pool* pool = new Pool();
+		return *pool;
+	}
+}
@@ -0,0 +1,97 @@
+
+#ifndef _BUFFER_POOL_H_
+#define _BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#define PIECE_MEMORY_DEFAULT_MB 256             // pieces being downloaded at once may hold this much memory
+#define PIECE_BUFFER_HUGE_PAGE (2 * 1024 * 1024) // buffers this large are backed by transparent huge pages
+
+namespace BufferPool
+{
+	class Pool;
+
+	// Memory for one piece, taken from a Pool and given back to it when the buffer is destroyed or reset.
+	// Move-only, an empty buffer holds nothing. The contents are whatever the previous piece left there.
+	class Piece_Buffer
+	{
+	public:
+		Piece_Buffer() = default;
+
+		Piece_Buffer(Piece_Buffer&& other) noexcept;
+
+		Piece_Buffer& operator=(Piece_Buffer&& other) noexcept;
+
+		~Piece_Buffer();
+
+		char* data() { return memory; }
+
+		const char* data() const { return memory; }
+
+		size_t size() const { return len; }
+
+		size_t capacity() const { return slot_size; } // of the memory behind it, the whole of it may be registered for I/O
+
+		bool empty() const { return memory == nullptr; }
+
+		std::string_view view() const { return std::string_view(memory, len); }
+
+		void reset();
+
+	private:
+		friend class Pool;
+
+		Pool* pool = nullptr;
+		char* memory = nullptr;
+		size_t len = 0;
+		size_t slot_size = 0; // what the memory behind it really is, len rounded up to its size class
+	};
+
+	// Fixed set of piece sized buffers with a cap on the memory the ones in use may hold. Released buffers are kept
+	// mapped for the next piece instead of going back to the allocator, so a download's memory stays flat at the cap
+	// no matter how many peers feed it. Buffers come in power of two size classes, the short last piece of a torrent
+	// reuses a regular one, and free buffers of another class are unmapped when a new class needs the room.
+	class Pool
+	{
+	public:
+		~Pool();
+
+		void set_memory_cap(size_t bytes);
+
+		size_t memory_cap() const;
+
+		// A buffer of len bytes, an empty one when it would take the memory in use past the cap. A single buffer is
+		// always handed out even if it is larger than the cap on its own, a piece mustn't become impossible to download.
+		Piece_Buffer try_acquire(size_t len);
+
+		size_t in_use() const; // bytes of the buffers handed out
+
+		size_t reserved() const; // bytes mapped, in use or kept for reuse
+
+		// Goes up whenever a buffer is unmapped, registrations of buffer addresses made before (io_uring fixed buffers) are stale
+		uint64_t mapping_generation() const;
+
+	private:
+		friend class Piece_Buffer;
+
+		void release(char* memory, size_t slot_size);
+
+		void trim(size_t wanted_reserved); // unmaps free buffers until at most wanted_reserved stays mapped, needs pool_mutex
+
+		std::map<size_t, std::vector<char*>> free_buffers; // size class -> buffers nobody uses
+		size_t in_use_bytes = 0;
+		size_t reserved_bytes = 0;
+		uint64_t unmap_generation = 0;
+		size_t cap_bytes = static_cast<size_t>(PIECE_MEMORY_DEFAULT_MB) * 1024 * 1024;
+		mutable std::mutex pool_mutex;
+	};
+
+	Pool& piece_buffers(); // process wide, shared by every torrent's downloads
+}
+
+#endif
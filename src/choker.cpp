@@ -0,0 +1,278 @@
+
+#include "choker.h"
+#include "bencode_helper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace Choker
+{
+	int slots_for_upload_limit(int64_t upload_limit)
+	{
+		if (upload_limit <= 0)
+			return CHOKER_DEFAULT_SLOTS;
+
+		int slots = static_cast<int>(std::sqrt(upload_limit / 1024.0 * 0.6));
+		return std::clamp(slots, 2, CHOKER_MAX_SLOTS);
+	}
+
+	Choker::~Choker()
+	{
+		stop();
+	}
+
+	void Choker::start(const Torrent::TorrentData* torrent_data)
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+
+		this->torrent_data = torrent_data;
+		is_stopping = false;
+		last_round = std::chrono::steady_clock::now();
+		follow_upload_limit();
+
+		choker_thread = std::thread(&Choker::choke_loop, this);
+	}
+
+	void Choker::stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(choker_mutex);
+			is_stopping = true;
+			choker_cv.notify_all();
+		}
+
+		if (choker_thread.joinable())
+			choker_thread.join();
+	}
+
+	void Choker::set_upload_slots(int slots)
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+		upload_slots = std::clamp(slots, 1, CHOKER_MAX_SLOTS);
+	}
+
+	void Choker::follow_upload_limit()
+	{
+		// only a changed limit resizes the slots, set_upload_slots() holds until then
+		int64_t upload_limit = torrent_data->upload_bucket.effective_rate();
+		if (upload_limit == applied_upload_limit)
+			return;
+
+		applied_upload_limit = upload_limit;
+		upload_slots = slots_for_upload_limit(upload_limit);
+	}
+
+	int Choker::add_connection(const Network::Peer_Address& address)
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+
+		int connection_id = next_connection_id++;
+		connections[connection_id].address = address;
+
+		return connection_id;
+	}
+
+	void Choker::remove_connection(int connection_id)
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+		connections.erase(connection_id);
+
+		if (optimistic_id == connection_id)
+			optimistic_id = -1;
+	}
+
+	void Choker::set_interested(int connection_id, bool is_interested)
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		if (connection_it == connections.end())
+			return;
+
+		auto& connection = connection_it->second;
+		connection.is_interested = is_interested;
+
+		if (!is_interested)
+		{
+			// its slot goes to the next best peer in the coming round
+			connection.is_choked = true;
+			return;
+		}
+
+		int unchoked = std::count_if(connections.begin(), connections.end(), [](const auto& entry) { return !entry.second.is_choked; });
+		if (unchoked < upload_slots)
+			connection.is_choked = false;
+	}
+
+	bool Choker::is_choked(int connection_id) const
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		return connection_it == connections.end() || connection_it->second.is_choked;
+	}
+
+	void Choker::record_upload(int connection_id, int64_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		if (connection_it != connections.end())
+			connection_it->second.uploaded += bytes;
+	}
+
+	void Choker::record_download(const Network::Peer_Address& address, int64_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+
+		auto& stats = host_stats[host_key(address)];
+		stats.downloaded += bytes;
+		stats.last_received = std::chrono::steady_clock::now();
+	}
+
+	std::string Choker::host_key(const Network::Peer_Address& address)
+	{
+		auto compact = address.to_compact();
+		return compact.substr(0, compact.size() - 2);
+	}
+
+	bool Choker::is_snubbed(const Connection_State& connection) const
+	{
+		auto stats_it = host_stats.find(host_key(connection.address));
+
+		// only a peer that did send us data and then stopped is snubbing us, one we never downloaded from isn't
+		if (stats_it == host_stats.end() || stats_it->second.last_received == std::chrono::steady_clock::time_point{})
+			return false;
+
+		return std::chrono::steady_clock::now() - stats_it->second.last_received > std::chrono::seconds(CHOKER_SNUB_TIMEOUT_SEC);
+	}
+
+	void Choker::choke_loop()
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+		auto last_optimistic = std::chrono::steady_clock::now() - std::chrono::seconds(CHOKER_OPTIMISTIC_INTERVAL_SEC);
+
+		while (!is_stopping)
+		{
+			choker_cv.wait_for(lock, std::chrono::seconds(CHOKER_INTERVAL_SEC), [this]() { return is_stopping; });
+
+			if (is_stopping)
+				break;
+
+			auto now = std::chrono::steady_clock::now();
+			bool rotate_optimistic = now - last_optimistic >= std::chrono::seconds(CHOKER_OPTIMISTIC_INTERVAL_SEC);
+
+			if (rotate_optimistic)
+				last_optimistic = now;
+
+			follow_upload_limit();
+			rechoke(rotate_optimistic);
+
+			if (connections.empty())
+				continue;
+
+			lock.unlock();
+			auto round_metrics = metrics();
+			std::cout << "Choker: " << round_metrics.unchoked << "/" << round_metrics.connections << " unchoked, "
+					  << round_metrics.interested << " interested, " << round_metrics.snubbed << " snubbed, "
+					  << round_metrics.upload_slots << " slots, optimistic: " << (round_metrics.optimistic_peer.empty() ? "none" : round_metrics.optimistic_peer) << "\n";
+			lock.lock();
+		}
+	}
+
+	void Choker::rechoke(bool rotate_optimistic)
+	{
+		auto now = std::chrono::steady_clock::now();
+		double round_sec = std::max(1.0, std::chrono::duration<double>(now - last_round).count());
+		last_round = now;
+
+		for (auto& [connection_id, connection] : connections)
+		{
+			connection.upload_rate = static_cast<int64_t>(connection.uploaded / round_sec);
+			connection.uploaded = 0;
+		}
+
+		for (auto& [host, stats] : host_stats)
+		{
+			stats.download_rate = static_cast<int64_t>(stats.downloaded / round_sec);
+			stats.downloaded = 0;
+		}
+
+		bool is_seeding = torrent_data != nullptr && torrent_data->length > 0 && torrent_data->verified >= torrent_data->length;
+
+		auto rate_of = [this, is_seeding](const Connection_State& connection) -> int64_t {
+			if (is_seeding)
+				return connection.upload_rate;
+
+			auto stats_it = host_stats.find(host_key(connection.address));
+			return stats_it == host_stats.end() ? 0 : stats_it->second.download_rate;
+		};
+
+		// regular slots: interested, not snubbing us, best rate first
+		std::vector<int> candidates;
+		for (const auto& [connection_id, connection] : connections)
+		{
+			if (connection.is_interested && !is_snubbed(connection))
+				candidates.push_back(connection_id);
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [this, &rate_of](int first, int second) {
+			return rate_of(connections.at(first)) > rate_of(connections.at(second));
+		});
+
+		int regular_slots = std::max(upload_slots - 1, 1); // one slot is kept for the optimistic unchoke
+
+		for (auto& [connection_id, connection] : connections)
+			connection.is_choked = true;
+
+		for (int index = 0; index < static_cast<int>(candidates.size()) && index < regular_slots; ++index)
+			connections.at(candidates[index]).is_choked = false;
+
+		// optimistic unchoke: a random interested peer that didn't make the cut, so new peers get a chance to prove themselves
+		if (optimistic_id >= 0 && (!connections.contains(optimistic_id) || !connections.at(optimistic_id).is_interested))
+			optimistic_id = -1;
+
+		if (rotate_optimistic || optimistic_id < 0)
+		{
+			std::vector<int> choked_interested;
+			for (const auto& [connection_id, connection] : connections)
+			{
+				if (connection.is_interested && connection.is_choked)
+					choked_interested.push_back(connection_id);
+			}
+
+			if (!choked_interested.empty())
+			{
+				static thread_local std::mt19937 rng(std::random_device{}());
+				optimistic_id = choked_interested[rng() % choked_interested.size()];
+			}
+			else if (rotate_optimistic)
+				optimistic_id = -1;
+		}
+
+		if (optimistic_id >= 0)
+			connections.at(optimistic_id).is_choked = false;
+	}
+
+	Metrics Choker::metrics() const
+	{
+		std::unique_lock<std::mutex> lock(choker_mutex);
+		Metrics choke_metrics;
+
+		choke_metrics.connections = connections.size();
+		choke_metrics.upload_slots = upload_slots;
+
+		for (const auto& [connection_id, connection] : connections)
+		{
+			choke_metrics.interested += connection.is_interested;
+			choke_metrics.unchoked += !connection.is_choked;
+			choke_metrics.snubbed += is_snubbed(connection);
+		}
+
+		if (optimistic_id >= 0 && connections.contains(optimistic_id))
+			choke_metrics.optimistic_peer = connections.at(optimistic_id).address.to_string();
+
+		return choke_metrics;
+	}
+}
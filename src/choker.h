@@ -0,0 +1,117 @@
+
+#ifndef _CHOKER_H_
+#define _CHOKER_H_
+
+#include "network_helper.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#define CHOKER_INTERVAL_SEC 10             // regular unchoke slots are re-evaluated this often
+#define CHOKER_OPTIMISTIC_INTERVAL_SEC 30  // the optimistic unchoke rotates this often
+#define CHOKER_SNUB_TIMEOUT_SEC 60         // a peer that stops sending us data for this long loses its regular slot
+#define CHOKER_DEFAULT_SLOTS 4             // unchoke slots without an upload limit, one of them optimistic
+#define CHOKER_MAX_SLOTS 20
+
+namespace Torrent
+{
+	struct TorrentData;
+}
+
+namespace Choker
+{
+	// Snapshot of the choke state, printed every round so the slot count can be tuned
+	struct Metrics
+	{
+		int connections = 0;
+		int interested = 0;
+		int unchoked = 0;
+		int snubbed = 0;
+		int upload_slots = 0;
+		std::string optimistic_peer; // empty when no optimistic unchoke is active
+	};
+
+	// Slots for an upload limit in bytes/s, 0 means unlimited (mainline's sqrt(kB/s * 0.6) rule)
+	int slots_for_upload_limit(int64_t upload_limit);
+
+	// Tit-for-tat choker for the connections we upload to: every 10s the interested peers with the best
+	// rate (download rate from them while leeching, upload rate to them while seeding) get the regular
+	// slots, and every 30s one more choked peer is unchoked optimistically. Connections poll is_choked().
+	class Choker
+	{
+	public:
+		~Choker();
+
+		void start(const Torrent::TorrentData* torrent_data);
+
+		void stop();
+
+		void set_upload_slots(int slots);
+
+		void set_upload_limit(int64_t upload_limit) { set_upload_slots(slots_for_upload_limit(upload_limit)); }
+
+		int add_connection(const Network::Peer_Address& address); // returns an id for the calls below
+
+		void remove_connection(int connection_id);
+
+		// a newly interested peer is unchoked right away when a slot is free instead of waiting for the next round
+		void set_interested(int connection_id, bool is_interested);
+
+		bool is_choked(int connection_id) const;
+
+		void record_upload(int connection_id, int64_t bytes);
+
+		// Bytes received on our own connections to this host, the host is the same peer whatever port it uses
+		void record_download(const Network::Peer_Address& address, int64_t bytes);
+
+		Metrics metrics() const;
+
+	private:
+		struct Connection_State
+		{
+			Network::Peer_Address address;
+			bool is_interested = false;
+			bool is_choked = true;
+			int64_t uploaded = 0;        // since the last round
+			int64_t upload_rate = 0;     // bytes/s over the last round
+		};
+
+		struct Host_Stats
+		{
+			int64_t downloaded = 0;      // since the last round
+			int64_t download_rate = 0;   // bytes/s over the last round
+			std::chrono::steady_clock::time_point last_received{};
+		};
+
+		void choke_loop();
+
+		void rechoke(bool rotate_optimistic); // needs choker_mutex
+
+		bool is_snubbed(const Connection_State& connection) const; // needs choker_mutex
+
+		void follow_upload_limit(); // needs choker_mutex, the slots follow the torrent's upload limit as it changes
+
+		static std::string host_key(const Network::Peer_Address& address); // address without the port
+
+		const Torrent::TorrentData* torrent_data = nullptr;
+		int upload_slots = CHOKER_DEFAULT_SLOTS;
+		int64_t applied_upload_limit = 0; // the limit upload_slots was last derived from
+
+		std::unordered_map<int, Connection_State> connections;
+		std::unordered_map<std::string, Host_Stats> host_stats;
+		int next_connection_id = 0;
+		int optimistic_id = -1;
+		std::chrono::steady_clock::time_point last_round{};
+
+		mutable std::mutex choker_mutex;
+		std::condition_variable choker_cv;
+		bool is_stopping = false;
+		std::thread choker_thread;
+	};
+}
+
+#endif
@@ -0,0 +1,250 @@
+
+#include "connector.h"
+#include "peer_pool.h"
+#include "utp.h"
+
+#include <algorithm>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+
+namespace Network
+{
+	Connector::~Connector()
+	{
+		stop();
+	}
+
+	void Connector::start(Peer_Pool* peer_pool, Utp::Utp_Socket* utp_socket)
+	{
+		if (is_running)
+			return;
+
+		this->peer_pool = peer_pool;
+		this->utp_socket = utp_socket;
+		is_running = true;
+		connect_thread = std::thread(&Connector::connect_loop, this);
+	}
+
+	void Connector::stop()
+	{
+		if (!is_running)
+			return;
+
+		is_running = false;
+		connector_cv.notify_all();
+
+		if (connect_thread.joinable())
+			connect_thread.join();
+
+		for (const auto& attempt : attempts)
+		{
+			drop_attempt(attempt);
+			peer_pool->release(attempt.peer_index);
+		}
+
+		for (const auto& connection : established)
+		{
+			close(connection.peer_socket);
+			peer_pool->release(connection.peer_index);
+		}
+
+		attempts.clear();
+		established.clear();
+	}
+
+	void Connector::set_connect_timeout(std::chrono::milliseconds timeout)
+	{
+		std::unique_lock<std::mutex> lock(connector_mutex);
+		connect_timeout = timeout;
+	}
+
+	void Connector::set_max_half_open(size_t max_half_open)
+	{
+		std::unique_lock<std::mutex> lock(connector_mutex);
+		this->max_half_open = std::max<size_t>(max_half_open, 1);
+	}
+
+	int Connector::take(std::chrono::milliseconds timeout, int& peer_socket)
+	{
+		std::unique_lock<std::mutex> lock(connector_mutex);
+
+		++waiting_threads;
+		connector_cv.wait_for(lock, timeout, [this]() { return !established.empty() || !is_running; });
+		--waiting_threads;
+
+		if (established.empty())
+			return -1;
+
+		// the lowest connect RTT is the best guess for a good peer we have this early
+		auto best_it = std::min_element(established.begin(), established.end(), [](const Established& first, const Established& second) {
+			return first.rtt < second.rtt;
+		});
+
+		Established connection = *best_it;
+		established.erase(best_it);
+		lock.unlock();
+
+		(*peer_pool)[connection.peer_index].connect_rtt = connection.rtt;
+		(*peer_pool)[connection.peer_index].is_utp = connection.is_utp;
+		peer_socket = connection.peer_socket;
+
+		return connection.peer_index;
+	}
+
+	void Connector::start_attempts()
+	{
+		std::unique_lock<std::mutex> lock(connector_mutex);
+
+		size_t missing = waiting_threads > established.size() ? waiting_threads - established.size() : 0;
+		size_t wanted = std::min(missing * CONNECT_RACE_WIDTH, max_half_open);
+
+		lock.unlock();
+
+		while (attempts.size() < wanted)
+		{
+			int peer_index = peer_pool->claim();
+			if (peer_index < 0)
+				break;
+
+			Attempt attempt;
+			attempt.peer_index = peer_index;
+			attempt.started_at = Clock::now();
+
+			if (utp_socket)
+				attempt.utp_socket = utp_socket->start_connect((*peer_pool)[peer_index].address);
+
+			// no uTP for this candidate, TCP doesn't wait then
+			if (attempt.utp_socket < 0)
+				start_tcp(attempt);
+
+			if (attempt.peer_socket < 0 && attempt.utp_socket < 0)
+			{
+				peer_pool->release_failed(peer_index);
+				continue;
+			}
+
+			attempts.push_back(attempt);
+		}
+	}
+
+	void Connector::start_tcp(Attempt& attempt)
+	{
+		attempt.has_tcp_started = true;
+		attempt.tcp_started_at = Clock::now();
+		attempt.peer_socket = start_connect((*peer_pool)[attempt.peer_index].address);
+	}
+
+	void Connector::drop_attempt(const Attempt& attempt)
+	{
+		if (attempt.peer_socket >= 0)
+			close(attempt.peer_socket);
+
+		if (attempt.utp_socket >= 0)
+		{
+			utp_socket->abort_connect(attempt.utp_socket);
+			close(attempt.utp_socket);
+		}
+	}
+
+	void Connector::connect_loop()
+	{
+		while (is_running)
+		{
+			start_attempts();
+
+			// poll() skips the -1 of attempts without a TCP socket, the indices stay those of attempts
+			std::vector<pollfd> poll_fds;
+			int poll_interval_ms = CONNECT_POLL_INTERVAL_MS;
+
+			for (const auto& attempt : attempts)
+			{
+				poll_fds.push_back(pollfd{attempt.peer_socket, POLLOUT, 0});
+
+				if (attempt.utp_socket >= 0)
+					poll_interval_ms = CONNECT_UTP_POLL_INTERVAL_MS;
+			}
+
+			if (poll_fds.empty())
+				std::this_thread::sleep_for(std::chrono::milliseconds(CONNECT_POLL_INTERVAL_MS));
+			else if (poll(poll_fds.data(), poll_fds.size(), poll_interval_ms) < 0)
+				continue;
+
+			std::unique_lock<std::mutex> lock(connector_mutex);
+			auto now = Clock::now();
+
+			for (size_t index = poll_fds.size(); index-- > 0;)
+			{
+				Attempt& attempt = attempts[index];
+
+				int connected_socket = -1;
+				bool is_utp = false;
+				auto transport_started_at = attempt.started_at;
+
+				if (attempt.utp_socket >= 0)
+				{
+					int utp_state = utp_socket->connect_state(attempt.utp_socket);
+
+					if (utp_state == 1)
+					{
+						connected_socket = attempt.utp_socket;
+						is_utp = true;
+						attempt.utp_socket = -1;
+					}
+					else if (utp_state < 0)
+					{
+						close(attempt.utp_socket);
+						attempt.utp_socket = -1;
+					}
+				}
+
+				if (connected_socket < 0 && attempt.peer_socket >= 0 && poll_fds[index].revents != 0)
+				{
+					if (finish_connect(attempt.peer_socket) == 0)
+					{
+						connected_socket = attempt.peer_socket;
+						transport_started_at = attempt.tcp_started_at;
+					}
+					else
+						close(attempt.peer_socket);
+
+					attempt.peer_socket = -1;
+				}
+
+				// uTP had its head start or failed already, TCP joins the race
+				if (connected_socket < 0 && !attempt.has_tcp_started &&
+					(attempt.utp_socket < 0 || now - attempt.started_at >= std::chrono::milliseconds(CONNECT_UTP_HEAD_START_MS)))
+					start_tcp(attempt);
+
+				bool has_failed = attempt.has_tcp_started && attempt.peer_socket < 0 && attempt.utp_socket < 0;
+				bool is_timed_out = now - attempt.started_at > connect_timeout;
+
+				if (connected_socket < 0 && !has_failed && !is_timed_out)
+					continue;
+
+				// the transport that lost the race is dropped along with the attempt
+				Attempt finished_attempt = attempt;
+				attempts.erase(attempts.begin() + index);
+				drop_attempt(finished_attempt);
+
+				if (connected_socket >= 0)
+				{
+					auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - transport_started_at);
+					established.push_back(Established{finished_attempt.peer_index, connected_socket, is_utp, rtt, now});
+					connector_cv.notify_one();
+					continue;
+				}
+
+				peer_pool->release_failed(finished_attempt.peer_index);
+			}
+
+			// connections raced for a thread that got another one in the meantime are given back after a while
+			while (!established.empty() && now - established.front().connected_at > std::chrono::seconds(CONNECT_READY_TTL_SEC))
+			{
+				close(established.front().peer_socket);
+				peer_pool->release(established.front().peer_index);
+				established.pop_front();
+			}
+		}
+	}
+}
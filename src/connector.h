@@ -0,0 +1,98 @@
+
+#ifndef _CONNECTOR_H_
+#define _CONNECTOR_H_
+
+#include "network_helper.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#define CONNECT_MAX_HALF_OPEN 16    // connects in flight at once
+#define CONNECT_RACE_WIDTH 3        // candidates raced for every thread that waits for a connection
+#define CONNECT_READY_TTL_SEC 20    // established connections nobody took are closed again
+#define CONNECT_POLL_INTERVAL_MS 50
+#define CONNECT_UTP_POLL_INTERVAL_MS 10 // uTP connects are polled for, there is no socket that turns writable
+#define CONNECT_UTP_HEAD_START_MS 250 // TCP is only tried once uTP didn't connect within this long
+
+namespace Utp
+{
+	class Utp_Socket;
+}
+
+namespace Network
+{
+	class Peer_Pool;
+
+	// Connects to candidates of a peer pool in the background with non-blocking sockets, so that a firewalled
+	// peer costs a half-open slot for CONNECT_TIMEOUT_MS instead of a download thread for minutes.
+	// Every waiting thread gets CONNECT_RACE_WIDTH candidates raced for it and takes whichever answered first.
+	// With a uTP socket every IPv4 candidate is tried over uTP first and over TCP as well after a head start,
+	// whichever transport connects first is kept and the other attempt dropped.
+	class Connector
+	{
+	public:
+		~Connector();
+
+		void start(Peer_Pool* peer_pool, Utp::Utp_Socket* utp_socket = nullptr);
+
+		void stop(); // closes the connections nobody took and releases their candidates
+
+		void set_connect_timeout(std::chrono::milliseconds timeout);
+
+		void set_max_half_open(size_t max_half_open);
+
+		// Waits up to timeout for an established connection, returns the pool index of the peer (its connect RTT is
+		// stored in the peer) and the socket, -1 if nothing connected in time. The caller owns the claimed candidate.
+		int take(std::chrono::milliseconds timeout, int& peer_socket);
+
+	private:
+		using Clock = std::chrono::steady_clock;
+
+		struct Attempt
+		{
+			size_t peer_index = 0;
+			int peer_socket = -1; // TCP, -1 before it started and after it failed
+			int utp_socket = -1;  // -1 without uTP and after it failed
+			bool has_tcp_started = false;
+			Clock::time_point started_at;
+			Clock::time_point tcp_started_at;
+		};
+
+		struct Established
+		{
+			size_t peer_index = 0;
+			int peer_socket = -1;
+			bool is_utp = false;
+			std::chrono::microseconds rtt{0};
+			Clock::time_point connected_at;
+		};
+
+		void connect_loop();
+
+		void start_attempts();
+
+		void start_tcp(Attempt& attempt);
+
+		void drop_attempt(const Attempt& attempt); // closes both transports
+
+		Peer_Pool* peer_pool = nullptr;
+		Utp::Utp_Socket* utp_socket = nullptr;
+		std::vector<Attempt> attempts; // only touched by the connect thread
+
+		std::deque<Established> established;
+		size_t waiting_threads = 0;
+		std::chrono::milliseconds connect_timeout{CONNECT_TIMEOUT_MS};
+		size_t max_half_open = CONNECT_MAX_HALF_OPEN;
+		std::mutex connector_mutex;
+		std::condition_variable connector_cv;
+
+		std::atomic<bool> is_running = false;
+		std::thread connect_thread;
+	};
+}
+
+#endif
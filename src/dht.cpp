@@ -0,0 +1,776 @@
+
+#include "dht.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <unordered_set>
+
+#define DHT_PEER_TTL_MIN 30
+#define DHT_MAX_STORED_PEERS 200
+#define DHT_MAX_STORED_HASHES 2000 // a new info hash beyond this replaces the one with the fewest peers
+#define DHT_PRUNE_INTERVAL_SEC 60  // how often announces older than DHT_PEER_TTL_MIN are dropped
+#define DHT_TOKEN_ROTATION_MIN 5
+
+namespace DHT
+{
+	static std::string random_bytes(size_t len)
+	{
+		static thread_local std::mt19937 rng(std::random_device{}());
+		std::string bytes(len, 0);
+
+		for (auto& byte : bytes)
+			byte = static_cast<char>(rng() & 0xFF);
+
+		return bytes;
+	}
+
+	std::string xor_distance(const std::string& first, const std::string& second)
+	{
+		std::string distance(20, 0);
+
+		for (size_t i = 0; i < 20; ++i)
+			distance[i] = first[i] ^ second[i];
+
+		return distance;
+	}
+
+	std::string nodes_to_compact(const std::vector<Node_Info>& nodes)
+	{
+		std::string compact;
+
+		for (const auto& node : nodes)
+		{
+			if (node.address.family() == AF_INET)
+				compact += node.id + node.address.to_compact();
+		}
+
+		return compact;
+	}
+
+	std::vector<Node_Info> compact_to_nodes(std::string_view compact)
+	{
+		std::vector<Node_Info> nodes;
+
+		for (size_t i = 0; i + 26 <= compact.size(); i += 26)
+		{
+			Node_Info node;
+			node.id = compact.substr(i, 20);
+
+			if (Network::Peer_Address::from_compact(compact.substr(i + 20, 6), node.address) && node.address.port() != 0)
+				nodes.push_back(std::move(node));
+		}
+
+		return nodes;
+	}
+
+	int Routing_Table::bucket_index(const std::string& id) const
+	{
+		auto distance = xor_distance(id, own_id);
+
+		for (int i = 0; i < 20; ++i)
+		{
+			auto byte = static_cast<uint8_t>(distance[i]);
+			if (byte != 0)
+				return i * 8 + std::countl_zero(byte);
+		}
+
+		return -1; // our own id
+	}
+
+	void Routing_Table::update(const std::string& id, const Network::Peer_Address& address, bool is_seen)
+	{
+		if (id.size() != 20)
+			return;
+
+		std::unique_lock<std::mutex> lock(table_mutex);
+
+		int index = bucket_index(id);
+		if (index < 0)
+			return;
+
+		auto& bucket = buckets[index];
+		auto node_it = std::find_if(bucket.begin(), bucket.end(), [&id](const Node_Info& node) { return node.id == id; });
+
+		if (node_it != bucket.end())
+		{
+			node_it->address = address;
+
+			if (is_seen)
+			{
+				node_it->last_seen = Clock::now();
+				node_it->failed_queries = 0;
+			}
+
+			return;
+		}
+
+		Node_Info node{id, address, is_seen ? Clock::now() : Clock::time_point{}, 0};
+
+		if (bucket.size() < DHT_K)
+		{
+			bucket.push_back(std::move(node));
+			return;
+		}
+
+		// full bucket: only replace a node that failed to answer repeatedly
+		auto bad_it = std::max_element(bucket.begin(), bucket.end(), [](const Node_Info& first, const Node_Info& second) { return first.failed_queries < second.failed_queries; });
+
+		if (bad_it->failed_queries >= 2)
+			*bad_it = std::move(node);
+	}
+
+	void Routing_Table::mark_failed(const std::string& id)
+	{
+		if (id.size() != 20)
+			return;
+
+		std::unique_lock<std::mutex> lock(table_mutex);
+
+		int index = bucket_index(id);
+		if (index < 0)
+			return;
+
+		auto& bucket = buckets[index];
+		auto node_it = std::find_if(bucket.begin(), bucket.end(), [&id](const Node_Info& node) { return node.id == id; });
+
+		if (node_it == bucket.end())
+			return;
+
+		// drop nodes that never answered us at all, keep the rest as replacement candidates
+		if (++node_it->failed_queries >= 5 || (node_it->last_seen == Clock::time_point{} && node_it->failed_queries >= 2))
+			bucket.erase(node_it);
+	}
+
+	std::vector<Node_Info> Routing_Table::find_closest(const std::string& target, size_t count) const
+	{
+		auto nodes = all_nodes();
+
+		std::sort(nodes.begin(), nodes.end(), [&target](const Node_Info& first, const Node_Info& second)
+		{
+			return xor_distance(first.id, target) < xor_distance(second.id, target);
+		});
+
+		if (nodes.size() > count)
+			nodes.resize(count);
+
+		return nodes;
+	}
+
+	std::vector<Node_Info> Routing_Table::all_nodes() const
+	{
+		std::unique_lock<std::mutex> lock(table_mutex);
+		std::vector<Node_Info> nodes;
+
+		for (const auto& bucket : buckets)
+			nodes.insert(nodes.end(), bucket.begin(), bucket.end());
+
+		return nodes;
+	}
+
+	size_t Routing_Table::size() const
+	{
+		std::unique_lock<std::mutex> lock(table_mutex);
+		size_t total = 0;
+
+		for (const auto& bucket : buckets)
+			total += bucket.size();
+
+		return total;
+	}
+
+	Node::Node(const std::string& state_file) : state_file(state_file)
+	{
+		node_id = random_bytes(20);
+		token_secrets = {random_bytes(8), random_bytes(8)};
+		secret_rotated_at = Clock::now();
+	}
+
+	Node::~Node()
+	{
+		stop();
+	}
+
+	static int resolve_node(const std::string& host_port, Network::Peer_Address& address)
+	{
+		if (Network::Peer_Address::from_string(host_port, address))
+			return 0;
+
+		auto colon_index = host_port.rfind(':');
+		if (colon_index == std::string::npos)
+			return -1;
+
+		addrinfo hints{};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		addrinfo* addr_result = nullptr;
+
+		if (getaddrinfo(host_port.substr(0, colon_index).c_str(), host_port.substr(colon_index + 1).c_str(), &hints, &addr_result) != 0 || addr_result == nullptr)
+			return -1;
+
+		address.storage = {};
+		std::memcpy(&address.storage, addr_result->ai_addr, addr_result->ai_addrlen);
+		freeaddrinfo(addr_result);
+
+		return 0;
+	}
+
+	int Node::start(const std::string& bind_ip, uint16_t port, const std::vector<std::string>& bootstrap_nodes)
+	{
+		load_state();
+		routing_table.set_own_id(node_id);
+
+		udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+		if (udp_socket < 0)
+		{
+			std::cerr << "Failed to create DHT socket" << std::endl;
+			return -1;
+		}
+
+		sockaddr_in bind_addr{};
+		bind_addr.sin_family = AF_INET;
+		bind_addr.sin_port = htons(port);
+		inet_pton(AF_INET, bind_ip.c_str(), &bind_addr.sin_addr);
+
+		if (bind(udp_socket, reinterpret_cast<sockaddr*>(&bind_addr), sizeof(bind_addr)) < 0)
+		{
+			// the port is taken (another client on this host), any port works for the DHT
+			bind_addr.sin_port = 0;
+			if (bind(udp_socket, reinterpret_cast<sockaddr*>(&bind_addr), sizeof(bind_addr)) < 0)
+			{
+				std::cerr << "Failed to bind DHT socket" << std::endl;
+				close(udp_socket);
+				udp_socket = -1;
+				return -1;
+			}
+		}
+
+		socklen_t addr_len = sizeof(bind_addr);
+		getsockname(udp_socket, reinterpret_cast<sockaddr*>(&bind_addr), &addr_len);
+		bound_port = ntohs(bind_addr.sin_port);
+
+		// lets the receive loop notice is_running going down
+		timeval tv{0, 200 * 1000};
+		setsockopt(udp_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		auto bootstrap_list = bootstrap_nodes;
+		if (bootstrap_list.empty())
+			bootstrap_list = {"router.bittorrent.com:6881", "router.utorrent.com:6881", "dht.transmissionbt.com:6881"};
+
+		for (const auto& host_port : bootstrap_list)
+		{
+			Network::Peer_Address address;
+			if (resolve_node(host_port, address) == 0)
+				bootstrap_addrs.push_back(address);
+		}
+
+		is_running = true;
+		receive_thread = std::thread(&Node::receive_loop, this);
+
+		std::cout << "DHT node listening on port " << bound_port << " with " << routing_table.size() << " known node(s)\n";
+		return 0;
+	}
+
+	void Node::stop()
+	{
+		if (!is_running.exchange(false))
+			return;
+
+		if (receive_thread.joinable())
+			receive_thread.join();
+
+		save_state();
+
+		close(udp_socket);
+		udp_socket = -1;
+	}
+
+	int Node::bootstrap()
+	{
+		std::vector<Network::Peer> unused_peers;
+		lookup(node_id, false, unused_peers, 0);
+
+		std::cout << "DHT bootstrap finished with " << routing_table.size() << " node(s) in the routing table\n";
+		save_state();
+
+		return routing_table.size() > 0 ? 0 : -1;
+	}
+
+	std::vector<Network::Peer> Node::get_peers(const std::string& info_hash, uint16_t announce_port)
+	{
+		if (routing_table.size() < DHT_K)
+			bootstrap();
+
+		std::vector<Network::Peer> found_peers;
+		lookup(info_hash, true, found_peers, announce_port);
+
+		return found_peers;
+	}
+
+	int Node::save_state() const
+	{
+		// a restart can then skip the bootstrap routers and keep its position in the keyspace
+		json state = json::object();
+		state["id"] = node_id;
+		state["nodes"] = nodes_to_compact(routing_table.all_nodes());
+
+		std::ofstream state_stream(state_file, std::ios::binary | std::ios::trunc);
+		if (!state_stream.is_open())
+		{
+			std::cerr << "Failed to save DHT state to " << state_file << std::endl;
+			return -1;
+		}
+
+		state_stream << Encoder::json_to_bencode(state);
+		return 0;
+	}
+
+	int Node::load_state()
+	{
+		std::ifstream state_stream(state_file, std::ios::binary);
+		if (!state_stream.is_open())
+			return -1;
+
+		std::string encoded((std::istreambuf_iterator<char>(state_stream)), std::istreambuf_iterator<char>());
+
+		json state;
+		try
+		{
+			size_t position = 0;
+			state = Decoder::decode_bencoded_value(encoded, position);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Ignoring corrupt DHT state file " << state_file << std::endl;
+			return -1;
+		}
+
+		if (!state.is_object() || !state.contains("id") || !state["id"].is_string() || state["id"].get<std::string>().size() != 20)
+			return -1;
+
+		node_id = state["id"].get<std::string>();
+		routing_table.set_own_id(node_id);
+
+		// loaded nodes are not known to be alive yet, the first lookup confirms them
+		if (state.contains("nodes") && state["nodes"].is_string())
+		{
+			for (const auto& node : compact_to_nodes(state["nodes"].get<std::string>()))
+				routing_table.update(node.id, node.address, false);
+		}
+
+		return 0;
+	}
+
+	void Node::send_message(const Network::Peer_Address& address, const json& message)
+	{
+		auto encoded = Encoder::json_to_bencode(message);
+		sendto(udp_socket, encoded.data(), encoded.size(), 0, address.sock_addr(), address.length());
+	}
+
+	std::string Node::send_query(const Network::Peer_Address& address, const std::string& method, json args, bool is_tracked)
+	{
+		std::string transaction_id(2, 0);
+
+		{
+			std::unique_lock<std::mutex> lock(transaction_mutex);
+			uint16_t id_value = next_transaction_id++;
+			transaction_id[0] = static_cast<char>(id_value >> 8);
+			transaction_id[1] = static_cast<char>(id_value & 0xFF);
+
+			if (is_tracked)
+				transactions[transaction_id] = Transaction{address, json(), false};
+		}
+
+		args["id"] = node_id;
+
+		json message = json::object();
+		message["t"] = transaction_id;
+		message["y"] = "q";
+		message["q"] = method;
+		message["a"] = std::move(args);
+
+		send_message(address, message);
+		return transaction_id;
+	}
+
+	std::vector<Node_Info> Node::lookup(const std::string& target, bool is_get_peers, std::vector<Network::Peer>& found_peers, uint16_t announce_port)
+	{
+		enum candidate_state
+		{
+			NEW = 0,
+			IN_FLIGHT,
+			RESPONDED,
+			FAILED
+		};
+
+		struct Candidate
+		{
+			Node_Info node;
+			candidate_state state = NEW;
+			std::string token;
+		};
+
+		// ordered by xor distance to the target, so the first DHT_K live entries are the current closest set
+		std::map<std::string, Candidate> candidates;
+		std::unordered_set<Network::Peer_Address, Network::Peer_Address_Hash> seen_addrs;
+		std::unordered_set<Network::Peer_Address, Network::Peer_Address_Hash> seen_peers;
+
+		auto add_candidate = [&](const Node_Info& node)
+		{
+			if (node.id == node_id || !seen_addrs.insert(node.address).second)
+				return;
+
+			// bootstrap routers have no known id yet, sort them after every real node
+			auto key = node.id.size() == 20 ? xor_distance(node.id, target) : std::string(20, '\xff') + node.address.to_compact();
+			candidates.emplace(key, Candidate{node, NEW, ""});
+		};
+
+		for (const auto& node : routing_table.find_closest(target, DHT_K * 2))
+			add_candidate(node);
+
+		if (candidates.size() < DHT_K)
+		{
+			for (const auto& address : bootstrap_addrs)
+				add_candidate(Node_Info{"", address});
+		}
+
+		std::map<std::string, std::pair<std::string, Clock::time_point>> in_flight; // transaction id -> candidate key, deadline
+		std::string method = is_get_peers ? "get_peers" : "find_node";
+
+		while (true)
+		{
+			// keep DHT_ALPHA queries outstanding towards the closest not yet queried nodes
+			size_t live_checked = 0;
+			bool has_unqueried = false;
+
+			for (auto& [key, candidate] : candidates)
+			{
+				if (candidate.state == FAILED)
+					continue;
+
+				if (++live_checked > DHT_K)
+					break;
+
+				if (candidate.state != NEW)
+					continue;
+
+				has_unqueried = true;
+				if (in_flight.size() >= DHT_ALPHA)
+					break;
+
+				json args = json::object();
+				args[is_get_peers ? "info_hash" : "target"] = target;
+
+				auto transaction_id = send_query(candidate.node.address, method, std::move(args));
+				in_flight[transaction_id] = {key, Clock::now() + std::chrono::milliseconds(DHT_QUERY_TIMEOUT_MS)};
+				candidate.state = IN_FLIGHT;
+			}
+
+			if (in_flight.empty() && !has_unqueried)
+				break;
+
+			auto earliest_deadline = Clock::time_point::max();
+			for (const auto& [transaction_id, entry] : in_flight)
+				earliest_deadline = std::min(earliest_deadline, entry.second);
+
+			std::vector<std::pair<std::string, json>> completed; // candidate key, response
+
+			{
+				std::unique_lock<std::mutex> lock(transaction_mutex);
+
+				auto has_completed = [&]()
+				{
+					for (const auto& [transaction_id, entry] : in_flight)
+					{
+						auto transaction_it = transactions.find(transaction_id);
+						if (transaction_it != transactions.end() && transaction_it->second.is_done)
+							return true;
+					}
+
+					return false;
+				};
+
+				transaction_cv.wait_until(lock, earliest_deadline, has_completed);
+
+				auto now = Clock::now();
+				for (auto flight_it = in_flight.begin(); flight_it != in_flight.end();)
+				{
+					auto transaction_it = transactions.find(flight_it->first);
+					bool is_done = transaction_it != transactions.end() && transaction_it->second.is_done;
+
+					if (!is_done && now < flight_it->second.second)
+					{
+						++flight_it;
+						continue;
+					}
+
+					completed.emplace_back(flight_it->second.first, is_done ? std::move(transaction_it->second.response) : json());
+
+					if (transaction_it != transactions.end())
+						transactions.erase(transaction_it);
+
+					flight_it = in_flight.erase(flight_it);
+				}
+			}
+
+			for (auto& [key, response] : completed)
+			{
+				auto& candidate = candidates[key];
+
+				if (!response.is_object() || !response.contains("r") || !response["r"].is_object())
+				{
+					candidate.state = FAILED;
+					routing_table.mark_failed(candidate.node.id);
+					continue;
+				}
+
+				auto& reply = response["r"];
+				candidate.state = RESPONDED;
+
+				if (reply.contains("id") && reply["id"].is_string())
+					candidate.node.id = reply["id"].get<std::string>();
+
+				if (reply.contains("token") && reply["token"].is_string())
+					candidate.token = reply["token"].get<std::string>();
+
+				if (reply.contains("values") && reply["values"].is_array())
+				{
+					for (const auto& value : reply["values"])
+					{
+						Network::Peer_Address address;
+						if (value.is_string() && Network::Peer_Address::from_compact(value.get<std::string>(), address) && seen_peers.insert(address).second)
+							found_peers.emplace_back(address);
+					}
+				}
+
+				if (reply.contains("nodes") && reply["nodes"].is_string())
+				{
+					for (const auto& node : compact_to_nodes(reply["nodes"].get<std::string>()))
+						add_candidate(node);
+				}
+			}
+		}
+
+		std::vector<Node_Info> closest_nodes;
+		for (auto& [key, candidate] : candidates)
+		{
+			if (candidate.state != RESPONDED)
+				continue;
+
+			if (announce_port != 0 && is_get_peers && !candidate.token.empty())
+			{
+				json args = json::object();
+				args["info_hash"] = target;
+				args["port"] = announce_port;
+				args["token"] = candidate.token;
+
+				send_query(candidate.node.address, "announce_peer", std::move(args), false); // nobody waits for the reply
+			}
+
+			closest_nodes.push_back(candidate.node);
+			if (closest_nodes.size() >= DHT_K)
+				break;
+		}
+
+		return closest_nodes;
+	}
+
+	void Node::receive_loop()
+	{
+		std::string buffer(2048, 0);
+
+		while (is_running)
+		{
+			// an info hash nobody looks up again would keep its peers forever otherwise
+			if (Clock::now() - pruned_at > std::chrono::seconds(DHT_PRUNE_INTERVAL_SEC))
+				prune_stored_peers();
+
+			sockaddr_storage sender_storage{};
+			socklen_t sender_len = sizeof(sender_storage);
+
+			auto bytes_read = recvfrom(udp_socket, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&sender_storage), &sender_len);
+			if (bytes_read <= 0)
+				continue;
+
+			Network::Peer_Address sender;
+			sender.storage = sender_storage;
+
+			json message;
+			try
+			{
+				size_t position = 0;
+				message = Decoder::decode_bencoded_value(buffer.substr(0, bytes_read), position);
+			}
+			catch (const std::exception& e)
+			{
+				continue; // not a KRPC message
+			}
+
+			if (!message.is_object() || !message.contains("y") || !message["y"].is_string() || !message.contains("t") || !message["t"].is_string())
+				continue;
+
+			auto message_type = message["y"].get<std::string>();
+
+			if (message_type == "q")
+				handle_query(message, sender);
+			else if (message_type == "r" || message_type == "e")
+				handle_response(message, sender);
+		}
+	}
+
+	void Node::prune_stored_peers()
+	{
+		std::unique_lock<std::mutex> lock(storage_mutex);
+
+		auto now = Clock::now();
+		pruned_at = now;
+
+		for (auto entry_it = stored_peers.begin(); entry_it != stored_peers.end();)
+		{
+			std::erase_if(entry_it->second, [now](const Stored_Peer& peer) { return now - peer.announced_at > std::chrono::minutes(DHT_PEER_TTL_MIN); });
+			entry_it = entry_it->second.empty() ? stored_peers.erase(entry_it) : std::next(entry_it);
+		}
+	}
+
+	void Node::handle_response(const json& message, const Network::Peer_Address& sender)
+	{
+		if (message.contains("r") && message["r"].is_object() && message["r"].contains("id") && message["r"]["id"].is_string())
+			routing_table.update(message["r"]["id"].get<std::string>(), sender, true);
+
+		std::unique_lock<std::mutex> lock(transaction_mutex);
+
+		auto transaction_it = transactions.find(message["t"].get<std::string>());
+		if (transaction_it == transactions.end() || !(transaction_it->second.address == sender))
+			return;
+
+		transaction_it->second.response = message;
+		transaction_it->second.is_done = true;
+		transaction_cv.notify_all();
+	}
+
+	std::string Node::make_token(const Network::Peer_Address& address, int secret_index) const
+	{
+		auto compact = address.to_compact();
+		return Encoder::SHA_string(token_secrets[secret_index] + compact.substr(0, compact.size() - 2)).substr(0, 8);
+	}
+
+	bool Node::is_valid_token(const std::string& token, const Network::Peer_Address& address) const
+	{
+		return token == make_token(address, 0) || token == make_token(address, 1);
+	}
+
+	void Node::handle_query(const json& message, const Network::Peer_Address& sender)
+	{
+		if (!message.contains("q") || !message["q"].is_string() || !message.contains("a") || !message["a"].is_object())
+			return;
+
+		const auto& args = message["a"];
+		auto method = message["q"].get<std::string>();
+
+		if (args.contains("id") && args["id"].is_string())
+			routing_table.update(args["id"].get<std::string>(), sender, true);
+
+		json reply = json::object();
+		reply["id"] = node_id;
+
+		json response = json::object();
+		response["t"] = message["t"];
+		response["y"] = "r";
+
+		std::unique_lock<std::mutex> lock(storage_mutex);
+
+		auto now = Clock::now();
+		if (now - secret_rotated_at > std::chrono::minutes(DHT_TOKEN_ROTATION_MIN))
+		{
+			token_secrets[1] = token_secrets[0];
+			token_secrets[0] = random_bytes(8);
+			secret_rotated_at = now;
+		}
+
+		auto string_arg = [&args](const char* key) { return args.contains(key) && args[key].is_string() ? args[key].get<std::string>() : std::string(); };
+
+		if (method == "ping")
+		{
+		}
+		else if (method == "find_node" && string_arg("target").size() == 20)
+		{
+			reply["nodes"] = nodes_to_compact(routing_table.find_closest(string_arg("target"), DHT_K));
+		}
+		else if (method == "get_peers" && string_arg("info_hash").size() == 20)
+		{
+			auto info_hash = string_arg("info_hash");
+			reply["token"] = make_token(sender, 0);
+
+			auto& peers = stored_peers[info_hash];
+			std::erase_if(peers, [now](const Stored_Peer& peer) { return now - peer.announced_at > std::chrono::minutes(DHT_PEER_TTL_MIN); });
+
+			if (!peers.empty())
+			{
+				reply["values"] = json::array();
+				for (const auto& peer : peers)
+					reply["values"].push_back(peer.address.to_compact());
+			}
+			else
+			{
+				stored_peers.erase(info_hash);
+				reply["nodes"] = nodes_to_compact(routing_table.find_closest(info_hash, DHT_K));
+			}
+		}
+		else if (method == "announce_peer" && string_arg("info_hash").size() == 20 && is_valid_token(string_arg("token"), sender))
+		{
+			Network::Peer_Address peer_address = sender;
+			bool is_implied_port = args.contains("implied_port") && args["implied_port"].is_number_integer() && args["implied_port"].get<int>() != 0;
+
+			if (!is_implied_port)
+			{
+				if (!args.contains("port") || !args["port"].is_number_integer())
+					return;
+
+				auto port = htons(static_cast<uint16_t>(args["port"].get<int>()));
+				if (peer_address.family() == AF_INET6)
+					reinterpret_cast<sockaddr_in6*>(&peer_address.storage)->sin6_port = port;
+				else
+					reinterpret_cast<sockaddr_in*>(&peer_address.storage)->sin_port = port;
+			}
+
+			auto info_hash = string_arg("info_hash");
+
+			// announces for made up info hashes only ever displace each other, not the torrents many peers announce
+			if (!stored_peers.contains(info_hash) && stored_peers.size() >= DHT_MAX_STORED_HASHES)
+			{
+				stored_peers.erase(std::min_element(stored_peers.begin(), stored_peers.end(), [](const auto& entry, const auto& other) {
+					return entry.second.size() < other.second.size();
+				}));
+			}
+
+			auto& peers = stored_peers[info_hash];
+			auto peer_it = std::find_if(peers.begin(), peers.end(), [&peer_address](const Stored_Peer& peer) { return peer.address == peer_address; });
+
+			if (peer_it != peers.end())
+				peer_it->announced_at = now;
+			else if (peers.size() < DHT_MAX_STORED_PEERS)
+				peers.push_back(Stored_Peer{peer_address, now});
+		}
+		else
+		{
+			bool is_known_method = method == "find_node" || method == "get_peers" || method == "announce_peer";
+
+			response["y"] = "e";
+			response["e"] = json::array({is_known_method ? 203 : 204, is_known_method ? "Protocol Error" : "Method Unknown"});
+			lock.unlock();
+			send_message(sender, response);
+			return;
+		}
+
+		lock.unlock();
+
+		response["r"] = std::move(reply);
+		send_message(sender, response);
+	}
+}
@@ -0,0 +1,149 @@
+
+#ifndef _DHT_H_
+#define _DHT_H_
+
+#include "bencode_helper.h"
+#include "network_helper.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#define DHT_DEFAULT_PORT 6881
+#define DHT_STATE_FILE ".dht_state"
+#define DHT_K 8                  // bucket size and number of closest nodes a lookup converges on
+#define DHT_ALPHA 3              // parallel in-flight queries per lookup
+#define DHT_QUERY_TIMEOUT_MS 2000
+
+namespace DHT
+{
+	using Clock = std::chrono::steady_clock;
+
+	struct Node_Info
+	{
+		std::string id; // 20 bytes
+		Network::Peer_Address address;
+		Clock::time_point last_seen{};
+		int failed_queries = 0;
+	};
+
+	std::string xor_distance(const std::string& first, const std::string& second);
+
+	std::string nodes_to_compact(const std::vector<Node_Info>& nodes);
+
+	std::vector<Node_Info> compact_to_nodes(std::string_view compact); // 26 bytes per node: id, IPv4, port
+
+	// Kademlia routing table, bucket i holds the nodes whose id shares exactly i leading bits with our own id
+	class Routing_Table
+	{
+	public:
+		void set_own_id(const std::string& id) { own_id = id; }
+
+		// Inserts or refreshes a node, a full bucket only accepts it in place of a node that stopped responding
+		void update(const std::string& id, const Network::Peer_Address& address, bool is_seen);
+
+		void mark_failed(const std::string& id);
+
+		std::vector<Node_Info> find_closest(const std::string& target, size_t count) const;
+
+		std::vector<Node_Info> all_nodes() const;
+
+		size_t size() const;
+
+	private:
+		int bucket_index(const std::string& id) const;
+
+		std::string own_id;
+		std::array<std::vector<Node_Info>, 160> buckets;
+		mutable std::mutex table_mutex;
+	};
+
+	// A mainline DHT (BEP 5) node: answers queries from other nodes and runs iterative lookups for us
+	class Node
+	{
+	public:
+		explicit Node(const std::string& state_file = DHT_STATE_FILE);
+
+		~Node();
+
+		// An empty bootstrap list uses the well known public routers
+		int start(const std::string& bind_ip, uint16_t port, const std::vector<std::string>& bootstrap_nodes = {});
+
+		void stop(); // saves the routing table to the state file
+
+		int bootstrap();
+
+		// Iterative get_peers lookup, announce_peer is sent to the closest nodes that handed out a token when announce_port != 0
+		std::vector<Network::Peer> get_peers(const std::string& info_hash, uint16_t announce_port = 0);
+
+		const std::string& id() const { return node_id; }
+
+		uint16_t port() const { return bound_port; }
+
+		size_t routing_table_size() const { return routing_table.size(); }
+
+		int save_state() const;
+
+		int load_state();
+
+	private:
+		struct Transaction
+		{
+			Network::Peer_Address address;
+			json response;
+			bool is_done = false;
+		};
+
+		struct Stored_Peer
+		{
+			Network::Peer_Address address;
+			Clock::time_point announced_at;
+		};
+
+		std::vector<Node_Info> lookup(const std::string& target, bool is_get_peers, std::vector<Network::Peer>& found_peers, uint16_t announce_port);
+
+		std::string send_query(const Network::Peer_Address& address, const std::string& method, json args, bool is_tracked = true);
+
+		void send_message(const Network::Peer_Address& address, const json& message);
+
+		void receive_loop();
+
+		void handle_query(const json& message, const Network::Peer_Address& sender);
+
+		void handle_response(const json& message, const Network::Peer_Address& sender);
+
+		void prune_stored_peers(); // drops expired announces and the info hashes left without peers
+
+		std::string make_token(const Network::Peer_Address& address, int secret_index) const;
+
+		bool is_valid_token(const std::string& token, const Network::Peer_Address& address) const;
+
+		std::string state_file;
+		std::string node_id;
+		std::vector<Network::Peer_Address> bootstrap_addrs;
+		int udp_socket = -1;
+		uint16_t bound_port = 0;
+
+		Routing_Table routing_table;
+
+		std::unordered_map<std::string, Transaction> transactions;
+		uint16_t next_transaction_id = 0;
+		std::mutex transaction_mutex;
+		std::condition_variable transaction_cv;
+
+		std::unordered_map<std::string, std::vector<Stored_Peer>> stored_peers; // info hash -> peers that announced to us
+		std::array<std::string, 2> token_secrets; // current and previous secret, rotated every 5 minutes
+		Clock::time_point secret_rotated_at;
+		Clock::time_point pruned_at; // receive thread only
+		mutable std::mutex storage_mutex;
+
+		std::atomic<bool> is_running = false;
+		std::thread receive_thread;
+	};
+}
+
+#endif
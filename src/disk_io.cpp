@@ -0,0 +1,512 @@
+
+#include "disk_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace DiskIo
+{
+	Options default_options;
+
+	// pwritev until every iovec is written, a write may stop short and IOV_MAX bounds one call
+	static bool write_fully(int fd, int64_t file_offset, std::vector<iovec> iov, uint64_t& syscalls)
+	{
+		size_t first = 0;
+
+		while (first < iov.size())
+		{
+			++syscalls;
+			ssize_t written = pwritev(fd, iov.data() + first, std::min<size_t>(iov.size() - first, IOV_MAX), file_offset);
+			if (written < 0 && errno == EINTR)
+				continue;
+
+			if (written <= 0)
+				return false;
+
+			file_offset += written;
+
+			for (; first < iov.size() && static_cast<size_t>(written) >= iov[first].iov_len; ++first)
+				written -= iov[first].iov_len;
+
+			if (written > 0)
+			{
+				iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+				iov[first].iov_len -= written;
+			}
+		}
+
+		return true;
+	}
+
+	static int sync_file(int fd, uint64_t& syscalls)
+	{
+		++syscalls;
+		return fdatasync(fd);
+	}
+
+	Disk_Thread::~Disk_Thread()
+	{
+		stop();
+	}
+
+	void Disk_Thread::start(const Options& start_options)
+	{
+		std::unique_lock<std::mutex> lock(start_mutex);
+
+		if (is_running)
+			return;
+
+		options = start_options;
+
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wake_fd < 0)
+		{
+			std::cerr << "Failed to create the disk thread's eventfd" << std::endl;
+			return;
+		}
+
+		if (options.use_io_uring && ring.open(DISK_URING_ENTRIES) != 0)
+			std::cerr << "io_uring is unavailable, pieces are written with pwritev" << std::endl;
+
+		if (ring.is_open())
+		{
+			has_fixed_slots = ring.register_buffer_slots(DISK_URING_FIXED_BUFFERS) == 0;
+			fixed_generation = BufferPool::piece_buffers().mapping_generation();
+		}
+
+		is_running = true;
+		io_thread = std::thread(&Disk_Thread::disk_loop, this);
+	}
+
+	void Disk_Thread::stop()
+	{
+		std::unique_lock<std::mutex> lock(start_mutex);
+
+		if (!is_running)
+			return;
+
+		is_running = false;
+		wake();
+		io_thread.join();
+
+		ring.close();
+		fixed_slots.clear();
+		has_fixed_slots = false;
+
+		close(wake_fd);
+		wake_fd = -1;
+	}
+
+	void Disk_Thread::write_piece(Storage::File_Storage& storage, int piece_index, BufferPool::Piece_Buffer buffer, std::function<void(int result)> on_complete)
+	{
+		Write_Job* job = new Write_Job{&storage, piece_index, std::move(buffer), std::move(on_complete)};
+
+		// without the disk thread (it couldn't start or was stopped) the caller writes the piece itself
+		if (!is_running)
+		{
+			Write_Run run;
+			run.bytes = job->buffer.size();
+			run.jobs.emplace_back(job);
+
+			uint64_t syscalls = 0;
+			prepare_run(run);
+			if (run.result == 0)
+				run.result = write_run(run, syscalls);
+
+			complete_run(run, syscalls);
+			return;
+		}
+
+		Write_Job* top = submitted.load(std::memory_order_relaxed);
+		do
+			job->next = top;
+		while (!submitted.compare_exchange_weak(top, job, std::memory_order_release, std::memory_order_relaxed));
+
+		// the disk thread always takes the whole stack, only a push onto an empty one can find it asleep
+		if (top == nullptr)
+			wake();
+	}
+
+	Stats Disk_Thread::stats() const
+	{
+		std::unique_lock<std::mutex> lock(stats_mutex);
+		return counters;
+	}
+
+	void Disk_Thread::disk_loop()
+	{
+		while (true)
+		{
+			bool is_stopping = !is_running;
+			int timeout_ms = -1;
+
+			if (is_stopping)
+				timeout_ms = 0;
+			else if (!pending.empty())
+				timeout_ms = std::max<int64_t>(DISK_FLUSH_DELAY_MS - std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - oldest_pending).count(), 0);
+
+			pollfd wake_poll{wake_fd, POLLIN, 0};
+			poll(&wake_poll, 1, timeout_ms);
+
+			uint64_t wakes = 0;
+			if (read(wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+				std::cerr << "Failed to read the disk thread's eventfd" << std::endl;
+
+			take_jobs();
+
+			if (!pending.empty() && (is_stopping || pending_bytes >= flush_threshold() || Clock::now() - oldest_pending >= std::chrono::milliseconds(DISK_FLUSH_DELAY_MS)))
+				flush();
+
+			if (is_stopping && pending.empty() && submitted.load() == nullptr)
+				break;
+		}
+	}
+
+	void Disk_Thread::take_jobs()
+	{
+		Write_Job* job = submitted.exchange(nullptr, std::memory_order_acquire);
+
+		if (job != nullptr && pending.empty())
+			oldest_pending = Clock::now();
+
+		while (job != nullptr)
+		{
+			Write_Job* next = job->next;
+
+			pending_bytes += job->buffer.size();
+			pending.emplace(Job_Key{job->storage, job->piece_index}, std::unique_ptr<Write_Job>(job));
+
+			job = next;
+		}
+	}
+
+	void Disk_Thread::flush()
+	{
+		// upwards from where the last flush ended, then around from the lowest offset
+		std::vector<std::unique_ptr<Write_Job>> ordered;
+		auto sweep_start = pending.lower_bound(head);
+
+		for (auto it = sweep_start; it != pending.end(); ++it)
+			ordered.push_back(std::move(it->second));
+
+		for (auto it = pending.begin(); it != sweep_start; ++it)
+			ordered.push_back(std::move(it->second));
+
+		pending.clear();
+		pending_bytes = 0;
+
+		std::vector<Write_Run> runs;
+
+		for (auto& job : ordered)
+		{
+			bool is_adjacent = !runs.empty() && runs.back().jobs.back()->storage == job->storage && runs.back().jobs.back()->piece_index + 1 == job->piece_index;
+			if (!is_adjacent)
+				runs.emplace_back();
+
+			runs.back().bytes += job->buffer.size();
+			runs.back().jobs.push_back(std::move(job));
+		}
+
+		const Write_Job& last_job = *runs.back().jobs.back();
+		head = Job_Key{last_job.storage, last_job.piece_index + 1};
+
+		for (auto& run : runs)
+			prepare_run(run);
+
+		uint64_t syscalls = 0;
+
+		if (ring.is_open())
+			write_runs_uring(runs, syscalls);
+		else
+		{
+			for (auto& run : runs)
+			{
+				if (run.result == 0)
+					run.result = write_run(run, syscalls);
+			}
+		}
+
+		for (auto& run : runs)
+			complete_run(run, std::exchange(syscalls, 0));
+	}
+
+	void Disk_Thread::prepare_run(Write_Run& run)
+	{
+		const Write_Job& first_job = *run.jobs.front();
+		run.spans = first_job.storage->map_pieces(first_job.piece_index, run.bytes);
+
+		size_t job = 0;
+		size_t job_offset = 0;
+		size_t mapped = 0;
+
+		for (const auto& span : run.spans)
+		{
+			// a piece on a file boundary is split between two spans
+			auto& iov = run.span_iovecs.emplace_back();
+			run.span_jobs.push_back(job);
+
+			for (int64_t span_left = span.length; span_left > 0;)
+			{
+				BufferPool::Piece_Buffer& buffer = run.jobs[job]->buffer;
+				size_t chunk = std::min<int64_t>(span_left, buffer.size() - job_offset);
+				iov.push_back(iovec{buffer.data() + job_offset, chunk});
+
+				span_left -= chunk;
+				job_offset += chunk;
+
+				if (job_offset == buffer.size())
+				{
+					++job;
+					job_offset = 0;
+				}
+			}
+
+			mapped += span.length;
+		}
+
+		if (mapped != run.bytes)
+			run.result = -1;
+	}
+
+	int Disk_Thread::write_run(Write_Run& run, uint64_t& syscalls)
+	{
+		for (size_t span = 0; span < run.spans.size(); ++span)
+		{
+			const auto& file_span = run.spans[span];
+
+			if (!write_fully(file_span.fd, file_span.file_offset, run.span_iovecs[span], syscalls))
+				return -1;
+
+			if (options.sync_pieces && sync_file(file_span.fd, syscalls) != 0)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	void Disk_Thread::write_runs_uring(std::vector<Write_Run>& runs, uint64_t& syscalls)
+	{
+		uint64_t ring_syscalls = ring.syscalls();
+
+		// a buffer the pool unmapped can come back at the same address with other pages behind it
+		uint64_t generation = BufferPool::piece_buffers().mapping_generation();
+		if (has_fixed_slots && generation != fixed_generation)
+		{
+			if (!fixed_slots.empty())
+				ring.update_buffer_slots(0, std::vector<iovec>(fixed_slots.size(), iovec{nullptr, 0}));
+
+			fixed_slots.clear();
+			fixed_generation = generation;
+		}
+
+		struct Span_Write
+		{
+			Write_Run* run = nullptr;
+			size_t span = 0;
+			int write_result = -ECANCELED; // what the CQE said, never submitted otherwise
+			int sync_result = -ECANCELED;
+		};
+
+		std::vector<Span_Write> writes;
+
+		for (auto& run : runs)
+		{
+			for (size_t span = 0; span < run.spans.size() && run.result == 0; ++span)
+				writes.push_back(Span_Write{&run, span});
+		}
+
+		unsigned sqes_per_write = options.sync_pieces ? 2 : 1;
+		size_t next = 0;
+
+		while (next < writes.size() && ring.is_open())
+		{
+			unsigned queued = 0;
+
+			for (; next < writes.size() && queued + sqes_per_write <= DISK_URING_ENTRIES; ++next)
+			{
+				Span_Write& write = writes[next];
+				const auto& file_span = write.run->spans[write.span];
+				const auto& iov = write.run->span_iovecs[write.span];
+
+				// left to the pwritev fallback below
+				if (iov.size() > IOV_MAX)
+					continue;
+
+				int slot = iov.size() == 1 ? fixed_slot(write.run->jobs[write.run->span_jobs[write.span]]->buffer) : -1;
+
+				io_uring_sqe* sqe = ring.get_sqe();
+				sqe->fd = file_span.fd;
+				sqe->off = file_span.file_offset;
+				sqe->user_data = next << 1;
+
+				if (slot >= 0)
+				{
+					sqe->opcode = IORING_OP_WRITE_FIXED;
+					sqe->addr = reinterpret_cast<uint64_t>(iov[0].iov_base);
+					sqe->len = iov[0].iov_len;
+					sqe->buf_index = slot;
+				}
+				else
+				{
+					sqe->opcode = IORING_OP_WRITEV;
+					sqe->addr = reinterpret_cast<uint64_t>(iov.data());
+					sqe->len = iov.size();
+				}
+
+				++queued;
+
+				if (options.sync_pieces)
+				{
+					// the fdatasync starts once the write completed in full, a failed or short write cancels it
+					sqe->flags |= IOSQE_IO_LINK;
+
+					io_uring_sqe* sync_sqe = ring.get_sqe();
+					sync_sqe->opcode = IORING_OP_FSYNC;
+					sync_sqe->fd = file_span.fd;
+					sync_sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+					sync_sqe->user_data = (next << 1) | 1;
+
+					++queued;
+				}
+			}
+
+			if (queued == 0)
+				continue;
+
+			// one enter hands the whole batch over and waits for all of it
+			int submitted = ring.submit_and_wait(queued);
+			int reaped = 0;
+
+			while (reaped < submitted)
+			{
+				io_uring_cqe cqe{};
+
+				if (!ring.pop_cqe(cqe))
+				{
+					if (ring.submit_and_wait(1) < 0)
+						break;
+
+					continue;
+				}
+
+				Span_Write& write = writes[cqe.user_data >> 1];
+				if (cqe.user_data & 1)
+					write.sync_result = cqe.res;
+				else
+					write.write_result = cqe.res;
+
+				++reaped;
+			}
+
+			// the SQEs the kernel didn't take go away with the ring, their writes are done below
+			if (submitted != static_cast<int>(queued) || reaped != submitted)
+			{
+				std::cerr << "io_uring submission failed, pieces are written with pwritev from now on" << std::endl;
+
+				ring.close();
+				fixed_slots.clear();
+				has_fixed_slots = false;
+			}
+		}
+
+		for (auto& write : writes)
+		{
+			const auto& file_span = write.run->spans[write.span];
+			bool is_written = write.write_result == file_span.length;
+			bool is_synced = !options.sync_pieces || write.sync_result == 0;
+
+			if (is_written && is_synced)
+				continue;
+
+			// short, failed or never submitted, rewriting bytes that did make it is harmless
+			if (!is_written && !write_fully(file_span.fd, file_span.file_offset, write.run->span_iovecs[write.span], syscalls))
+				write.run->result = -1;
+			else if (options.sync_pieces && sync_file(file_span.fd, syscalls) != 0)
+				write.run->result = -1;
+		}
+
+		syscalls += ring.syscalls() - ring_syscalls;
+	}
+
+	int Disk_Thread::fixed_slot(const BufferPool::Piece_Buffer& buffer)
+	{
+		if (!has_fixed_slots)
+			return -1;
+
+		auto slot_it = fixed_slots.find(buffer.data());
+		if (slot_it != fixed_slots.end())
+			return slot_it->second;
+
+		if (fixed_slots.size() >= DISK_URING_FIXED_BUFFERS)
+			return -1;
+
+		// registering pins the whole buffer, unprivileged users run into RLIMIT_MEMLOCK and write without slots from then on
+		int slot = fixed_slots.size();
+		if (ring.update_buffer_slots(slot, {iovec{const_cast<char*>(buffer.data()), buffer.capacity()}}) != 0)
+		{
+			has_fixed_slots = false;
+			return -1;
+		}
+
+		fixed_slots.emplace(buffer.data(), slot);
+		return slot;
+	}
+
+	void Disk_Thread::complete_run(Write_Run& run, uint64_t syscalls)
+	{
+		int first_piece_index = run.jobs.front()->piece_index;
+		int piece_count = run.jobs.size();
+
+		if (run.result == 0)
+			run.jobs.front()->storage->mark_pieces(first_piece_index, piece_count);
+		else
+			std::cerr << "Failed to write pieces " << first_piece_index << "-" << first_piece_index + piece_count - 1 << std::endl;
+
+		std::unique_lock<std::mutex> lock(stats_mutex);
+		if (run.result == 0)
+		{
+			counters.pieces_written += piece_count;
+			counters.runs_written += 1;
+			counters.bytes_written += run.bytes;
+		}
+		else
+			counters.failed_pieces += piece_count;
+
+		counters.syscalls += syscalls;
+		lock.unlock();
+
+		// the memory is free before anyone hears the piece is done, a thread waiting for a buffer gets it right away
+		for (auto& job : run.jobs)
+		{
+			job->buffer.reset();
+			job->on_complete(run.result);
+		}
+	}
+
+	size_t Disk_Thread::flush_threshold() const
+	{
+		// pending pieces hold on to their buffers, waiting for neighbours mustn't starve the downloads of piece memory
+		return std::min<size_t>(DISK_FLUSH_BYTES, BufferPool::piece_buffers().memory_cap() / 4);
+	}
+
+	void Disk_Thread::wake()
+	{
+		uint64_t one = 1;
+		if (write(wake_fd, &one, sizeof(one)) < 0)
+			std::cerr << "Failed to wake the disk thread" << std::endl;
+	}
+
+	Disk_Thread& disk_thread()
+	{
+		static Disk_Thread thread;
+		static std::once_flag started;
+
+		std::call_once(started, []() { thread.start(default_options); });
+		return thread;
+	}
+}
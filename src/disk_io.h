@@ -0,0 +1,136 @@
+
+#ifndef _DISK_IO_H_
+#define _DISK_IO_H_
+
+#include "buffer_pool.h"
+#include "storage.h"
+#include "uring.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+
+#define DISK_FLUSH_BYTES (8 * 1024 * 1024) // pending writes of this many bytes go to disk right away
+#define DISK_FLUSH_DELAY_MS 20             // a piece waits at most this long for the pieces next to it to coalesce with
+#define DISK_URING_ENTRIES 256             // submission queue size, a flush with more writes submits them in batches
+#define DISK_URING_FIXED_BUFFERS 1024      // registered buffer slots, pool buffers past this are written without one
+
+namespace DiskIo
+{
+	struct Options
+	{
+		bool use_io_uring = false; // falls back to pwritev where io_uring is unavailable
+		bool sync_pieces = false;  // fdatasync the files a run touched before its pieces count as written
+	};
+
+	extern Options default_options; // the process wide disk thread starts with these
+
+	struct Stats
+	{
+		uint64_t pieces_written = 0;
+		uint64_t runs_written = 0; // coalesced writes, adjacent pieces go to disk as one
+		uint64_t bytes_written = 0;
+		uint64_t failed_pieces = 0;
+		uint64_t syscalls = 0; // pwritev and fdatasync, or io_uring_enter and io_uring_register plus any pwritev fallback
+	};
+
+	// Writes verified pieces on a thread of its own, so the peer threads never wait for the disk. Pieces are handed over
+	// through a lock-free stack the thread takes whole, and held for up to DISK_FLUSH_DELAY_MS: pieces that finish close
+	// together are mostly neighbours, adjacent ones are written with one pwritev per file, and the runs go out sorted by
+	// offset, upwards from where the last flush ended (elevator order) so the writes sweep across the files.
+	// With io_uring the writes of a whole flush go to the kernel in one io_uring_enter(), a piece that fills a span on its
+	// own is written from its registered pool buffer (WRITE_FIXED) and with sync_pieces each write is linked to its fdatasync.
+	class Disk_Thread
+	{
+	public:
+		~Disk_Thread();
+
+		void start(const Options& options = Options());
+
+		void stop(); // writes what is still queued first
+
+		bool is_using_io_uring() const { return ring.is_open(); }
+
+		// Queues the piece for writing, the buffer goes with it and back to the pool once the data is on disk. on_complete
+		// gets 0 or -1 on the disk thread afterwards, the piece is readable from storage by then. Never blocks.
+		void write_piece(Storage::File_Storage& storage, int piece_index, BufferPool::Piece_Buffer buffer, std::function<void(int result)> on_complete);
+
+		Stats stats() const;
+
+	private:
+		using Clock = std::chrono::steady_clock;
+		using Job_Key = std::pair<Storage::File_Storage*, int>; // (storage, piece index) sorts the pieces of a torrent by offset
+
+		struct Write_Job
+		{
+			Storage::File_Storage* storage = nullptr;
+			int piece_index = 0;
+			BufferPool::Piece_Buffer buffer;
+			std::function<void(int)> on_complete;
+			Write_Job* next = nullptr; // in the submitted stack
+		};
+
+		// Adjacent pieces of one storage and the file spans they are written to
+		struct Write_Run
+		{
+			std::vector<std::unique_ptr<Write_Job>> jobs;
+			std::vector<Storage::File_Span> spans;
+			std::vector<std::vector<iovec>> span_iovecs; // the piece data of each span, pointing into the job buffers
+			std::vector<int> span_jobs;                  // job whose buffer holds the start of each span
+			size_t bytes = 0;
+			int result = 0;
+		};
+
+		void disk_loop();
+
+		void take_jobs(); // moves the submitted stack into pending
+
+		void flush(); // writes every pending piece
+
+		void prepare_run(Write_Run& run);
+
+		int write_run(Write_Run& run, uint64_t& syscalls); // pwritev (and fdatasync) on this thread
+
+		void write_runs_uring(std::vector<Write_Run>& runs, uint64_t& syscalls);
+
+		int fixed_slot(const BufferPool::Piece_Buffer& buffer); // registered slot of the buffer, -1 if it can't have one
+
+		void complete_run(Write_Run& run, uint64_t syscalls);
+
+		size_t flush_threshold() const;
+
+		void wake();
+
+		std::atomic<Write_Job*> submitted{nullptr}; // producers push, the disk thread exchanges it for nullptr
+		std::multimap<Job_Key, std::unique_ptr<Write_Job>> pending; // disk thread only
+		size_t pending_bytes = 0;
+		Clock::time_point oldest_pending;
+		Job_Key head{nullptr, 0}; // past the last piece written, the next flush carries on upwards from here
+
+		Options options;
+		Uring::Ring ring;                                 // open while io_uring is used
+		std::unordered_map<const char*, int> fixed_slots; // pool buffer -> registered slot
+		uint64_t fixed_generation = 0;                    // pool mapping generation the registrations belong to
+		bool has_fixed_slots = false;
+
+		Stats counters;
+		mutable std::mutex stats_mutex;
+		std::mutex start_mutex;
+		int wake_fd = -1; // eventfd, signalled by a push onto an empty stack and by stop()
+		std::atomic<bool> is_running = false;
+		std::thread io_thread;
+	};
+
+	Disk_Thread& disk_thread(); // process wide, started on first use
+}
+
+#endif
@@ -1,58 +1,81 @@
 
 #include "downloader.h"
 #include "network_helper.h"
-
+#include "pex.h"
+#include "web_seed.h"
+#include "listener.h"
+#include "upload.h"
+#include "connector.h"
+#include "timer_wheel.h"
+#include "disk_io.h"
+
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <algorithm>
-#include <queue>
-#include <fstream>
-#include <filesystem>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <utility>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 #define BLOCK_SIZE_FOR_PIECE (16 * 1024)
-#define REQUEST_PIPELINE_LEN 5
+#define REQUEST_PIPELINE_LEN 5    // requests in flight for a peer we know nothing about yet
+#define REQUEST_PIPELINE_MAX 64   // requests in flight for the fastest peers
+#define REQUEST_QUEUE_TIME_SEC 3  // a peer's pipeline holds what it delivers in this much time
+#define PEER_SNUB_TIMEOUT_SEC 20  // no block for this long while we wait for one and the peer is snubbing us
+#define PEER_RATE_SMOOTHING 0.3   // weight of the newest sample in the smoothed rate and latency
+#define PEER_MIN_SCORED_PIECES 3  // pieces a peer downloads before it can be evicted as slow
+#define PEER_SLOW_RATE_DIVISOR 8  // slower than the fastest connected peer by this factor is too slow
+#define MAX_FAILED_COPIES 4       // bad copies kept per piece for attribution, bounds the memory a poisoned piece costs
+#define PEER_KEEPALIVE_INTERVAL_SEC 90 // peers drop connections that stayed silent for two minutes
+#define BLOCK_REQUEST_TIMEOUT_SEC 15   // a requested block that takes longer is cancelled and requested from another peer
+#define ACTIVE_PIECE_POLL_MS 1000      // how often a thread with nothing to request looks for blocks given back
+#define PIECE_BUFFER_POLL_MS 50        // how often a thread waiting for piece memory looks for a free buffer
+#define PEER_CHOKED_TIMEOUT_SEC 60     // a peer that keeps us choked this long gives its download thread to another candidate
+#define MAX_PEER_CONNECTIONS 10 // download threads, each one holds a connection to one peer at a time
 
 namespace Downloader
 {
 	std::vector<std::thread> thread_pool;
-	std::queue<Piece_Info> pieces_queue;
-	std::mutex queue_mutex;
-
-	class piece_comparator
-	{
-		public:
-			bool operator()(const Piece_Info& first, const Piece_Info& second)
-			{
-				return first.piece_index > second.piece_index; // swaps if false
-			}
-	};
-
-	std::priority_queue<Piece_Info, std::vector<Piece_Info>, piece_comparator> downloaded_piece_pq;
-	std::mutex pq_mutex;
+	std::deque<Piece_Info> pieces_queue;
+	std::list<Piece_Info> active_pieces; // pieces blocks are being requested for, possibly by several threads at once
+	int pieces_writing = 0;              // verified pieces the disk thread hasn't written yet
+	std::mutex queue_mutex;              // guards the three, and the block state of active pieces
+	Network::Connector connector;
 
 	int start_downloader(Torrent::TorrentData &torrent_data, int piece_index)
 	{
-		populate_work_queue(torrent_data, piece_index);
+		if (torrent_data.storage.open(torrent_data, piece_index) != 0)
+			return -1;
 
-		// determine thread pool size (each thread is a connection to a peer)
-		// pool_size = min(peers, pieces, threshold) else 1 if piece_index is provided
-		int pool_size = 0;
+		populate_work_queue(torrent_data, piece_index);
 
-		if (piece_index >= 0)
+		// verified pieces are served to incoming peers while we keep downloading
+		if (torrent_data.listener)
 		{
-			pool_size = 1; // downloading a single piece
+			torrent_data.choker.start(&torrent_data);
+			torrent_data.listener->add_torrent(&torrent_data);
 		}
-		else
-		{
-			pool_size = std::min(torrent_data.peers.size(), torrent_data.piece_hashes.size());
-			int pool_threshold = 10;
 
-			if (pool_size > pool_threshold)
-				pool_size = pool_threshold;
-		}
+		// determine thread pool size (each thread is a connection to a peer)
+		// pool_size = min(blocks, threshold), pieces are striped over peers at block granularity so even a
+		// single piece keeps several connections busy. It is sized for the connections we want rather than the
+		// peers known right now, trackers, the DHT and PEX keep adding candidates and idle threads pick them up.
+		size_t block_count = 0;
+
+		for (const auto& piece : pieces_queue)
+			block_count += (piece.piece_len + BLOCK_SIZE_FOR_PIECE - 1) / BLOCK_SIZE_FOR_PIECE;
+
+		int pool_size = std::min<size_t>(MAX_PEER_CONNECTIONS, block_count);
 
 		auto start = std::chrono::high_resolution_clock::now();
+
+		// candidates are connected to in the background, the threads take whichever connection is ready first
+		connector.start(&torrent_data.peers, torrent_data.utp.get());
 		
 		if (initialize_thread_pool(pool_size, torrent_data) != 0)
 		{
@@ -62,9 +85,16 @@ namespace Downloader
 
 		wait_for_download(torrent_data);
 
+		if (piece_index < 0 && torrent_data.verified == torrent_data.length)
+			torrent_data.announcer.announce_completed();
+
 		auto stop = std::chrono::high_resolution_clock::now();
 		std::cout << "Time taken for download: " << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << " ms\n";
 
+		DiskIo::Stats disk_stats = DiskIo::disk_thread().stats();
+		std::cout << "Wrote " << disk_stats.pieces_written << " pieces in " << disk_stats.runs_written << " coalesced writes"
+				  << (DiskIo::disk_thread().is_using_io_uring() ? " with io_uring" : "") << "\n";
+
 		return 0;
 	}
 
@@ -72,161 +102,458 @@ namespace Downloader
 	{
 		std::cout << "Creating " << pool_size << " threads in the pool..." << std::endl;
 
-		for (int peer_index = 0; peer_index < pool_size; ++peer_index)
-			thread_pool.emplace_back(thread_function, &torrent_data, peer_index);
+		for (int thread_index = 0; thread_index < pool_size; ++thread_index)
+			thread_pool.emplace_back(thread_function, &torrent_data, thread_index);
+
+		// web seeds come on top of the peer connections, each one is a single high bandwidth source
+		for (const auto& url : torrent_data.url_list)
+			thread_pool.emplace_back(web_seed_function, &torrent_data, url);
 
 		return 0;
 	}
 
-	void thread_function(Torrent::TorrentData* torrent_data, int peer_index)
+	int claim_peer(Torrent::TorrentData* torrent_data, int& peer_socket)
+	{
+		peer_socket = -1;
+		int peer_index = connector.take(std::chrono::seconds(1), peer_socket);
+
+		// every candidate is busy, backing off or retired, ask the trackers for fresh ones (appended after the known ones)
+		if (peer_index < 0)
+			torrent_data->announcer.request_peers();
+		else
+			torrent_data->peers.mark_tried(peer_index);
+
+		return peer_index;
+	}
+
+	static void schedule_keepalive(const std::shared_ptr<Network::Peer_Timers>& timers)
+	{
+		// a timer that fires after the connection went away finds nothing to wake
+		std::weak_ptr<Network::Peer_Timers> weak_timers = timers;
+
+		auto keepalive_timer = Timer::shared_wheel().schedule(std::chrono::seconds(PEER_KEEPALIVE_INTERVAL_SEC), [weak_timers]() {
+			if (auto timers = weak_timers.lock())
+			{
+				std::unique_lock<std::mutex> lock(timers->timers_mutex);
+				timers->is_keepalive_due = true;
+				lock.unlock();
+
+				timers->wake();
+			}
+		});
+
+		std::unique_lock<std::mutex> lock(timers->timers_mutex);
+		timers->keepalive_timer = keepalive_timer;
+	}
+
+	static Timer::Timer_Id schedule_request_timeout(const std::shared_ptr<Network::Peer_Timers>& timers, int piece_index, int block)
+	{
+		std::weak_ptr<Network::Peer_Timers> weak_timers = timers;
+
+		return Timer::shared_wheel().schedule(std::chrono::seconds(BLOCK_REQUEST_TIMEOUT_SEC), [weak_timers, piece_index, block]() {
+			if (auto timers = weak_timers.lock())
+			{
+				std::unique_lock<std::mutex> lock(timers->timers_mutex);
+				timers->expired_requests.emplace_back(piece_index, block);
+				lock.unlock();
+
+				timers->wake();
+			}
+		});
+	}
+
+	void start_peer_timers(Network::Peer& peer)
+	{
+		peer.timers = std::make_shared<Network::Peer_Timers>();
+		schedule_keepalive(peer.timers);
+	}
+
+	void stop_peer_timers(Network::Peer& peer)
+	{
+		if (!peer.timers)
+			return;
+
+		// only the thread that owns the connection reschedules the keep-alive, the id can't change under us
+		Timer::shared_wheel().cancel(peer.timers->keepalive_timer);
+		peer.timers.reset();
+	}
+
+	int wait_for_peer(Network::Peer& peer, std::chrono::steady_clock::time_point deadline)
 	{
 		while (true)
 		{
-			std::unique_lock<std::mutex> lock(queue_mutex);
-			
-			if (pieces_queue.empty())
-				break;
+			auto timeout = std::chrono::milliseconds::max();
+			if (deadline != std::chrono::steady_clock::time_point::max())
+				timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
 
-			auto piece_info = std::move(pieces_queue.front());
-			pieces_queue.pop();
+			int ready = Network::wait_readable(peer.peer_socket, timeout, peer.timers ? peer.timers->wake_fd : -1);
+			if (ready != 2)
+				return ready;
 
+			std::unique_lock<std::mutex> lock(peer.timers->timers_mutex);
+			bool is_keepalive_due = std::exchange(peer.timers->is_keepalive_due, false);
+			bool has_expired_requests = !peer.timers->expired_requests.empty();
 			lock.unlock();
 
-			if (piece_info.downloaded_len < piece_info.piece_len)
+			if (is_keepalive_due)
 			{
-				try
+				if (Network::send_keepalive(peer.peer_socket) != 0)
+					return -1;
+
+				schedule_keepalive(peer.timers);
+			}
+
+			if (has_expired_requests)
+				return 2;
+		}
+	}
+
+	// A peer that stops in the middle of a msg would keep us in recv, the stall timer shuts the socket down under it
+	static void receive_msg(Network::Peer& peer, Network::Peer_Msg& peer_msg)
+	{
+		int peer_socket = peer.peer_socket;
+		auto stall_timer = Timer::shared_wheel().schedule(std::chrono::seconds(PEER_SNUB_TIMEOUT_SEC), [peer_socket]() { shutdown(peer_socket, SHUT_RDWR); });
+
+		int result = Network::receive_peer_msg(peer_socket, peer_msg);
+		Timer::shared_wheel().cancel(stall_timer);
+
+		if (result != 0)
+			throw std::runtime_error("Failed to receive peer msgs");
+	}
+
+	// left over from requests of an earlier piece when nothing is outstanding
+	static void drop_expired_requests(Network::Peer& peer)
+	{
+		std::unique_lock<std::mutex> lock(peer.timers->timers_mutex);
+		peer.timers->expired_requests.clear();
+	}
+
+	// Next msg that isn't a keep-alive, keep-alives of our own go out while we wait
+	static Network::Peer_Msg next_peer_msg(Network::Peer& peer, std::chrono::steady_clock::time_point deadline)
+	{
+		while (true)
+		{
+			int ready = wait_for_peer(peer, deadline);
+			if (ready < 0)
+				throw std::runtime_error("Failed to wait for peer msgs");
+
+			if (ready == 0)
+				throw std::runtime_error("Timed out waiting for peer msgs");
+
+			if (ready == 2)
+			{
+				drop_expired_requests(peer);
+				continue;
+			}
+
+			Network::Peer_Msg peer_msg;
+			receive_msg(peer, peer_msg);
+
+			if (peer_msg.total_bytes != 0)
+				return peer_msg;
+		}
+	}
+
+	void disconnect_peer(Torrent::TorrentData* torrent_data, Network::Peer& peer)
+	{
+		if (peer.peer_socket > 0)
+		{
+			close(peer.peer_socket);
+			torrent_data->peers.set_connected(peer.address, false);
+		}
+
+		peer.peer_socket = 0;
+		stop_peer_timers(peer);
+		peer.download_bucket.reset();
+
+		// a reconnect starts from scratch, the peer forgets everything about this connection
+		peer.have_cursor = 0;
+		peer.download_rate = 0;
+		peer.block_latency_ms = 0;
+		peer.scored_pieces = 0;
+		peer.is_snubbed = false;
+		peer.am_choking = true;
+		peer.am_interested = false;
+		peer.peer_choking = true;
+		peer.peer_interested = false;
+		peer.has_all = false;
+		peer.bitfield.clear();
+		peer.allowed_fast.clear();
+		peer.suggested_pieces.clear();
+	}
+
+	void thread_function(Torrent::TorrentData* torrent_data, int thread_index)
+	{
+		int peer_socket = -1;
+		int peer_index = claim_peer(torrent_data, peer_socket);
+
+		while (has_remaining_work())
+		{
+			if (peer_index < 0)
+			{
+				// nothing connected in time, the connector keeps trying the candidates the trackers find
+				peer_index = claim_peer(torrent_data, peer_socket);
+				continue;
+			}
+
+			Network::Peer& peer = torrent_data->peers[peer_index];
+			int piece_index = -1;
+
+			// another thread may have found the peer's blocks in a piece that failed its hash check
+			if (torrent_data->peers.is_banned(peer_index))
+			{
+				std::cout << "Dropping banned peer " << peer.value() << "\n";
+
+				if (peer_socket >= 0)
+					close(std::exchange(peer_socket, -1));
+
+				disconnect_peer(torrent_data, peer);
+				torrent_data->peers.release(peer_index);
+				peer_index = claim_peer(torrent_data, peer_socket);
+				continue;
+			}
+
+			try
+			{
+				if (peer_socket >= 0)
 				{
-					download_piece(torrent_data, piece_info, peer_index);
+					int connected_socket = std::exchange(peer_socket, -1);
+
+					// the metadata exchange of a magnet link may have left its connection to this peer open
+					if (peer.peer_socket != 0)
+					{
+						close(connected_socket);
+
+						if (!peer.timers)
+							start_peer_timers(peer);
+					}
+					else if (!connect_to_peer(torrent_data, peer, connected_socket))
+					{
+						std::cout << "Peer " << peer.value() << " kept us choked, trying another peer\n";
+
+						disconnect_peer(torrent_data, peer);
+						torrent_data->peers.release(peer_index, std::chrono::seconds(PEER_IDLE_BACKOFF_SEC));
+						peer_index = claim_peer(torrent_data, peer_socket);
+						continue;
+					}
+				}
+
+				Piece_Info* piece = take_piece(peer, peer_index);
 
-					std::unique_lock<std::mutex> lock(pq_mutex);
-					downloaded_piece_pq.push(std::move(piece_info));
+				if (!piece && peer.peer_choking && has_wanted_piece(peer))
+				{
+					// nothing we may request while choked, wait for the unchoke (or another Allowed Fast piece)
+					if (!handle_unchoke_msg(torrent_data, peer))
+					{
+						// not a failure, another candidate takes the slot while this one backs off
+						std::cout << "Peer " << peer.value() << " kept us choked, trying another peer\n";
+
+						disconnect_peer(torrent_data, peer);
+						torrent_data->peers.release(peer_index, std::chrono::seconds(PEER_IDLE_BACKOFF_SEC));
+						peer_index = claim_peer(torrent_data, peer_socket);
+					}
+
+					continue;
 				}
-				catch (const std::exception& e)
+
+				if (!piece && has_wanted_piece(peer))
 				{
-					std::cerr << "Failed to download piece " << piece_info.piece_index << ". Err: " << e.what() << "\n";
+					// the piece memory is used up, a buffer frees up as soon as a verified piece is on disk
+					wait_for_pieces(torrent_data, peer, std::chrono::milliseconds(PIECE_BUFFER_POLL_MS));
+					continue;
+				}
 
-					std::unique_lock<std::mutex> lock(queue_mutex);
-					pieces_queue.push(piece_info);
-					lock.unlock();
+				if (!piece && has_active_piece(peer))
+				{
+					// every block left is requested from other peers, stay connected in case one of them doesn't deliver
+					wait_for_pieces(torrent_data, peer, std::chrono::milliseconds(ACTIVE_PIECE_POLL_MS));
+					continue;
+				}
+
+				if (!piece && is_writing_last_pieces())
+				{
+					// a failed write puts its piece back in the queue, the connection is kept until the writes are done
+					wait_for_pieces(torrent_data, peer, std::chrono::milliseconds(ACTIVE_PIECE_POLL_MS));
+					continue;
+				}
+
+				if (!piece)
+				{
+					if (!has_remaining_work())
+						break;
+
+					// not a failure, the peer may have picked up more pieces by the time it comes around again
+					std::cout << "Peer " << peer.value() << " has none of the remaining pieces\n";
+
+					disconnect_peer(torrent_data, peer);
+					torrent_data->peers.release(peer_index, std::chrono::seconds(PEER_IDLE_BACKOFF_SEC));
+					peer_index = claim_peer(torrent_data, peer_socket);
+					continue;
+				}
+
+				// the piece is left (and verified by the last peer to leave it) before download_piece returns
+				piece_index = piece->piece_index;
+
+				if (download_piece(torrent_data, *piece, peer_index))
+				{
+					torrent_data->peers.reset_failures(peer_index);
+
+					if (is_slow_peer(torrent_data, peer, peer_index))
+					{
+						std::cout << "Evicting slow peer " << peer.value() << " (" << static_cast<int64_t>(peer.download_rate / 1024) << " KB/s)\n";
+
+						disconnect_peer(torrent_data, peer);
+						torrent_data->peers.release(peer_index, std::chrono::seconds(PEER_SLOW_BACKOFF_SEC));
+						peer_index = claim_peer(torrent_data, peer_socket);
+					}
+				}
+				else if (peer.is_snubbed)
+				{
+					std::cout << "Peer " << peer.value() << " is snubbing us, handing piece " << piece_index << " to another peer\n";
+
+					disconnect_peer(torrent_data, peer);
+					torrent_data->peers.release(peer_index, std::chrono::seconds(PEER_SLOW_BACKOFF_SEC));
+					peer_index = claim_peer(torrent_data, peer_socket);
+				}
+				else
+				{
+					// the peer choked us with none of our requests outstanding, another thread can finish the piece right away
+					std::cout << "Peer " << peer.value() << " choked us, handing piece " << piece_index << " to another peer\n";
 				}
 			}
+			catch (const std::exception& e)
+			{
+				if (piece_index >= 0)
+					std::cerr << "Failed to download piece " << piece_index << ". Err: " << e.what() << "\n";
+				else
+					std::cerr << "Failed to use peer " << peer.value() << ". Err: " << e.what() << "\n";
+
+				// move on to the next candidate, this one backs off before it is tried again
+				disconnect_peer(torrent_data, peer);
+				torrent_data->peers.release_failed(peer_index);
+				peer_index = claim_peer(torrent_data, peer_socket);
+			}
 		}
 
-		std::cout << "Thread #" << peer_index << " exiting...\n";
+		if (peer_index >= 0)
+		{
+			if (peer_socket >= 0)
+				close(peer_socket);
+
+			disconnect_peer(torrent_data, torrent_data->peers[peer_index]);
+			torrent_data->peers.release(peer_index);
+		}
+
+		std::cout << "Thread #" << thread_index << " exiting...\n";
 	}
 
-	int write_multi_file_torrent(const Torrent::TorrentData &torrent_data)
+	void web_seed_function(Torrent::TorrentData* torrent_data, std::string url)
 	{
-		// Create base directory if specified
-		std::string base_path = torrent_data.out_file;
-		if (torrent_data.is_multi_file && !torrent_data.name.empty()) {
-			base_path = torrent_data.out_file + "/" + torrent_data.name;
-			std::filesystem::create_directories(base_path);
-		}
+		WebSeed::Web_Seed web_seed(url);
+		int failures = 0;
 
-		// Collect all piece data in order
-		std::vector<std::string> all_data;
-		all_data.resize(torrent_data.piece_hashes.size());
-		
-		while (!downloaded_piece_pq.empty()) {
-			auto piece = std::move(downloaded_piece_pq.top());
-			downloaded_piece_pq.pop();
-
-			// Read piece data
-			std::ifstream piece_file(piece.piece_file, std::ios::binary);
-			if (!piece_file.is_open()) {
-				std::cerr << "Failed to open piece file: " << piece.piece_file << "\n";
-				return -1;
+		while (failures < WEB_SEED_MAX_FAILURES)
+		{
+			// take the next piece plus the ones directly after it, so that one range request covers all of them
+			std::vector<Piece_Info> run;
+			int64_t run_len = 0;
+			bool is_out_of_memory = false;
+
+			std::unique_lock<std::mutex> lock(queue_mutex);
+
+			while (!pieces_queue.empty() && run_len < WEB_SEED_MAX_RUN_BYTES
+				   && (run.empty() || pieces_queue.front().piece_index == run.back().piece_index + 1))
+			{
+				// the run ends where the piece memory does
+				Piece_Info& piece = pieces_queue.front();
+				if (piece.piece_data.empty())
+					piece.piece_data = BufferPool::piece_buffers().try_acquire(piece.piece_len);
+
+				if (piece.piece_data.empty())
+				{
+					is_out_of_memory = true;
+					break;
+				}
+
+				run_len += piece.piece_len;
+				run.push_back(std::move(piece));
+				pieces_queue.pop_front();
 			}
-			
-			std::string piece_data((std::istreambuf_iterator<char>(piece_file)),
-			                       std::istreambuf_iterator<char>());
-			all_data[piece.piece_index] = std::move(piece_data);
-			
-			piece_file.close();
-			std::remove(piece.piece_file.c_str());
-		}
-
-		// Concatenate all piece data
-		std::string complete_data;
-		for (const auto& piece_data : all_data) {
-			complete_data += piece_data;
-		}
-
-		// Write data to individual files
-		size_t data_offset = 0;
-		for (const auto& file_info : torrent_data.files) {
-			// Build file path
-			std::string file_path = base_path;
-			for (const auto& path_component : file_info.path) {
-				file_path += "/" + path_component;
+
+			lock.unlock();
+
+			if (run.empty() && is_out_of_memory)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(PIECE_BUFFER_POLL_MS));
+				continue;
 			}
-			
-			// Create directory structure
-			std::filesystem::create_directories(std::filesystem::path(file_path).parent_path());
-			
-			// Write file data
-			std::ofstream output_file(file_path, std::ios::binary);
-			if (!output_file.is_open()) {
-				std::cerr << "Failed to create file: " << file_path << "\n";
-				return -1;
+
+			if (run.empty())
+				break;
+
+			// web seeds count against the torrent's download limit like peers do, a run waits until it fits in
+			std::this_thread::sleep_for(torrent_data->download_bucket.delay());
+			torrent_data->download_bucket.consume(run_len);
+
+			int64_t run_offset = static_cast<int64_t>(run.front().piece_index) * torrent_data->piece_length;
+			std::string run_data;
+
+			std::cout << "Downloading pieces " << run.front().piece_index << "-" << run.back().piece_index << " from web seed " << url << "\n";
+
+			if (web_seed.fetch_range(*torrent_data, run_offset, run_len, run_data) != 0)
+			{
+				++failures;
+
+				for (auto& piece : run)
+					requeue_piece(std::move(piece));
+
+				std::this_thread::sleep_for(std::chrono::seconds(failures));
+				continue;
 			}
-			
-			if (data_offset + file_info.length <= complete_data.size()) {
-				output_file.write(complete_data.data() + data_offset, file_info.length);
-				data_offset += file_info.length;
-			} else {
-				std::cerr << "Error: Not enough data for file " << file_path << "\n";
-				return -1;
+
+			failures = 0;
+			torrent_data->downloaded += run_len;
+
+			size_t piece_offset = 0;
+			for (auto& piece : run)
+			{
+				std::copy_n(run_data.data() + piece_offset, piece.piece_len, piece.piece_data.data());
+				piece.downloaded_len = piece.piece_len;
+				piece.completed_blocks.assign((piece.piece_len + BLOCK_SIZE_FOR_PIECE - 1) / BLOCK_SIZE_FOR_PIECE, true);
+				piece.block_sources.assign(piece.completed_blocks.size(), -1);
+				piece_offset += piece.piece_len;
+
+				try
+				{
+					verify_piece_hash(torrent_data, piece);
+				}
+				catch (const std::exception& e)
+				{
+					std::cerr << "Failed to download piece " << piece.piece_index << " from web seed. Err: " << e.what() << "\n";
+					++failures;
+					requeue_piece(std::move(piece));
+				}
 			}
-			
-			output_file.close();
-			std::cout << "Created file: " << file_path << " (" << file_info.length << " bytes)\n";
 		}
 
-		return 0;
+		std::cout << "Web seed " << url << (failures >= WEB_SEED_MAX_FAILURES ? " gave up" : " finished") << "\n";
 	}
 
-	int wait_for_download(const Torrent::TorrentData &torrent_data)
+	int wait_for_download(Torrent::TorrentData &torrent_data)
 	{
-
 		for (auto& thread : thread_pool)
 			thread.join();
 
-		// Handle multi-file torrents differently
-		if (torrent_data.is_multi_file) {
-			return write_multi_file_torrent(torrent_data);
-		}
+		connector.stop();
 
-		// Original single-file logic
-		std::ofstream output_file(torrent_data.out_file, std::ios::binary | std::ios::out);
-		if (!output_file.is_open())
+		// every verified piece is already in place, stop uploading before the files go away
+		if (torrent_data.listener)
 		{
-			std::cerr << "Failed to open output file: " << torrent_data.out_file << "\n";
-			return -1;
-		}
-		
-		while (!downloaded_piece_pq.empty())
-		{
-			auto piece = std::move(downloaded_piece_pq.top());
-			downloaded_piece_pq.pop();
-
-			// Read piece file and write to actual file
-			std::ifstream piece_file(piece.piece_file, std::ios::binary | std::ios::in);
-			if (!piece_file.is_open())
-			{
-				std::cerr << "Failed to open output file: " << piece.piece_file << "\n";
-				output_file.close();
-				return -1;
-			}
-
-			output_file << piece_file.rdbuf();
-
-			piece_file.close();
-			std::remove(piece.piece_file.c_str());
+			torrent_data.listener->remove_torrent(torrent_data.info_hash);
+			torrent_data.choker.stop();
 		}
 
-		output_file.close();
+		torrent_data.storage.close();
 		return 0;
 	}
 
@@ -246,155 +573,782 @@ namespace Downloader
 			curr_total_len -= piece.piece_len;
 
 			if (piece_index < 0 || curr_piece_index == piece_index)
-				pieces_queue.push(std::move(piece));
+				pieces_queue.push_back(std::move(piece));
 		}
 
 		assert(curr_total_len == 0);
 		std::cout << "Populated pieces work queue. Size: " << pieces_queue.size() << std::endl;
 	}
 
-	void download_piece(Torrent::TorrentData *torrent_data, Piece_Info &piece, int peer_index)
+	void requeue_piece(Piece_Info&& piece)
 	{
-		piece.piece_data.clear(); // clear any previous half downloaded piece data
-		piece.downloaded_len = 0;
-		piece.piece_data.resize(piece.piece_len, '\0');
+		std::unique_lock<std::mutex> lock(queue_mutex);
 
-		std::cout << "Downloading piece: " << piece.piece_index << " in Thread #" << peer_index << "\n";
+		if (piece.downloaded_len > 0)
+			pieces_queue.push_front(std::move(piece));
+		else
+			pieces_queue.push_back(std::move(piece));
+	}
 
-		Network::Peer& peer = torrent_data->peers[peer_index];
-		if (peer.peer_socket == 0)
+	bool connect_to_peer(Torrent::TorrentData* torrent_data, Network::Peer& peer, int peer_socket)
+	{
+		if (Network::receive_peer_id_with_handshake(*torrent_data, peer, peer_socket) != 0)
+			throw std::runtime_error("Failed to connect to peer");
+
+		if (peer.connect_rtt.count() > 0)
+			std::cout << "Connected to peer " << peer.value() << (peer.is_utp ? " over uTP" : "") << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(peer.connect_rtt).count() << " ms\n";
+
+		torrent_data->peers.set_connected(peer.address, true);
+		start_peer_timers(peer);
+
+		if (not peer.supports_extensions)
 		{
-			if (Network::receive_peer_id_with_handshake(*torrent_data, peer.value(), peer) != 0)
-				throw std::runtime_error("Failed to connect to peer");
+			// the extension handshake already received the bitfield otherwise
+			handle_bitfield_msg(peer);
+		}
 
-			if (not torrent_data->is_magnet_download)
-			{
-				// receive and skip bitfield
-				handle_bitfield_msg(peer.peer_socket);
-			}
+		// send interested and receive unchoke msg, unless the peer has nothing for us (the caller moves on then)
+		return !has_wanted_piece(peer) || handle_unchoke_msg(torrent_data, peer);
+	}
 
-			// send interested and receive unchoke msg
-			handle_unchoke_msg(peer.peer_socket);
+	// first block of an active piece that is neither complete nor requested from some peer, -1 if there is none
+	static int next_unclaimed_block(const Piece_Info& piece, const std::set<int>& skipped_blocks = {})
+	{
+		for (size_t block = 0; block < piece.completed_blocks.size(); ++block)
+		{
+			if (!piece.completed_blocks[block] && piece.block_sources[block] < 0 && !skipped_blocks.contains(block))
+				return block;
 		}
-		std::cout << "Peer connected for piece #" << piece.piece_index << "\n";
-		// send request messages
-		handle_request_msgs(piece, peer);
 
-		if (piece.downloaded_len == piece.piece_len)
-			verify_piece_hash(piece, torrent_data->out_file);
+		return -1;
 	}
 
-	void handle_bitfield_msg(int peer_socket)
+	bool has_remaining_work()
 	{
-		std::vector<Network::Peer_Msg> peer_msgs;
-		Network::receive_peer_msgs(peer_socket, peer_msgs, 1);
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		return !pieces_queue.empty() || !active_pieces.empty() || pieces_writing > 0;
+	}
 
-		if (peer_msgs.size() != 1 && peer_msgs[0].msg_type != message_type::BITFIELD)
-			throw std::runtime_error("Expected bit field msg but got " + peer_msgs[0].msg_type);
+	bool is_writing_last_pieces()
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		return pieces_queue.empty() && active_pieces.empty() && pieces_writing > 0;
 	}
 
-	void handle_unchoke_msg(int peer_socket)
+	bool has_active_piece(const Network::Peer& peer)
 	{
-		// Interested msg
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		return std::any_of(active_pieces.begin(), active_pieces.end(), [&peer](const Piece_Info& piece) { return peer.has_piece(piece.piece_index); });
+	}
+
+	void wait_for_pieces(Torrent::TorrentData* torrent_data, Network::Peer& peer, std::chrono::milliseconds timeout)
+	{
+		int ready = wait_for_peer(peer, std::chrono::steady_clock::now() + timeout);
+		if (ready < 0)
+			throw std::runtime_error("Failed to wait for peer msgs");
+
+		if (ready == 2)
+			drop_expired_requests(peer);
+
+		if (ready != 1)
+			return;
+
 		Network::Peer_Msg peer_msg;
-		peer_msg.msg_type = message_type::INTERESTED;
+		receive_msg(peer, peer_msg);
 
-		std::vector<Network::Peer_Msg> peer_msgs{peer_msg};
-		if (Network::send_peer_msgs(peer_socket, peer_msgs) != 0)
-			throw std::runtime_error("Error when sending interested msg");
+		if (peer_msg.total_bytes != 0)
+			handle_peer_msg(torrent_data, peer, peer_msg);
+	}
 
-		Network::receive_peer_msgs(peer_socket, peer_msgs, 1);
-		if (peer_msgs.size() != 1 && peer_msgs[0].msg_type != message_type::UNCHOKE)
-			throw std::runtime_error("Error when receiving unchoke"); // try loop instead?
+	bool has_wanted_piece(const Network::Peer& peer)
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
 
+		return std::any_of(pieces_queue.begin(), pieces_queue.end(), [&peer](const Piece_Info& piece) { return peer.has_piece(piece.piece_index); })
+			   || std::any_of(active_pieces.begin(), active_pieces.end(), [&peer](const Piece_Info& piece) {
+					  return peer.has_piece(piece.piece_index) && next_unclaimed_block(piece) >= 0;
+				  });
 	}
 
-	void handle_request_msgs(Piece_Info &piece, Network::Peer &peer)
+	Piece_Info* take_piece(const Network::Peer& peer, int peer_index)
 	{
-		int requests_sent = 0;
-		std::vector<Network::Peer_Msg> peer_msgs;
+		std::unique_lock<std::mutex> lock(queue_mutex);
+
+		auto may_take = [&peer](const Piece_Info& piece) {
+			return peer.has_piece(piece.piece_index) && (!peer.peer_choking || peer.allowed_fast.contains(piece.piece_index));
+		};
 
-		while (piece.downloaded_len < piece.piece_len)
+		// a piece this peer sent a bad copy of has to come from someone else, or the bad blocks can't be told apart
+		auto is_usable = [&may_take, peer_index](const Piece_Info& piece) {
+			return may_take(piece) && std::find(piece.excluded_peers.begin(), piece.excluded_peers.end(), peer_index) == piece.excluded_peers.end();
+		};
+
+		// join a piece other threads are downloading while it has blocks nobody requested yet, so that a large
+		// piece is striped over several peers instead of being limited to one connection
+		for (auto& piece : active_pieces)
 		{
-			// construct payload for the msg
-			auto index_bytes = Encoder::uint32_to_uint8(piece.piece_index);
-			auto begin_bytes = Encoder::uint32_to_uint8(requests_sent * BLOCK_SIZE_FOR_PIECE);
-			auto block_length = piece.piece_len - piece.downloaded_len < BLOCK_SIZE_FOR_PIECE ? piece.piece_len - piece.downloaded_len : BLOCK_SIZE_FOR_PIECE;
-			auto block_length_bytes = Encoder::uint32_to_uint8(block_length);
+			if (is_usable(piece) && next_unclaimed_block(piece) >= 0)
+			{
+				++piece.workers;
+				return &piece;
+			}
+		}
 
-			Network::Peer_Msg peer_msg;
-			peer_msg.msg_type = message_type::REQUEST;
-			peer_msg.payload.insert(peer_msg.payload.end(), index_bytes.begin(), index_bytes.end());
-			peer_msg.payload.insert(peer_msg.payload.end(), begin_bytes.begin(), begin_bytes.end());
-			peer_msg.payload.insert(peer_msg.payload.end(), block_length_bytes.begin(), block_length_bytes.end());
+		// finishing a started piece first frees its buffer and gets it verified (and uploaded) sooner
+		auto piece_it = std::find_if(pieces_queue.begin(), pieces_queue.end(), [&is_usable](const Piece_Info& piece) {
+			return piece.downloaded_len > 0 && is_usable(piece);
+		});
 
-			peer_msgs.push_back(peer_msg);
+		// a suggested piece is likely still in the seeder's cache, so it comes back fastest
+		for (auto suggested = peer.suggested_pieces.rbegin(); suggested != peer.suggested_pieces.rend() && piece_it == pieces_queue.end(); ++suggested)
+		{
+			piece_it = std::find_if(pieces_queue.begin(), pieces_queue.end(), [&is_usable, suggested](const Piece_Info& piece) {
+				return piece.piece_index == *suggested && is_usable(piece);
+			});
+		}
 
-			++requests_sent;
-			piece.downloaded_len += block_length;
+		if (piece_it == pieces_queue.end())
+			piece_it = std::find_if(pieces_queue.begin(), pieces_queue.end(), is_usable);
 
-			if ((requests_sent != 0 && requests_sent % 5 == 0) || piece.downloaded_len == piece.piece_len)
+		// nobody else has it, another strike is what bounds the retries with this peer
+		if (piece_it == pieces_queue.end())
+			piece_it = std::find_if(pieces_queue.begin(), pieces_queue.end(), may_take);
+
+		if (piece_it == pieces_queue.end())
+			return nullptr;
+
+		// a piece that was started before keeps its buffer and blocks, only what is missing gets requested
+		BufferPool::Piece_Buffer buffer;
+		bool is_new_piece = piece_it->piece_data.empty();
+
+		if (is_new_piece)
+			buffer = BufferPool::piece_buffers().try_acquire(piece_it->piece_len);
+
+		if (is_new_piece && buffer.empty())
+		{
+			// the piece memory is used up, no new piece is started until a buffer is given back
+			auto started_it = std::find_if(pieces_queue.begin(), pieces_queue.end(), [&may_take](const Piece_Info& piece) {
+				return !piece.piece_data.empty() && may_take(piece);
+			});
+
+			if (started_it != pieces_queue.end())
 			{
-				auto expected_responses = peer_msgs.size();
-				
-				if (Network::send_peer_msgs(peer.peer_socket, peer_msgs) != 0)
-					throw std::runtime_error("Failed to send peer msgs");
+				piece_it = started_it;
+				is_new_piece = false;
+			}
+			else
+			{
+				// the buffers may all sit in queued pieces no connected peer can finish, the least progressed of them
+				// starts over so its memory isn't stuck there
+				auto victim_it = pieces_queue.end();
+				for (auto it = pieces_queue.begin(); it != pieces_queue.end(); ++it)
+				{
+					if (!it->piece_data.empty() && it->piece_len >= piece_it->piece_len && (victim_it == pieces_queue.end() || it->downloaded_len < victim_it->downloaded_len))
+						victim_it = it;
+				}
+
+				if (victim_it == pieces_queue.end())
+					return nullptr;
+
+				victim_it->piece_data.reset();
+				victim_it->downloaded_len = 0;
+				victim_it->completed_blocks.clear();
+				victim_it->block_sources.clear();
 
-				handle_piece_msgs(piece, peer, expected_responses);
+				buffer = BufferPool::piece_buffers().try_acquire(piece_it->piece_len);
+				if (buffer.empty())
+					return nullptr;
 			}
 		}
+
+		Piece_Info& piece = active_pieces.emplace_back(std::move(*piece_it));
+		pieces_queue.erase(piece_it);
+
+		if (is_new_piece)
+		{
+			int block_count = (piece.piece_len + BLOCK_SIZE_FOR_PIECE - 1) / BLOCK_SIZE_FOR_PIECE;
+
+			piece.piece_data = std::move(buffer);
+			piece.downloaded_len = 0;
+			piece.completed_blocks.assign(block_count, false);
+			piece.block_sources.assign(block_count, -1);
+		}
+
+		piece.workers = 1;
+		return &piece;
 	}
 
-	void handle_piece_msgs(Piece_Info &piece, Network::Peer &peer, int expected_responses)
+	void leave_piece(Torrent::TorrentData* torrent_data, Piece_Info& piece, int peer_index)
 	{
-		std::vector<Network::Peer_Msg> peer_msgs;
+		std::unique_lock<std::mutex> lock(queue_mutex);
 
-		if (Network::receive_peer_msgs(peer.peer_socket, peer_msgs, expected_responses) != 0)
-			throw std::runtime_error("Failed to receive peer msgs");
+		// blocks still requested from this peer are up for grabs again
+		for (size_t block = 0; block < piece.completed_blocks.size(); ++block)
+		{
+			if (!piece.completed_blocks[block] && piece.block_sources[block] == peer_index)
+				piece.block_sources[block] = -1;
+		}
+
+		if (--piece.workers > 0)
+			return;
+
+		auto piece_it = std::find_if(active_pieces.begin(), active_pieces.end(), [&piece](const Piece_Info& active) { return &active == &piece; });
+		Piece_Info finished = std::move(*piece_it);
+		active_pieces.erase(piece_it);
+
+		bool is_complete = std::all_of(finished.completed_blocks.begin(), finished.completed_blocks.end(), [](bool is_completed) { return is_completed; });
+		lock.unlock();
+
+		if (!is_complete)
+		{
+			requeue_piece(std::move(finished));
+			return;
+		}
+
+		// the last peer to leave hashes the assembled piece, whoever sent its blocks
+		try
+		{
+			verify_piece_hash(torrent_data, finished);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Failed to download piece " << finished.piece_index << ". Err: " << e.what() << "\n";
+			requeue_piece(std::move(finished));
+		}
+	}
+
+	bool is_slow_peer(Torrent::TorrentData* torrent_data, const Network::Peer& peer, int peer_index)
+	{
+		torrent_data->peers.set_download_rate(peer_index, peer.download_rate);
+
+		if (peer.scored_pieces < PEER_MIN_SCORED_PIECES)
+			return false;
+
+		// a slow peer is still better than none, it only makes room when there is someone new to try
+		return peer.download_rate * PEER_SLOW_RATE_DIVISOR < torrent_data->peers.fastest_download_rate()
+			   && torrent_data->peers.has_untried_candidates();
+	}
+
+	static void smooth(double& value, double sample)
+	{
+		value = value == 0 ? sample : value + PEER_RATE_SMOOTHING * (sample - value);
+	}
+
+	bool download_piece(Torrent::TorrentData *torrent_data, Piece_Info &piece, int peer_index)
+	{
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		std::cout << "Downloading piece: " << piece.piece_index << " in Thread #" << peer_index;
+
+		if (piece.workers > 1)
+			std::cout << " (striped, " << piece.workers << " peers on it)";
+		else if (piece.downloaded_len > 0)
+			std::cout << " (resuming at " << piece.downloaded_len << " of " << piece.piece_len << " bytes)";
+
+		std::cout << "\n";
+		lock.unlock();
+
+		Network::Peer& peer = torrent_data->peers[peer_index];
+		bool is_share_done = false;
+		int received_len = 0;
+		auto started_at = std::chrono::steady_clock::now();
+
+		try
+		{
+			if (Upload::send_haves(*torrent_data, peer) != 0)
+				throw std::runtime_error("Failed to send have msgs");
+
+			// send request messages
+			is_share_done = handle_request_msgs(torrent_data, piece, peer, peer_index, received_len);
+		}
+		catch (const std::exception& e)
+		{
+			leave_piece(torrent_data, piece, peer_index);
+			throw;
+		}
+
+		auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_at).count();
 
-		// process piece responses
-		for (auto &peer_msg : peer_msgs)
+		if (is_share_done && received_len > 0 && elapsed > 0)
 		{
-			if (peer_msg.msg_type != message_type::PIECE)
-				throw std::runtime_error("Expected piece msg but received " + peer_msg.msg_type);
+			smooth(peer.download_rate, received_len / elapsed);
+			++peer.scored_pieces;
+		}
+
+		torrent_data->downloaded += received_len;
+		torrent_data->choker.record_download(peer.address, received_len); // tit-for-tat, peers that give us data get our upload slots
+
+		leave_piece(torrent_data, piece, peer_index);
+
+		// tell the peer about the swarm we are connected to, rate limited to once a minute
+		if (PEX::send_pex_msg(*torrent_data, peer) != 0)
+			throw std::runtime_error("Failed to send pex msg");
+
+		return is_share_done;
+	}
+
+	bool handle_peer_state_msg(Network::Peer& peer, const Network::Peer_Msg& peer_msg)
+	{
+		bool is_fast_msg = peer_msg.msg_type >= message_type::SUGGEST_PIECE && peer_msg.msg_type <= message_type::ALLOWED_FAST;
+		int piece_index = peer_msg.payload.size() == 4
+			? Encoder::uint8_to_uint32(peer_msg.payload[0], peer_msg.payload[1], peer_msg.payload[2], peer_msg.payload[3]) : -1;
+
+		if (is_fast_msg && !peer.supports_fast_extension)
+			return false; // protocol violation, the caller treats it like any unexpected msg
+
+		if (peer_msg.msg_type == message_type::CHOKE)
+		{
+			peer.peer_choking = true;
+		}
+		else if (peer_msg.msg_type == message_type::UNCHOKE)
+		{
+			peer.peer_choking = false;
+		}
+		else if (peer_msg.msg_type == message_type::INTERESTED || peer_msg.msg_type == message_type::NOT_INTERESTED)
+		{
+			peer.peer_interested = peer_msg.msg_type == message_type::INTERESTED;
+		}
+		else if (peer_msg.msg_type == message_type::HAVE)
+		{
+			peer.set_piece(piece_index);
+		}
+		else if (peer_msg.msg_type == message_type::BITFIELD)
+		{
+			peer.bitfield = peer_msg.payload;
+		}
+		else if (peer_msg.msg_type == message_type::HAVE_ALL || peer_msg.msg_type == message_type::HAVE_NONE)
+		{
+			peer.has_all = peer_msg.msg_type == message_type::HAVE_ALL;
+			peer.bitfield.clear();
+		}
+		else if (peer_msg.msg_type == message_type::ALLOWED_FAST)
+		{
+			if (piece_index >= 0)
+				peer.allowed_fast.insert(piece_index);
+		}
+		else if (peer_msg.msg_type == message_type::SUGGEST_PIECE)
+		{
+			if (piece_index >= 0)
+				peer.suggested_pieces.push_back(piece_index);
+
+			if (peer.suggested_pieces.size() > MAX_SUGGESTED_PIECES)
+				peer.suggested_pieces.pop_front();
+		}
+		else
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	void handle_bitfield_msg(Network::Peer& peer)
+	{
+		auto peer_msg = next_peer_msg(peer, std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS));
+
+		auto msg_type = peer_msg.msg_type;
+		bool is_availability = msg_type == message_type::BITFIELD || msg_type == message_type::HAVE_ALL || msg_type == message_type::HAVE_NONE;
+
+		if (!is_availability || !handle_peer_state_msg(peer, peer_msg))
+			throw std::runtime_error("Expected bit field msg but got " + std::to_string(msg_type));
+	}
+
+	bool handle_unchoke_msg(Torrent::TorrentData* torrent_data, Network::Peer& peer)
+	{
+		if (!peer.am_interested)
+		{
+			// Interested msg
+			Network::Peer_Msg peer_msg;
+			peer_msg.msg_type = message_type::INTERESTED;
+
+			std::vector<Network::Peer_Msg> peer_msgs{peer_msg};
+			if (Network::send_peer_msgs(peer.peer_socket, peer_msgs) != 0)
+				throw std::runtime_error("Error when sending interested msg");
+
+			peer.am_interested = true;
+		}
+
+		// fast peers may let us start on a few pieces before they unchoke us
+		size_t allowed_fast_count = peer.allowed_fast.size();
+
+		// keep-alives would hold a choked connection open forever, the timer ends the wait
+		auto is_choke_expired = std::make_shared<std::atomic<bool>>(false);
+		auto choke_timer = Timer::shared_wheel().schedule(std::chrono::seconds(PEER_CHOKED_TIMEOUT_SEC), [is_choke_expired]() { *is_choke_expired = true; });
+
+		// a download thread also stops waiting once the peer has nothing left we want (a magnet link's metadata
+		// exchange waits before there is any work)
+		bool is_watching_work = has_remaining_work();
+
+		while (peer.peer_choking && peer.allowed_fast.size() == allowed_fast_count && !*is_choke_expired)
+		{
+			if (is_watching_work && (!has_remaining_work() || !has_wanted_piece(peer)))
+				break;
+
+			wait_for_pieces(torrent_data, peer, std::chrono::milliseconds(ACTIVE_PIECE_POLL_MS));
+		}
+
+		Timer::shared_wheel().cancel(choke_timer);
+
+		return !(*is_choke_expired && peer.peer_choking && peer.allowed_fast.size() == allowed_fast_count);
+	}
+
+	// REQUEST, CANCEL and REJECT_REQUEST share the same payload
+	static Network::Peer_Msg block_msg(uint8_t msg_type, int piece_index, int begin, int length)
+	{
+		Network::Peer_Msg peer_msg;
+		peer_msg.msg_type = msg_type;
+
+		for (uint32_t value : {piece_index, begin, length})
+		{
+			auto value_bytes = Encoder::uint32_to_uint8(value);
+			peer_msg.payload.insert(peer_msg.payload.end(), value_bytes.begin(), value_bytes.end());
+		}
+
+		return peer_msg;
+	}
+
+	bool handle_request_msgs(Torrent::TorrentData* torrent_data, Piece_Info &piece, Network::Peer &peer, int peer_index, int& received_len)
+	{
+		std::map<int, std::pair<std::chrono::steady_clock::time_point, Timer::Timer_Id>> requested_blocks; // block -> when it was requested, its timeout
+		std::set<int> timed_out_blocks; // left to other peers for a while, this one didn't send them in time
+		auto timed_out_at = std::chrono::steady_clock::now();
+		received_len = 0;
+
+		auto block_length = [&piece](int block) { return std::min(BLOCK_SIZE_FOR_PIECE, piece.piece_len - block * BLOCK_SIZE_FOR_PIECE); };
+
+		// blocks we requested go back to the piece for the other threads when this peer won't send them
+		auto unclaim = [&piece](int block) {
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			piece.block_sources[block] = -1;
+		};
+
+		auto cancel_timers = [&requested_blocks]() {
+			for (const auto& requested : requested_blocks)
+				Timer::shared_wheel().cancel(requested.second.second);
+		};
 
-			if (peer_msg.payload.size() < 8)
-				throw std::runtime_error("piece msg with incorrect length received");
+		drop_expired_requests(peer);
+		std::unique_lock<std::mutex> timers_lock(peer.timers->timers_mutex, std::defer_lock);
 
-			uint32_t piece_index = Encoder::uint8_to_uint32(peer_msg.payload[0], peer_msg.payload[1], peer_msg.payload[2], peer_msg.payload[3]);
+		if (!peer.download_bucket)
+			peer.download_bucket = std::make_shared<RateLimit::Token_Bucket>(&torrent_data->download_bucket, &torrent_data->peer_download_limit);
 
-			if (piece_index != piece.piece_index)
+		// fast peers get a deeper pipeline, enough to cover REQUEST_QUEUE_TIME_SEC at the rate they have shown so far
+		size_t pipeline_len = std::clamp<size_t>(peer.download_rate * REQUEST_QUEUE_TIME_SEC / BLOCK_SIZE_FOR_PIECE, REQUEST_PIPELINE_LEN, REQUEST_PIPELINE_MAX);
+		auto last_block_at = std::chrono::steady_clock::now();
+
+		while (true)
+		{
+			bool may_request = !peer.peer_choking || peer.allowed_fast.contains(piece.piece_index);
+
+			// keep the pipeline full, a block that arrived frees a slot for the next one nobody requested yet
+			std::vector<Network::Peer_Msg> peer_msgs;
+			auto now = std::chrono::steady_clock::now();
+
+			bool was_idle = requested_blocks.empty();
+			auto limit_delay = std::chrono::milliseconds(0);
+
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			std::erase_if(timed_out_blocks, [&piece](int block) { return piece.completed_blocks[block]; });
+
+			while (may_request && requested_blocks.size() < pipeline_len)
+			{
+				int block = next_unclaimed_block(piece, timed_out_blocks);
+				if (block < 0)
+					break;
+
+				// download limits pace the requests, so the peer's sends and the TCP window are never held up on our side
+				limit_delay = peer.download_bucket->delay();
+				if (limit_delay.count() > 0)
+					break;
+
+				peer.download_bucket->consume(block_length(block));
+				piece.block_sources[block] = peer_index;
+				requested_blocks.emplace(block, std::make_pair(now, schedule_request_timeout(peer.timers, piece.piece_index, block)));
+
+				peer_msgs.push_back(block_msg(message_type::REQUEST, piece.piece_index, block * BLOCK_SIZE_FOR_PIECE, block_length(block)));
+			}
+
+			lock.unlock();
+
+			if (!peer_msgs.empty() && Network::send_peer_msgs(peer.peer_socket, peer_msgs) != 0)
+				throw std::runtime_error("Failed to send peer msgs");
+
+			// the snub timeout runs while we wait for a block, not while the download limit kept us from asking for one
+			if (was_idle && !requested_blocks.empty())
+				last_block_at = now;
+
+			auto deadline = last_block_at + std::chrono::seconds(PEER_SNUB_TIMEOUT_SEC);
+
+			if (limit_delay.count() > 0)
+			{
+				// the next request goes out as soon as the limit allows it
+				deadline = requested_blocks.empty() ? now + limit_delay : std::min(deadline, now + limit_delay);
+			}
+			else if (requested_blocks.empty())
+			{
+				// nothing outstanding: our share of the piece is in, or we are choked and another peer can go on with it
+				if (!may_request || timed_out_blocks.empty())
+					return may_request;
+
+				// staying on the piece keeps it active, so a thread with another peer joins it and takes the blocks,
+				// we look in every now and then to leave as soon as they arrived
+				deadline = std::min(timed_out_at + std::chrono::seconds(BLOCK_REQUEST_TIMEOUT_SEC), now + std::chrono::milliseconds(ACTIVE_PIECE_POLL_MS));
+			}
+
+			int ready = wait_for_peer(peer, deadline);
+			if (ready < 0)
+				throw std::runtime_error("Failed to wait for peer msgs");
+
+			if (ready == 0 && requested_blocks.empty())
+			{
+				// nobody took them, this peer gets another go
+				if (std::chrono::steady_clock::now() >= timed_out_at + std::chrono::seconds(BLOCK_REQUEST_TIMEOUT_SEC))
+					timed_out_blocks.clear();
+
+				continue;
+			}
+
+			if (ready == 0)
+			{
+				if (std::chrono::steady_clock::now() - last_block_at < std::chrono::seconds(PEER_SNUB_TIMEOUT_SEC))
+					continue;
+
+				// the caller hands the rest of the piece to another peer
+				cancel_timers();
+				peer.is_snubbed = true;
+				return false;
+			}
+
+			if (ready == 2)
+			{
+				std::vector<std::pair<int, int>> expired_requests;
+				timers_lock.lock();
+				std::swap(expired_requests, peer.timers->expired_requests);
+				timers_lock.unlock();
+
+				now = std::chrono::steady_clock::now();
+
+				for (const auto& [piece_index, block] : expired_requests)
+				{
+					// the block may have arrived (or been requested again) while its timer fired
+					auto requested_it = requested_blocks.find(block);
+					if (piece_index != piece.piece_index || requested_it == requested_blocks.end()
+						|| now - requested_it->second.first < std::chrono::seconds(BLOCK_REQUEST_TIMEOUT_SEC))
+						continue;
+
+					// another peer can have it now, if this one sends it anyway it is dropped like any unrequested block
+					peer_msgs.push_back(block_msg(message_type::CANCEL, piece.piece_index, block * BLOCK_SIZE_FOR_PIECE, block_length(block)));
+
+					requested_blocks.erase(requested_it);
+					timed_out_blocks.insert(block);
+					timed_out_at = now;
+					unclaim(block);
+				}
+
+				if (!peer_msgs.empty())
+				{
+					// the thread that takes the piece over next should be one with another peer
+					lock.lock();
+					if (std::find(piece.excluded_peers.begin(), piece.excluded_peers.end(), peer_index) == piece.excluded_peers.end())
+						piece.excluded_peers.push_back(peer_index);
+					lock.unlock();
+
+					std::cout << "Re-requesting " << peer_msgs.size() << " blocks of piece " << piece.piece_index << " that peer " << peer.value() << " didn't send in time\n";
+
+					if (Network::send_peer_msgs(peer.peer_socket, peer_msgs) != 0)
+						throw std::runtime_error("Failed to send peer msgs");
+				}
+
+				continue;
+			}
+
+			Network::Peer_Msg peer_msg;
+			receive_msg(peer, peer_msg);
+
+			if (peer_msg.total_bytes == 0)
+				continue; // keep-alive
+
+			uint32_t piece_index = peer_msg.payload.size() >= 8 ? Encoder::uint8_to_uint32(peer_msg.payload[0], peer_msg.payload[1], peer_msg.payload[2], peer_msg.payload[3]) : 0;
+			uint32_t begin_byte = peer_msg.payload.size() >= 8 ? Encoder::uint8_to_uint32(peer_msg.payload[4], peer_msg.payload[5], peer_msg.payload[6], peer_msg.payload[7]) : 0;
+			int block = begin_byte / BLOCK_SIZE_FOR_PIECE;
+
+			bool is_our_block = peer_msg.payload.size() >= 8 && piece_index == static_cast<uint32_t>(piece.piece_index)
+								&& begin_byte % BLOCK_SIZE_FOR_PIECE == 0 && requested_blocks.contains(block);
+
+			if (peer_msg.msg_type == message_type::PIECE && is_our_block)
+			{
+				if (peer_msg.payload.size() - 8 != static_cast<size_t>(block_length(block)))
+					throw std::runtime_error("piece msg with incorrect length received");
+
+				// the buffer doesn't move while the piece is active and no other thread writes this block
+				std::copy(peer_msg.payload.begin() + 8, peer_msg.payload.end(), piece.piece_data.data() + begin_byte);
+
+				last_block_at = std::chrono::steady_clock::now();
+				smooth(peer.block_latency_ms, std::chrono::duration<double, std::milli>(last_block_at - requested_blocks[block].first).count());
+
+				Timer::shared_wheel().cancel(requested_blocks[block].second);
+				requested_blocks.erase(block);
+				received_len += block_length(block);
+
+				lock.lock();
+				piece.completed_blocks[block] = true;
+				piece.downloaded_len += block_length(block);
+				lock.unlock();
+			}
+			else if (peer_msg.msg_type == message_type::REJECT_REQUEST && peer.supports_fast_extension && is_our_block)
+			{
+				// a choked fast peer rejects what it won't serve, those blocks go out again after the unchoke
+				if (!peer.peer_choking)
+					throw std::runtime_error("Peer rejected requests without choking us");
+
+				Timer::shared_wheel().cancel(requested_blocks[block].second);
+				requested_blocks.erase(block);
+				unclaim(block);
+			}
+			else
 			{
-				throw std::runtime_error("Expected piece not same as received index" +
-										 piece.piece_index + std::string(" ") + std::to_string(piece_index));
+				bool was_choking = peer.peer_choking;
+				handle_peer_msg(torrent_data, peer, peer_msg);
+
+				// without the Fast Extension a choke silently drops every outstanding request
+				if (!was_choking && peer.peer_choking && !peer.supports_fast_extension)
+				{
+					for (const auto& requested : requested_blocks)
+						unclaim(requested.first);
+
+					cancel_timers();
+					requested_blocks.clear();
+				}
 			}
+		}
+	}
+
+	void handle_peer_msg(Torrent::TorrentData* torrent_data, Network::Peer& peer, const Network::Peer_Msg& peer_msg)
+	{
+		if (handle_peer_state_msg(peer, peer_msg))
+			return;
 
-			uint32_t begin_byte = Encoder::uint8_to_uint32(peer_msg.payload[4], peer_msg.payload[5], peer_msg.payload[6], peer_msg.payload[7]);
+		if (peer_msg.msg_type == message_type::EXTENDED)
+		{
+			if (peer.pex_extension_id != 0 && !peer_msg.payload.empty() && peer_msg.payload[0] == PEX_EXTENSION_ID)
+				PEX::handle_pex_msg(*torrent_data, peer, peer_msg.payload.substr(1));
 
-			std::copy(peer_msg.payload.begin() + 8, peer_msg.payload.end(), piece.piece_data.begin() + begin_byte);
-			//piece.piece_data.insert(piece.piece_data.begin() + begin_byte, peer_msg.payload.begin() + 8, peer_msg.payload.end());
+			// other extensions are of no interest while downloading
+		}
+		else if (peer_msg.msg_type == message_type::REQUEST)
+		{
+			// we keep choking on connections we opened, uploads are served on incoming connections.
+			// A fast peer is owed a reject, everyone else knows a choked request is dropped.
+			if (peer.supports_fast_extension && peer_msg.payload.size() == 12)
+			{
+				Network::Peer_Msg reject_msg = peer_msg;
+				reject_msg.msg_type = message_type::REJECT_REQUEST;
+
+				std::vector<Network::Peer_Msg> peer_msgs{reject_msg};
+				if (Network::send_peer_msgs(peer.peer_socket, peer_msgs) != 0)
+					throw std::runtime_error("Failed to send reject msg");
+			}
 		}
+		// PIECE and REJECT_REQUEST that arrive late for a block we no longer wait for, CANCEL, PORT and
+		// unknown msgs need no answer
 	}
 
-	void verify_piece_hash(Piece_Info &piece, const std::string& out_file)
+	void verify_piece_hash(Torrent::TorrentData* torrent_data, Piece_Info &piece)
 	{
 		// calculate hash of downloaded piece
-		std::string downloaded_data_hash = Encoder::hash_to_hex(Encoder::SHA_string(piece.piece_data));
+		std::string downloaded_data_hash = Encoder::hash_to_hex(Encoder::SHA_string(piece.piece_data.view()));
 
 		if (downloaded_data_hash != piece.piece_hash)
+		{
+			std::set<int> sources(piece.block_sources.begin(), piece.block_sources.end());
+
+			for (int source : sources)
+			{
+				if (source < 0)
+					continue;
+
+				// a striped piece doesn't tell who was at fault, that waits for the block comparison against a good copy
+				if (sources.size() == 1 && torrent_data->peers.add_hash_failure(source))
+					std::cerr << "Banned peer " << torrent_data->peers[source].value() << " after repeated hash failures\n";
+
+				if (std::find(piece.excluded_peers.begin(), piece.excluded_peers.end(), source) == piece.excluded_peers.end())
+					piece.excluded_peers.push_back(source);
+			}
+
+			// copied out of the pool, the buffer goes back for the next attempt
+			if (piece.failed_copies.size() < MAX_FAILED_COPIES)
+				piece.failed_copies.push_back(Failed_Copy{std::string(piece.piece_data.view()), std::move(piece.block_sources)});
+
+			// the next attempt starts from scratch
+			piece.piece_data.reset();
+			piece.block_sources.clear();
+			piece.completed_blocks.clear();
+			piece.downloaded_len = 0;
+
 			throw std::runtime_error("Hash of downloaded data doesn't match actual hash: " + downloaded_data_hash + " " + piece.piece_hash);
+		}
 
-		std::unique_lock<std::mutex> lock(queue_mutex); // use another mutex for output from threads
+		if (!piece.failed_copies.empty())
+			attribute_hash_failures(torrent_data, piece);
 
-		piece.piece_file = out_file + "_piece_" + std::to_string(piece.piece_index);
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		++pieces_writing;
+		lock.unlock();
 
-		std::ofstream piece_file(piece.piece_file);
-		piece_file << std::move(piece.piece_data);
-		piece_file.close();
+		// the buffer goes along and back to the pool once the piece is on disk, this thread moves on right away
+		int piece_index = piece.piece_index;
+		int piece_len = piece.piece_len;
+		std::string piece_hash = piece.piece_hash;
 
-		piece.piece_data.clear();
-		std::cout << "Piece #" << piece.piece_index << " successfully downloaded!\n";
+		DiskIo::disk_thread().write_piece(torrent_data->storage, piece_index, std::move(piece.piece_data), [=](int result) {
+			complete_write(torrent_data, piece_index, piece_len, piece_hash, result);
+		});
 	}
 
-}
+	void complete_write(Torrent::TorrentData* torrent_data, int piece_index, int piece_len, const std::string& piece_hash, int result)
+	{
+		if (result == 0)
+		{
+			torrent_data->verified += piece_len;
+			std::cout << "Piece #" << piece_index << " successfully downloaded!\n";
+		}
+		else
+		{
+			std::cerr << "Failed to write piece " << piece_index << ", downloading it again\n";
 
+			Piece_Info piece;
+			piece.piece_index = piece_index;
+			piece.piece_len = piece_len;
+			piece.piece_hash = piece_hash;
+			requeue_piece(std::move(piece));
+		}
+
+		// after the requeue, so the piece is never out of sight of has_remaining_work()
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		--pieces_writing;
+	}
+
+	void attribute_hash_failures(Torrent::TorrentData* torrent_data, const Piece_Info& piece)
+	{
+		std::set<int> banned;
+
+		for (const auto& failed_copy : piece.failed_copies)
+		{
+			for (size_t block = 0; block < failed_copy.block_sources.size(); ++block)
+			{
+				size_t begin = block * BLOCK_SIZE_FOR_PIECE;
+				int source = failed_copy.block_sources[block];
+
+				if (failed_copy.piece_data.compare(begin, BLOCK_SIZE_FOR_PIECE, piece.piece_data.view(), begin, BLOCK_SIZE_FOR_PIECE) == 0)
+					continue;
+
+				// web seeds are not in the pool, a bad one just keeps failing until it gives up
+				if (source >= 0 && banned.insert(source).second)
+				{
+					torrent_data->peers.ban(source);
+					std::cerr << "Banned peer " << torrent_data->peers[source].value() << " for sending a bad block of piece " << piece.piece_index << "\n";
+				}
+			}
+		}
+	}
+}
@@ -3,17 +3,32 @@
 #define _DOWNLOADER_H_
 
 #include "bencode_helper.h"
+#include "buffer_pool.h"
+#include "connector.h"
+
+#include <vector>
 
 namespace Downloader
 {
+	// A copy of a piece that failed its hash check, kept until a good copy shows which blocks were bad
+	struct Failed_Copy
+	{
+		std::string piece_data;
+		std::vector<int> block_sources;
+	};
+
 	struct Piece_Info
 	{
 		int piece_index = 0;
 		int piece_len = 0; // can be different for last piece
 		int downloaded_len = 0;
 		std::string piece_hash;
-		std::string piece_data;
-		std::string piece_file;
+		BufferPool::Piece_Buffer piece_data; // from the piece buffer pool when the first block is requested, kept while the piece waits in the queue
+		std::vector<bool> completed_blocks; // a failed peer only costs the blocks that are still missing
+		std::vector<int> block_sources; // peer pool index each block came from (or is requested from), -1 for none and web seeds
+		int workers = 0; // threads requesting blocks of the piece, the last one to leave verifies it
+		std::vector<Failed_Copy> failed_copies; // at most MAX_FAILED_COPIES
+		std::vector<int> excluded_peers; // sent a failed copy or let a block request time out, the piece goes to other peers first
 	};
 
 	enum message_type
@@ -26,30 +41,109 @@ namespace Downloader
 		BITFIELD,
 		REQUEST,
 		PIECE,
-		CANCEL
+		CANCEL,
+		PORT, // DHT port of the peer, we find nodes through the routing table instead
+		SUGGEST_PIECE = 13, // Fast Extension (BEP 6)
+		HAVE_ALL,
+		HAVE_NONE,
+		REJECT_REQUEST,
+		ALLOWED_FAST,
+		EXTENDED = 20
 	};
 
+	extern Network::Connector connector; // dials the candidates for every download thread, configured by the global options
+
 	int start_downloader(Torrent::TorrentData& torrent_data, int piece_index = -1); // -1 indicates download all pieces
 
 	int initialize_thread_pool(int pool_size, Torrent::TorrentData &torrent_data);
 
-	int wait_for_download(const Torrent::TorrentData &torrent_data);
+	int wait_for_download(Torrent::TorrentData &torrent_data);
+
+	void thread_function(Torrent::TorrentData* torrent_data, int thread_index);
+
+	// Pulls runs of contiguous pieces off the work queue and fetches them from an HTTP web seed
+	void web_seed_function(Torrent::TorrentData* torrent_data, std::string url);
+
+	// Takes the next connection the Connector established, returns the peer index and its socket, or -1 if nothing
+	// connected within a second, which also asks the trackers for more candidates
+	int claim_peer(Torrent::TorrentData* torrent_data, int& peer_socket);
+
+	void disconnect_peer(Torrent::TorrentData* torrent_data, Network::Peer& peer); // also stops the peer's timers
+
+	void start_peer_timers(Network::Peer& peer); // keep-alives every PEER_KEEPALIVE_INTERVAL_SEC from now on
+
+	void stop_peer_timers(Network::Peer& peer);
 
-	void thread_function(Torrent::TorrentData* torrent_data, int peer_index);
+	// Waits for a msg of the peer until deadline (time_point::max() waits forever) and sends our keep-alives when they
+	// are due. 1 when a msg is waiting, 2 when block requests timed out (in peer.timers), 0 at the deadline, -1 on error
+	int wait_for_peer(Network::Peer& peer, std::chrono::steady_clock::time_point deadline);
 
 	void populate_work_queue(const Torrent::TorrentData& torrent_data, int piece_index);
 
-	void download_piece(Torrent::TorrentData* torrent_data, Piece_Info& piece_info, int peer_index);
+	void requeue_piece(Piece_Info&& piece); // partially downloaded pieces go to the front, so they are finished first
+
+	// Handshake, availability and interest, returns once the peer unchoked us or granted Allowed Fast pieces
+	// (right after the availability if the peer has none of the pieces we still need). false when the peer kept us
+	// choked for PEER_CHOKED_TIMEOUT_SEC instead
+	bool connect_to_peer(Torrent::TorrentData* torrent_data, Network::Peer& peer, int peer_socket);
+
+	bool has_remaining_work(); // pieces are queued, still being downloaded or not written yet
+
+	bool is_writing_last_pieces(); // nothing is left to download, but verified pieces still wait for the disk thread
+
+	bool has_active_piece(const Network::Peer& peer); // the peer has a piece other threads are downloading
+
+	// Waits up to timeout for blocks of active pieces to be given back or a piece buffer to free up, handling the peer's msgs meanwhile
+	void wait_for_pieces(Torrent::TorrentData* torrent_data, Network::Peer& peer, std::chrono::milliseconds timeout);
+
+	bool has_wanted_piece(const Network::Peer& peer); // the peer has a piece that is queued or still has unrequested blocks
+
+	// Picks a piece the peer can serve right now (only Allowed Fast ones while it chokes us) and makes the caller one of its
+	// workers. Active pieces with unrequested blocks are joined first, then partially downloaded pieces, the peer's
+	// suggestions and the rest of the queue. Pieces the peer sent a bad copy of are only taken when nothing else is left for it.
+	// A piece not started yet needs a buffer from the pool, while the piece memory is used up only started pieces are
+	// taken (the least progressed one gives its buffer up if the peer has none of them), nullptr otherwise.
+	Piece_Info* take_piece(const Network::Peer& peer, int peer_index);
+
+	// Gives back the blocks still requested from the peer. The last worker to leave verifies the piece when it is
+	// complete and requeues it otherwise, the piece must not be touched afterwards.
+	void leave_piece(Torrent::TorrentData* torrent_data, Piece_Info& piece, int peer_index);
+
+	// Requests blocks of the piece nobody else requested until none are left, then leaves the piece. False when the peer
+	// choked us with nothing outstanding or is snubbing us, the blocks that did arrive stay in the piece. Updates the peer's download rate.
+	bool download_piece(Torrent::TorrentData* torrent_data, Piece_Info& piece_info, int peer_index);
+
+	// The peer delivers at a fraction of the fastest connected peer's rate and an untried candidate could replace it
+	bool is_slow_peer(Torrent::TorrentData* torrent_data, const Network::Peer& peer, int peer_index);
+
+	// Applies (UN)CHOKE, (NOT_)INTERESTED, HAVE, BITFIELD and the Fast Extension msgs to the peer, returns false for any other msg
+	bool handle_peer_state_msg(Network::Peer& peer, const Network::Peer_Msg& peer_msg);
+
+	// Handles any msg that can arrive at any point of a connection we opened: state changes, ut_pex and the peer's own requests
+	void handle_peer_msg(Torrent::TorrentData* torrent_data, Network::Peer& peer, const Network::Peer_Msg& peer_msg);
+
+	void handle_bitfield_msg(Network::Peer& peer); // BITFIELD, or HAVE_ALL / HAVE_NONE from fast peers
 
-	void handle_bitfield_msg(int peer_socket);
+	// Sends interested if needed and waits for the unchoke, or until the peer grants an Allowed Fast piece. A download
+	// thread stops waiting when the download completes or the peer has nothing left we want. false when the peer kept us
+	// choked for PEER_CHOKED_TIMEOUT_SEC
+	bool handle_unchoke_msg(Torrent::TorrentData* torrent_data, Network::Peer& peer);
 
-	void handle_unchoke_msg(int peer_socket);
+	// Keeps the peer's pipeline of block requests full (deeper for faster peers) with blocks of the piece no other thread
+	// requested, until there are none left and ours arrived. Other msgs go through handle_peer_msg, requests a choke
+	// dropped (or a fast peer rejected) go back to the piece. Gives up with peer.is_snubbed set when no block arrived for
+	// PEER_SNUB_TIMEOUT_SEC. Blocks not delivered within BLOCK_REQUEST_TIMEOUT_SEC are cancelled and left to other peers for
+	// as long again before this peer is asked once more. received_len is what this peer delivered.
+	bool handle_request_msgs(Torrent::TorrentData* torrent_data, Piece_Info& piece, Network::Peer &peer, int peer_index, int& received_len);
 
-	void handle_request_msgs(Piece_Info& piece, Network::Peer &peer);
+	// Hands the piece and its buffer to the disk thread if its hash matches. A mismatch keeps the bad copy and gives each peer
+	// that contributed to it a strike, once a good copy arrives the blocks that differ identify the peers to ban.
+	void verify_piece_hash(Torrent::TorrentData* torrent_data, Piece_Info& piece);
 
-	void handle_piece_msgs(Piece_Info& piece, Network::Peer &peer, int expected_responses);
+	// Runs on the disk thread once a verified piece was written: counts it as verified, or downloads it again if the write failed
+	void complete_write(Torrent::TorrentData* torrent_data, int piece_index, int piece_len, const std::string& piece_hash, int result);
 
-	void verify_piece_hash(Piece_Info& piece, const std::string& out_file);
+	void attribute_hash_failures(Torrent::TorrentData* torrent_data, const Piece_Info& piece); // piece holds a good copy
 }
 
 #endif
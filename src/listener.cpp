@@ -0,0 +1,252 @@
+
+#include "listener.h"
+#include "bencode_helper.h"
+#include "upload.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+namespace Listener
+{
+	Peer_Listener::~Peer_Listener()
+	{
+		stop();
+	}
+
+	int Peer_Listener::start(uint16_t port, int acceptor_count)
+	{
+		for (int acceptor_index = 0; acceptor_index < acceptor_count; ++acceptor_index)
+		{
+			int listen_socket = socket(AF_INET6, SOCK_STREAM, 0);
+			if (listen_socket < 0)
+			{
+				std::cerr << "Failed to create listening socket" << std::endl;
+				break;
+			}
+
+			// dual stack, and the kernel spreads incoming connections over the acceptors
+			int enable = 1, disable = 0;
+			setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+			setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+			setsockopt(listen_socket, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+
+			sockaddr_in6 bind_addr{};
+			bind_addr.sin6_family = AF_INET6;
+			bind_addr.sin6_addr = in6addr_any;
+			bind_addr.sin6_port = htons(port);
+
+			if (bind(listen_socket, reinterpret_cast<sockaddr*>(&bind_addr), sizeof(bind_addr)) < 0 || listen(listen_socket, SOMAXCONN) < 0)
+			{
+				std::cerr << "Failed to listen on port " << port << std::endl;
+				close(listen_socket);
+				break;
+			}
+
+			// the first acceptor picks the port when asked for any port, the others join it
+			if (port == 0)
+			{
+				socklen_t addr_len = sizeof(bind_addr);
+				getsockname(listen_socket, reinterpret_cast<sockaddr*>(&bind_addr), &addr_len);
+				port = ntohs(bind_addr.sin6_port);
+			}
+
+			listen_sockets.push_back(listen_socket);
+		}
+
+		if (listen_sockets.empty())
+			return -1;
+
+		bound_port = port;
+		is_running = true;
+
+		for (int listen_socket : listen_sockets)
+			acceptor_threads.emplace_back(&Peer_Listener::accept_loop, this, listen_socket);
+
+		std::cout << "Listening for peers on port " << bound_port << " with " << listen_sockets.size() << " acceptor(s)\n";
+		return 0;
+	}
+
+	void Peer_Listener::stop()
+	{
+		if (!is_running.exchange(false))
+			return;
+
+		for (auto& thread : acceptor_threads)
+			thread.join();
+
+		acceptor_threads.clear();
+
+		for (int listen_socket : listen_sockets)
+			close(listen_socket);
+
+		listen_sockets.clear();
+
+		std::unique_lock<std::mutex> lock(connections_mutex);
+		torrents.clear();
+
+		std::list<Connection> closing_connections;
+		closing_connections.splice(closing_connections.end(), connections);
+
+		for (auto& connection : closing_connections)
+			shutdown(connection.peer.peer_socket, SHUT_RDWR);
+
+		// a connection may still be waiting for the lock to look up its torrent
+		lock.unlock();
+
+		for (auto& connection : closing_connections)
+			join_connection(connection);
+	}
+
+	void Peer_Listener::add_torrent(Torrent::TorrentData* torrent_data)
+	{
+		std::unique_lock<std::mutex> lock(connections_mutex);
+		torrents[torrent_data->info_hash] = torrent_data;
+	}
+
+	void Peer_Listener::remove_torrent(const std::string& info_hash)
+	{
+		std::unique_lock<std::mutex> lock(connections_mutex);
+		torrents.erase(info_hash);
+
+		// no connection can pick the torrent up anymore, wake the ones serving it
+		std::list<Connection> closing_connections;
+
+		for (auto connection_it = connections.begin(); connection_it != connections.end();)
+		{
+			auto next_it = std::next(connection_it);
+
+			if (connection_it->info_hash == info_hash)
+			{
+				shutdown(connection_it->peer.peer_socket, SHUT_RDWR);
+				closing_connections.splice(closing_connections.end(), connections, connection_it);
+			}
+
+			connection_it = next_it;
+		}
+
+		lock.unlock();
+
+		for (auto& connection : closing_connections)
+			join_connection(connection);
+	}
+
+	void Peer_Listener::join_connection(Connection& connection)
+	{
+		connection.thread.join();
+		close(connection.peer.peer_socket); // closed only here, so shutdown() never hits a reused descriptor
+	}
+
+	void Peer_Listener::reap_connections()
+	{
+		for (auto connection_it = connections.begin(); connection_it != connections.end();)
+		{
+			if (!connection_it->is_done)
+			{
+				++connection_it;
+				continue;
+			}
+
+			join_connection(*connection_it);
+			connection_it = connections.erase(connection_it);
+		}
+	}
+
+	void Peer_Listener::accept_loop(int listen_socket)
+	{
+		while (is_running)
+		{
+			// poll instead of a blocking accept so that stop() doesn't need to wake us up
+			pollfd poll_fd{listen_socket, POLLIN, 0};
+			if (poll(&poll_fd, 1, 200) <= 0)
+				continue;
+
+			sockaddr_storage peer_storage{};
+			socklen_t peer_len = sizeof(peer_storage);
+
+			int peer_socket = accept(listen_socket, reinterpret_cast<sockaddr*>(&peer_storage), &peer_len);
+			if (peer_socket < 0)
+				continue;
+
+			Network::Peer_Address peer_addr;
+			peer_addr.storage = peer_storage;
+
+			adopt_connection(peer_socket, peer_addr);
+		}
+	}
+
+	void Peer_Listener::adopt_connection(int peer_socket, const Network::Peer_Address& peer_addr)
+	{
+		std::unique_lock<std::mutex> lock(connections_mutex);
+		reap_connections();
+
+		if (!is_running || connections.size() >= LISTENER_MAX_CONNECTIONS)
+		{
+			close(peer_socket);
+			return;
+		}
+
+		// the dual-stack socket reports IPv4 peers as v4-mapped IPv6, everything else (the choker's per host download
+		// stats, Allowed Fast sets, the peer pool) knows them by their plain IPv4 address
+		auto& connection = connections.emplace_back();
+		connection.peer = Network::Peer(peer_addr.unmapped());
+		connection.peer.peer_socket = peer_socket;
+		connection.thread = std::thread(&Peer_Listener::handle_connection, this, &connection);
+	}
+
+	void Peer_Listener::handle_connection(Connection* connection)
+	{
+		Network::Peer& peer = connection->peer;
+
+		timeval tv{LISTENER_HANDSHAKE_TIMEOUT_SEC, 0};
+		setsockopt(peer.peer_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		std::string handshake_msg(68, 0);
+		Torrent::TorrentData* torrent_data = nullptr;
+
+		if (Network::receive_all(peer.peer_socket, handshake_msg.data(), handshake_msg.size()) == 0 && handshake_msg[0] == 19)
+		{
+			std::unique_lock<std::mutex> lock(connections_mutex);
+
+			auto torrent_it = torrents.find(handshake_msg.substr(28, 20));
+			if (torrent_it != torrents.end())
+			{
+				torrent_data = torrent_it->second;
+				connection->info_hash = torrent_it->first;
+			}
+		}
+
+		if (torrent_data != nullptr)
+		{
+			peer.peer_id = handshake_msg.substr(48, 20);
+			peer.supports_fast_extension = Network::is_fast_extension_supported(handshake_msg);
+
+			std::string our_handshake;
+			Network::prepare_handshake(connection->info_hash, our_handshake);
+
+			if (send(peer.peer_socket, our_handshake.data(), our_handshake.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(our_handshake.size()))
+			{
+				// block reads from here on are bounded by the idle timeout in serve_peer, not by the handshake timeout
+				tv = timeval{UPLOAD_IDLE_TIMEOUT_SEC, 0};
+				setsockopt(peer.peer_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+				std::cout << "Incoming peer " << peer.value() << " connected\n";
+
+				// whatever a peer sends, it may only end its own connection
+				try
+				{
+					Upload::serve_peer(*torrent_data, peer);
+				}
+				catch (const std::exception& e)
+				{
+					std::cerr << "Incoming peer " << peer.value() << " failed: " << e.what() << std::endl;
+				}
+
+				std::cout << "Incoming peer " << peer.value() << " disconnected\n";
+			}
+		}
+
+		// the peer sees the connection end now, the descriptor stays ours until join_connection()
+		shutdown(peer.peer_socket, SHUT_RDWR);
+		connection->is_done = true;
+	}
+}
@@ -0,0 +1,75 @@
+
+#ifndef _LISTENER_H_
+#define _LISTENER_H_
+
+#include "network_helper.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#define LISTENER_ACCEPTORS 4            // sockets sharing the port through SO_REUSEPORT, each with its own accept thread
+#define LISTENER_MAX_CONNECTIONS 50     // incoming connections over all torrents
+#define LISTENER_HANDSHAKE_TIMEOUT_SEC 10
+
+namespace Torrent
+{
+	struct TorrentData;
+}
+
+namespace Listener
+{
+	// Accepts incoming peer connections on the port we announce and routes them by the info hash
+	// of their handshake to the registered torrent, which then uploads to them (see Upload::serve_peer).
+	class Peer_Listener
+	{
+	public:
+		~Peer_Listener();
+
+		int start(uint16_t port, int acceptor_count = LISTENER_ACCEPTORS);
+
+		void stop(); // closes every connection
+
+		void add_torrent(Torrent::TorrentData* torrent_data);
+
+		// Closes the torrent's connections and waits for them, torrent_data is no longer touched afterwards
+		void remove_torrent(const std::string& info_hash);
+
+		uint16_t port() const { return bound_port; }
+
+		// Serves a connection accepted elsewhere like one of ours, uTP hands its incoming connections over this way
+		void adopt_connection(int peer_socket, const Network::Peer_Address& peer_addr);
+
+	private:
+		struct Connection
+		{
+			Network::Peer peer;
+			std::string info_hash; // empty until the handshake was read
+			std::thread thread;
+			std::atomic<bool> is_done = false;
+		};
+
+		void accept_loop(int listen_socket);
+
+		void handle_connection(Connection* connection);
+
+		void reap_connections(); // joins connections that finished, needs connections_mutex
+
+		void join_connection(Connection& connection);
+
+		std::vector<int> listen_sockets;
+		std::vector<std::thread> acceptor_threads;
+		uint16_t bound_port = 0;
+
+		std::unordered_map<std::string, Torrent::TorrentData*> torrents; // info hash -> torrent
+		std::list<Connection> connections;
+		std::mutex connections_mutex; // guards torrents and connections
+
+		std::atomic<bool> is_running = false;
+	};
+}
+
+#endif
@@ -0,0 +1,221 @@
+
+#include "lsd.h"
+#include "bencode_helper.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <sstream>
+
+namespace LSD
+{
+	Service::~Service()
+	{
+		stop();
+	}
+
+	int Service::start(const std::string& interface_ip, uint16_t lsd_port)
+	{
+		udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+		if (udp_socket < 0)
+		{
+			std::cerr << "Failed to create LSD socket" << std::endl;
+			return -1;
+		}
+
+		// every client on the host listens on the same multicast port
+		int enable = 1;
+		setsockopt(udp_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+		setsockopt(udp_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+		sockaddr_in bind_addr{};
+		bind_addr.sin_family = AF_INET;
+		bind_addr.sin_port = htons(lsd_port);
+		bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+		if (bind(udp_socket, reinterpret_cast<sockaddr*>(&bind_addr), sizeof(bind_addr)) < 0)
+		{
+			std::cerr << "Failed to bind LSD socket" << std::endl;
+			close(udp_socket);
+			udp_socket = -1;
+			return -1;
+		}
+
+		multicast_addr.sin_family = AF_INET;
+		multicast_addr.sin_port = htons(lsd_port);
+		inet_pton(AF_INET, LSD_MULTICAST_ADDR, &multicast_addr.sin_addr);
+
+		ip_mreq membership{};
+		membership.imr_multiaddr = multicast_addr.sin_addr;
+		inet_pton(AF_INET, interface_ip.c_str(), &membership.imr_interface);
+
+		if (setsockopt(udp_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)
+		{
+			std::cerr << "Failed to join LSD multicast group" << std::endl;
+			close(udp_socket);
+			udp_socket = -1;
+			return -1;
+		}
+
+		// announces must not leave the local network, and other clients on this host should see them too
+		unsigned char ttl = 1, loop = 1;
+		setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+		setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_IF, &membership.imr_interface, sizeof(membership.imr_interface));
+
+		// lets the service loop notice is_running going down
+		timeval tv{0, 200 * 1000};
+		setsockopt(udp_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		std::mt19937 rng(std::random_device{}());
+		cookie = std::to_string(rng());
+
+		is_running = true;
+		service_thread = std::thread(&Service::service_loop, this);
+
+		std::cout << "LSD listening on " << LSD_MULTICAST_ADDR << ":" << lsd_port << "\n";
+		return 0;
+	}
+
+	void Service::stop()
+	{
+		if (!is_running.exchange(false))
+			return;
+
+		if (service_thread.joinable())
+			service_thread.join();
+
+		close(udp_socket);
+		udp_socket = -1;
+	}
+
+	void Service::add_torrent(const std::string& info_hash, Network::Peer_Pool* peers, uint16_t listen_port)
+	{
+		std::unique_lock<std::mutex> lock(torrents_mutex);
+		torrents[info_hash] = Torrent_Entry{peers, listen_port}; // never announced, so the service loop sends it right away
+	}
+
+	void Service::remove_torrent(const std::string& info_hash)
+	{
+		std::unique_lock<std::mutex> lock(torrents_mutex);
+		torrents.erase(info_hash);
+	}
+
+	void Service::service_loop()
+	{
+		std::string buffer(1500, 0);
+
+		while (is_running)
+		{
+			send_announces();
+
+			sockaddr_storage sender_storage{};
+			socklen_t sender_len = sizeof(sender_storage);
+
+			auto bytes_read = recvfrom(udp_socket, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&sender_storage), &sender_len);
+			if (bytes_read <= 0)
+				continue;
+
+			Network::Peer_Address sender;
+			sender.storage = sender_storage;
+
+			handle_announce(buffer.substr(0, bytes_read), sender);
+		}
+	}
+
+	void Service::send_announces()
+	{
+		std::unique_lock<std::mutex> lock(torrents_mutex);
+		auto now = std::chrono::steady_clock::now();
+
+		// torrents with the same listen port share one message, BEP 14 allows several Infohash headers
+		std::unordered_map<uint16_t, std::vector<std::string>> due_hashes;
+
+		for (auto& [info_hash, entry] : torrents)
+		{
+			if (now - entry.last_announce < std::chrono::seconds(LSD_ANNOUNCE_INTERVAL_SEC))
+				continue;
+
+			entry.last_announce = now;
+			due_hashes[entry.listen_port].push_back(info_hash);
+		}
+
+		lock.unlock();
+
+		for (const auto& [listen_port, info_hashes] : due_hashes)
+		{
+			std::ostringstream message;
+			message << "BT-SEARCH * HTTP/1.1\r\n"
+					<< "Host: " << LSD_MULTICAST_ADDR << ":" << ntohs(multicast_addr.sin_port) << "\r\n"
+					<< "Port: " << listen_port << "\r\n";
+
+			for (const auto& info_hash : info_hashes)
+				message << "Infohash: " << Encoder::hash_to_hex(info_hash) << "\r\n";
+
+			message << "cookie: " << cookie << "\r\n\r\n\r\n";
+
+			auto message_str = message.str();
+			if (sendto(udp_socket, message_str.data(), message_str.size(), 0, reinterpret_cast<const sockaddr*>(&multicast_addr), sizeof(multicast_addr)) < 0)
+				std::cerr << "Failed to send LSD announce" << std::endl;
+		}
+	}
+
+	void Service::handle_announce(const std::string& message, const Network::Peer_Address& sender)
+	{
+		std::istringstream lines(message);
+		std::string line;
+
+		if (!std::getline(lines, line) || !line.starts_with("BT-SEARCH * HTTP/1.1"))
+			return;
+
+		int port = 0;
+		std::string peer_cookie;
+		std::vector<std::string> info_hashes;
+
+		while (std::getline(lines, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+
+			auto colon_index = line.find(':');
+			if (colon_index == std::string::npos)
+				continue;
+
+			std::string header = line.substr(0, colon_index);
+			std::string value = line.substr(colon_index + 1);
+			value.erase(0, value.find_first_not_of(' '));
+
+			std::transform(header.begin(), header.end(), header.begin(), [](unsigned char c) { return std::tolower(c); });
+
+			if (header == "port")
+				port = std::atoi(value.c_str());
+			else if (header == "infohash" && value.size() == 40)
+				info_hashes.push_back(Encoder::hex_to_hash(value));
+			else if (header == "cookie")
+				peer_cookie = value;
+		}
+
+		if (peer_cookie == cookie || port <= 0 || port > 65535)
+			return;
+
+		// the peer listens on the announced port of the address the datagram came from
+		Network::Peer_Address peer_addr = sender;
+		reinterpret_cast<sockaddr_in*>(&peer_addr.storage)->sin_port = htons(port);
+
+		Network::Peer peer(peer_addr);
+		peer.is_local = true;
+
+		std::unique_lock<std::mutex> lock(torrents_mutex);
+
+		for (const auto& info_hash : info_hashes)
+		{
+			auto torrent_it = torrents.find(info_hash);
+			if (torrent_it == torrents.end())
+				continue;
+
+			int added = torrent_it->second.peers->add_peers({peer});
+			std::cout << "LSD found LAN peer " << peer.value() << (added > 0 ? " (new)" : "") << "\n";
+		}
+	}
+}
@@ -0,0 +1,67 @@
+
+#ifndef _LSD_H_
+#define _LSD_H_
+
+#include "network_helper.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#define LSD_MULTICAST_ADDR "239.192.152.143"
+#define LSD_PORT 6771
+#define LSD_ANNOUNCE_INTERVAL_SEC 300 // BEP 14: every 5 minutes, never more than once a minute per torrent
+
+namespace Network
+{
+	class Peer_Pool;
+}
+
+namespace LSD
+{
+	// Local Service Discovery (BEP 14): multicasts the info hashes we work on to the LAN
+	// and feeds the peers that announce the same info hashes into the matching candidate pool.
+	class Service
+	{
+	public:
+		~Service();
+
+		// interface_ip picks the multicast interface, "127.0.0.1" keeps the traffic on this host
+		int start(const std::string& interface_ip = "0.0.0.0", uint16_t lsd_port = LSD_PORT);
+
+		void stop();
+
+		// Announces the torrent right away and then every LSD_ANNOUNCE_INTERVAL_SEC, LAN peers are added to peers
+		void add_torrent(const std::string& info_hash, Network::Peer_Pool* peers, uint16_t listen_port);
+
+		void remove_torrent(const std::string& info_hash);
+
+	private:
+		struct Torrent_Entry
+		{
+			Network::Peer_Pool* peers = nullptr;
+			uint16_t listen_port = 0;
+			std::chrono::steady_clock::time_point last_announce{};
+		};
+
+		void service_loop();
+
+		void send_announces(); // announces every torrent whose interval elapsed
+
+		void handle_announce(const std::string& message, const Network::Peer_Address& sender);
+
+		int udp_socket = -1;
+		sockaddr_in multicast_addr{};
+		std::string cookie; // tells our own announces apart when the multicast loops back
+
+		std::unordered_map<std::string, Torrent_Entry> torrents; // info hash -> torrent
+		std::mutex torrents_mutex;
+
+		std::atomic<bool> is_running = false;
+		std::thread service_thread;
+	};
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include "bencode_helper.h"
 #include "network_helper.h"
 #include "downloader.h"
+#include "pex.h"
 
 #include <string_view>
 
@@ -10,6 +11,30 @@
 
 namespace Magnet
 {
+	std::string url_decode(std::string_view encoded)
+	{
+		std::string decoded;
+
+		for (size_t i = 0; i < encoded.size(); ++i)
+		{
+			if (encoded[i] == '%' && i + 2 < encoded.size() && std::isxdigit(encoded[i + 1]) && std::isxdigit(encoded[i + 2]))
+			{
+				decoded.push_back(static_cast<char>(std::stoi(std::string(encoded.substr(i + 1, 2)), nullptr, 16)));
+				i += 2;
+			}
+			else if (encoded[i] == '+')
+			{
+				decoded.push_back(' ');
+			}
+			else
+			{
+				decoded.push_back(encoded[i]);
+			}
+		}
+
+		return decoded;
+	}
+
 	int parse_magnet_link(const std::string& magnet_link, Torrent::TorrentData& torrent_data)
 	{
 		std::string_view link_view(magnet_link);
@@ -32,15 +57,14 @@ namespace Magnet
 
 			if (curr_key == "tr")
 			{
-				std::string curr_val_str(curr_val);
-				// Decode %3A to :
-				while (curr_val_str.find("%3A") != std::string::npos)
-					curr_val_str.replace(curr_val_str.find("%3A"), 3, ":");
-				// Decode %2F to /
-				while (curr_val_str.find("%2F") != std::string::npos)
-					curr_val_str.replace(curr_val_str.find("%2F"), 3, "/");
-
-				torrent_data.tracker = curr_val_str;
+				// every tr= is its own tracker, keep them all in a single tier
+				if (torrent_data.announce_list.empty())
+					torrent_data.announce_list.emplace_back();
+
+				torrent_data.announce_list.front().push_back(url_decode(curr_val));
+
+				if (torrent_data.tracker.empty())
+					torrent_data.tracker = torrent_data.announce_list.front().front();
 			}
 
 			if (link_view.find('&') == std::string::npos)
@@ -50,7 +74,7 @@ namespace Magnet
 		} while (true);
 		
 		torrent_data.is_magnet_download = true;
-		torrent_data.peers = Network::get_peers(torrent_data.info_hash, torrent_data.tracker, 999);
+		torrent_data.announcer.announce_to_all(torrent_data, std::chrono::milliseconds(TRACKER_TIMEOUT_MS));
 
 		return 0;
 	}
@@ -65,7 +89,7 @@ namespace Magnet
 		return false;
 	}
 
-	int send_and_receive_peer_msg(int peer_socket, const std::string payload, Network::Peer_Msg& peer_msg_resp)
+	int send_and_receive_peer_msg(Network::Peer& peer, const std::string payload, Network::Peer_Msg& peer_msg_resp)
 	{
 		// Send request to peer
 		Network::Peer_Msg peer_msg;
@@ -76,15 +100,26 @@ namespace Magnet
 		std::vector<Network::Peer_Msg> peer_msgs;
 		peer_msgs.push_back(peer_msg);
 
-		if (Network::send_peer_msgs(peer_socket, peer_msgs) != 0)
+		if (Network::send_peer_msgs(peer.peer_socket, peer_msgs) != 0)
 		{
 			std::cout << "Failed to send extension handshake msg\n";
 			return -1;
 		}
 
-		if (Network::receive_peer_msgs(peer_socket, peer_msgs, 1) != 0 || peer_msgs.size() < 1)
+		do
 		{
-			std::cout << "Failed to receive extension handshake msg\n";
+			if (Network::receive_peer_msgs(peer.peer_socket, peer_msgs, 1) != 0 || peer_msgs.size() < 1)
+			{
+				std::cout << "Failed to receive extension handshake msg\n";
+				return -1;
+			}
+
+			// HAVEs and Allowed Fast msgs may arrive before the answer
+		} while (peer_msgs[0].msg_type != Downloader::message_type::EXTENDED && Downloader::handle_peer_state_msg(peer, peer_msgs[0]));
+
+		if (peer_msgs[0].msg_type != Downloader::message_type::EXTENDED)
+		{
+			std::cout << "Expected extension msg but got " << static_cast<int>(peer_msgs[0].msg_type) << "\n";
 			return -1;
 		}
 
@@ -96,19 +131,20 @@ namespace Magnet
 	int get_peer_extension_id(Network::Peer& peer)
 	{
 		// receive and skip bitfield
-		Downloader::handle_bitfield_msg(peer.peer_socket);
+		Downloader::handle_bitfield_msg(peer);
 
 		// Send and receive extension handshake
 		std::string payload;
 		json m_dict = json::object();
 		m_dict["m"] = json::object();
 		m_dict["m"]["ut_metadata"] = MY_PEER_EXTENSION_ID; // my birthday :)
+		m_dict["m"]["ut_pex"] = PEX_EXTENSION_ID;
 
 		payload.push_back(0); // extension handshake
 		payload.append(Encoder::json_to_bencode(m_dict));
 
 		Network::Peer_Msg peer_msg;
-		if (send_and_receive_peer_msg(peer.peer_socket, payload, peer_msg) != 0)
+		if (send_and_receive_peer_msg(peer, payload, peer_msg) != 0)
 		{
 			std::cout << "Failed to perform handshake\n";
 			return -1;
@@ -117,13 +153,25 @@ namespace Magnet
 		std::string bencoded_resp = peer_msg.payload.substr(1);
 		auto m_dict_resp = Decoder::decode_bencoded_value(bencoded_resp);
 
-		peer.magnet_extension_id = m_dict_resp["m"]["ut_metadata"].get<int>();
+		if (!m_dict_resp.is_object() || !m_dict_resp.contains("m") || !m_dict_resp["m"].is_object())
+		{
+			std::cout << "Invalid extension handshake\n";
+			return -1;
+		}
+
+		const auto& extensions = m_dict_resp["m"];
+		if (extensions.contains("ut_metadata") && extensions["ut_metadata"].is_number_integer())
+			peer.magnet_extension_id = extensions["ut_metadata"].get<int>();
+		if (extensions.contains("ut_pex") && extensions["ut_pex"].is_number_integer())
+			peer.pex_extension_id = extensions["ut_pex"].get<int>();
+
+		peer.supports_extensions = true;
 		std::cout << "Got peer extension Id: " << peer.magnet_extension_id << "\n";
 
 		return 0;
 	}
 
-	int receive_torrent_info(const Network::Peer& peer, Torrent::TorrentData& torrent_data, bool do_unchoke)
+	int receive_torrent_info(Network::Peer& peer, Torrent::TorrentData& torrent_data, bool do_unchoke)
 	{
 		std::string payload;
 		json req_dict = json::object();
@@ -135,7 +183,7 @@ namespace Magnet
 		payload.append(Encoder::json_to_bencode(req_dict));
 
 		Network::Peer_Msg peer_msg;
-		if (send_and_receive_peer_msg(peer.peer_socket, payload, peer_msg) != 0
+		if (send_and_receive_peer_msg(peer, payload, peer_msg) != 0
 			|| (peer_msg.payload.size() < 1 || static_cast<int>(peer_msg.payload[0]) != MY_PEER_EXTENSION_ID))
 		{
 			std::cout << "Failed to receive torrent info\n";
@@ -156,7 +204,7 @@ namespace Magnet
 			if (do_unchoke)
 			{
 				// send interested and receive unchoke msg
-				Downloader::handle_unchoke_msg(peer.peer_socket);
+				Downloader::handle_unchoke_msg(&torrent_data, peer);
 			}
 
 			return 0;
@@ -3,6 +3,7 @@
 #define _MAGNET_LINKS_H_
 
 #include <string>
+#include <string_view>
 
 namespace Torrent
 {
@@ -17,15 +18,17 @@ namespace Network
 
 namespace Magnet
 {
+	std::string url_decode(std::string_view encoded);
+
 	int parse_magnet_link(const std::string& magnet_link, Torrent::TorrentData& torrent_data);
 
 	bool is_extension_supported(const std::string& base_handshake);
 
 	int get_peer_extension_id(Network::Peer& peer);
 
-	int send_and_receive_peer_msg(int peer_socket, const std::string payload, Network::Peer_Msg& peer_msg);
+	int send_and_receive_peer_msg(Network::Peer& peer, const std::string payload, Network::Peer_Msg& peer_msg); // other msgs in between update the peer's state
 
-	int receive_torrent_info(const Network::Peer& peer, Torrent::TorrentData& torrent_data, bool do_unchoke);
+	int receive_torrent_info(Network::Peer& peer, Torrent::TorrentData& torrent_data, bool do_unchoke);
 }
 
 
@@ -1,27 +1,204 @@
 
 #include "network_helper.h"
 #include "bencode_helper.h"
-#include "lib/http/httplib.h"
 #include "downloader.h"
 #include "magnet_links.h"
+#include "upload.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 
 #define BITTORRENT_PROTOCOL "BitTorrent protocol"
-#define PEER_ID "PUNITKOUJAPAVANKOUJA"
 
 namespace Network
 {
-	Peer::Peer(UCHAR u1, UCHAR u2, UCHAR u3, UCHAR u4, unsigned short port)
+	bool Peer_Address::from_compact(std::string_view compact, Peer_Address& address)
 	{
-		this->ip_addr = std::to_string(u1) + '.' + std::to_string(u2) + '.' + std::to_string(u3) + '.' + std::to_string(u4);
-		this->port = std::to_string(port);
+		address.storage = {};
+
+		if (compact.size() == 6)
+		{
+			auto addr_in = reinterpret_cast<sockaddr_in*>(&address.storage);
+			addr_in->sin_family = AF_INET;
+			std::memcpy(&addr_in->sin_addr, compact.data(), 4);
+			std::memcpy(&addr_in->sin_port, compact.data() + 4, 2); // already in network byte order
+			return true;
+		}
+
+		if (compact.size() == 18)
+		{
+			auto addr_in6 = reinterpret_cast<sockaddr_in6*>(&address.storage);
+			addr_in6->sin6_family = AF_INET6;
+			std::memcpy(&addr_in6->sin6_addr, compact.data(), 16);
+			std::memcpy(&addr_in6->sin6_port, compact.data() + 16, 2);
+			return true;
+		}
+
+		return false;
+	}
+
+	bool Peer_Address::from_string(const std::string& addr_str, Peer_Address& address)
+	{
+		address.storage = {};
+
+		auto colon_index = addr_str.rfind(':');
+		if (colon_index == std::string::npos || colon_index + 1 == addr_str.size())
+			return false;
+
+		std::string ip = addr_str.substr(0, colon_index);
+		int port = std::atoi(addr_str.c_str() + colon_index + 1);
+
+		if (port <= 0 || port > 0xFFFF)
+			return false;
+
+		if (ip.size() > 2 && ip.front() == '[' && ip.back() == ']')
+			ip = ip.substr(1, ip.size() - 2);
+
+		auto addr_in = reinterpret_cast<sockaddr_in*>(&address.storage);
+		if (inet_pton(AF_INET, ip.c_str(), &addr_in->sin_addr) == 1)
+		{
+			addr_in->sin_family = AF_INET;
+			addr_in->sin_port = htons(port);
+			return true;
+		}
+
+		auto addr_in6 = reinterpret_cast<sockaddr_in6*>(&address.storage);
+		if (inet_pton(AF_INET6, ip.c_str(), &addr_in6->sin6_addr) == 1)
+		{
+			addr_in6->sin6_family = AF_INET6;
+			addr_in6->sin6_port = htons(port);
+			return true;
+		}
+
+		return false;
+	}
+
+	uint16_t Peer_Address::port() const
+	{
+		if (family() == AF_INET6)
+			return ntohs(reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_port);
+
+		return ntohs(reinterpret_cast<const sockaddr_in*>(&storage)->sin_port);
+	}
+
+	socklen_t Peer_Address::length() const
+	{
+		return family() == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+	}
+
+	std::string Peer_Address::to_compact() const
+	{
+		if (family() == AF_INET6)
+		{
+			auto addr_in6 = reinterpret_cast<const sockaddr_in6*>(&storage);
+			return std::string(reinterpret_cast<const char*>(&addr_in6->sin6_addr), 16) + std::string(reinterpret_cast<const char*>(&addr_in6->sin6_port), 2);
+		}
+
+		auto addr_in = reinterpret_cast<const sockaddr_in*>(&storage);
+		return std::string(reinterpret_cast<const char*>(&addr_in->sin_addr), 4) + std::string(reinterpret_cast<const char*>(&addr_in->sin_port), 2);
+	}
+
+	std::string Peer_Address::to_string() const
+	{
+		char ip[INET6_ADDRSTRLEN] = {};
+
+		if (family() == AF_INET6)
+		{
+			inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_addr, ip, sizeof(ip));
+			return "[" + std::string(ip) + "]:" + std::to_string(port());
+		}
+
+		inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&storage)->sin_addr, ip, sizeof(ip));
+		return std::string(ip) + ":" + std::to_string(port());
+	}
+
+	Peer_Address Peer_Address::unmapped() const
+	{
+		auto addr_in6 = reinterpret_cast<const sockaddr_in6*>(&storage);
+		if (family() != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&addr_in6->sin6_addr))
+			return *this;
+
+		Peer_Address address;
+		auto addr_in = reinterpret_cast<sockaddr_in*>(&address.storage);
+		addr_in->sin_family = AF_INET;
+		addr_in->sin_port = addr_in6->sin6_port;
+		std::memcpy(&addr_in->sin_addr, &addr_in6->sin6_addr.s6_addr[12], 4);
+
+		return address;
+	}
+
+	bool Peer_Address::operator==(const Peer_Address& other) const
+	{
+		if (family() != other.family())
+			return false;
+
+		if (family() == AF_INET6)
+		{
+			auto lhs = reinterpret_cast<const sockaddr_in6*>(&storage);
+			auto rhs = reinterpret_cast<const sockaddr_in6*>(&other.storage);
+			return lhs->sin6_port == rhs->sin6_port && std::memcmp(&lhs->sin6_addr, &rhs->sin6_addr, 16) == 0;
+		}
+
+		auto lhs = reinterpret_cast<const sockaddr_in*>(&storage);
+		auto rhs = reinterpret_cast<const sockaddr_in*>(&other.storage);
+		return lhs->sin_port == rhs->sin_port && lhs->sin_addr.s_addr == rhs->sin_addr.s_addr;
+	}
+
+	size_t Peer_Address_Hash::operator()(const Peer_Address& address) const noexcept
+	{
+		// FNV-1a over the compact form, only the meaningful bytes of the sockaddr take part
+		uint64_t hash = 14695981039346656037ULL;
+		auto mix = [&hash](const void* data, size_t len)
+		{
+			auto bytes = static_cast<const uint8_t*>(data);
+			for (size_t i = 0; i < len; ++i)
+				hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		};
+
+		if (address.family() == AF_INET6)
+		{
+			auto addr_in6 = reinterpret_cast<const sockaddr_in6*>(&address.storage);
+			mix(&addr_in6->sin6_addr, 16);
+			mix(&addr_in6->sin6_port, 2);
+		}
+		else
+		{
+			auto addr_in = reinterpret_cast<const sockaddr_in*>(&address.storage);
+			mix(&addr_in->sin_addr, 4);
+			mix(&addr_in->sin_port, 2);
+		}
+
+		return hash;
+	}
+
+	bool Peer::has_piece(int piece_index) const
+	{
+		if (has_all)
+			return true;
+
+		size_t byte_index = piece_index / 8;
+		return piece_index >= 0 && byte_index < bitfield.size() && (static_cast<uint8_t>(bitfield[byte_index]) & (0x80 >> (piece_index % 8)));
 	}
 
-	std::string Peer::value() { return this->ip_addr + ":" + this->port; }
+	void Peer::set_piece(int piece_index)
+	{
+		if (piece_index < 0 || has_all)
+			return;
+
+		size_t byte_index = piece_index / 8;
+		if (byte_index >= bitfield.size())
+			bitfield.resize(byte_index + 1, 0);
+
+		bitfield[byte_index] |= static_cast<char>(0x80 >> (piece_index % 8));
+	}
 
 	std::string Peer_Msg::getMessage()
 	{
@@ -46,69 +223,25 @@ namespace Network
 		return std::make_tuple(domain, endpoint);
 	}
 
-	std::vector<Peer> process_peers_str(std::string&& encoded_peers)
+	std::vector<Peer> process_peers_str(std::string_view encoded_peers, int family)
 	{
 		std::vector<Peer> peers{};
+		size_t entry_len = family == AF_INET6 ? 18 : 6;
 
-		for (auto i = 0; i < encoded_peers.size(); i += 6)
+		peers.reserve(encoded_peers.size() / entry_len);
+
+		// ip followed by the port, both in network byte order
+		for (size_t i = 0; i + entry_len <= encoded_peers.size(); i += entry_len)
 		{
-			auto peer = encoded_peers.substr(i, 6);
-
-			// First four bytes are the ip, the final two bytes are the port in big endian.
-			peers.push_back(Peer(static_cast<UCHAR>(peer[0]),
-						static_cast<UCHAR>(peer[1]),
-						static_cast<UCHAR>(peer[2]),
-						static_cast<UCHAR>(peer[3]),
-						(static_cast<unsigned short>(peer[4] << 8) | static_cast<unsigned char>(peer[5]))));
+			Peer_Address address;
+			if (Peer_Address::from_compact(encoded_peers.substr(i, entry_len), address))
+				peers.emplace_back(address);
 		}
 
 		return peers;
 	}
 
-	std::vector<Peer> get_peers(const std::string& info_hash, const std::string& tracker, int length)
-	{
-		httplib::Params params{
-			{"peer_id", PEER_ID},
-			{"port", "6881"},
-			{"uploaded", "0"},
-			{"downloaded", "0"},
-			{"left", std::to_string(length)},
-			{"compact", "1"}
-		};
-
-		auto domain_and_endpoint = split_domain_and_endpoint(tracker);
-		httplib::Headers headers{};
-
-		auto encoded_info_hash = Encoder::encode_info_hash(Encoder::hash_to_hex(info_hash));
-
-		auto resp = httplib::Client(std::get<0>(domain_and_endpoint))
-				// By moving the info hash here we can avoid the url encoding of the query parameter.
-				.Get(std::get<1>(domain_and_endpoint) + "?info_hash=" + encoded_info_hash, params, headers);
-
-		if (!resp) {
-			std::cerr << "Failed to connect to tracker: " << tracker << std::endl;
-			return std::vector<Peer>();
-		}
-
-		auto resp_json = Decoder::decode_bencoded_value(resp->body);
-		
-		if (resp_json.contains("failure reason") && !resp_json["failure reason"].empty())
-		{
-			std::cerr << "Tracker request failed with err: " << resp_json["failure reason"].get<std::string>() << std::endl;
-			return std::vector<Peer>();
-		}
-		
-		if (resp_json.contains("peers"))
-		{
-			auto peers_str = resp_json["peers"].get<std::string>();
-			return process_peers_str(std::move(peers_str));
-		}
-		
-		std::cerr << "No peers found in tracker response" << std::endl;
-		return std::vector<Peer>();
-	}
-
-	void prepare_handshake(const std::string& hashinfo, bool is_magnet_download, std::string& handShake)
+	void prepare_handshake(const std::string& hashinfo, std::string& handShake)
 	{
 		char protocolLength = 19;
 		handShake.push_back(protocolLength);
@@ -119,8 +252,10 @@ namespace Network
 		//eight reserved bytes
 		for (int i = 0; i < 8 ; ++i)
 		{
-			if (is_magnet_download && i == 5)
-				handShake.push_back('\x10'); // 20th bit from the right
+			if (i == 5)
+				handShake.push_back('\x10'); // 20th bit from the right, extension protocol (metadata and pex)
+			else if (i == 7)
+				handShake.push_back(FAST_EXTENSION_BIT);
 			else	
 				handShake.push_back(0);
 		}
@@ -131,51 +266,86 @@ namespace Network
 	}
 
 
-	int connect_with_peer(const std::string& peer_addr_str)
+	bool is_fast_extension_supported(const std::string& handshake)
 	{
-		std::string peer_ip = peer_addr_str.substr(0, peer_addr_str.find(':'));
-		int peer_port = std::stoi(peer_addr_str.substr(peer_addr_str.find(':') + 1));
+		return handshake.size() >= 28 && (static_cast<uint8_t>(handshake[27]) & FAST_EXTENSION_BIT);
+	}
 
-		int my_socket = socket(AF_INET, SOCK_STREAM, 0);
+	int start_connect(const Peer_Address& peer_addr)
+	{
+		int my_socket = socket(peer_addr.family(), SOCK_STREAM | SOCK_NONBLOCK, 0);
 		if (my_socket < 0)
 		{
 			std::cerr << "Failed to create socket" << std::endl;
 			return -1;
 		}
 
-		struct sockaddr_in peer_addr;
-		peer_addr.sin_family = AF_INET;
-		peer_addr.sin_port = htons(peer_port);
-
-		if (inet_pton(AF_INET, peer_ip.c_str(), &peer_addr.sin_addr) < 0)
+		if (connect(my_socket, peer_addr.sock_addr(), peer_addr.length()) < 0 && errno != EINPROGRESS)
 		{
-			std::cerr << "Invalid IP address" << std::endl;
+			close(my_socket);
 			return -1;
 		}
 
-		std::cout << "Connecting to peer: " << peer_addr_str << "\n";
-		if (connect(my_socket, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0)
-		{
-			std::cerr << "Failed to connect to peer" << std::endl;
-			return -1;
-		}
-		std::cout << "Success connected to peer: " << peer_addr_str << "\n";
 		return my_socket;
 	}
 
-	int receive_peer_id_with_handshake(const Torrent::TorrentData& torrent_data, const std::string& peer_addr_str, Peer& peer)
+	int finish_connect(int peer_socket)
 	{
-		int my_socket = connect_with_peer(peer_addr_str);
-		if (my_socket < 0)
+		int error = 0;
+		socklen_t error_len = sizeof(error);
+
+		if (getsockopt(peer_socket, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0)
+			return -1;
+
+		// the peer threads use plain blocking reads and writes
+		return fcntl(peer_socket, F_SETFL, fcntl(peer_socket, F_GETFL) & ~O_NONBLOCK) == 0 ? 0 : -1;
+	}
+
+	int connect_with_peer(const Peer_Address& peer_addr, std::chrono::milliseconds timeout)
+	{
+		std::cout << "Connecting to peer: " << peer_addr.to_string() << "\n";
+
+		int my_socket = start_connect(peer_addr);
+		pollfd poll_fd{my_socket, POLLOUT, 0};
+
+		if (my_socket < 0 || poll(&poll_fd, 1, timeout.count()) != 1 || finish_connect(my_socket) != 0)
 		{
 			std::cerr << "Failed to connect to peer" << std::endl;
+
+			if (my_socket >= 0)
+				close(my_socket);
+
 			return -1;
 		}
 
+		std::cout << "Success connected to peer: " << peer_addr.to_string() << "\n";
+		return my_socket;
+	}
+
+	Peer_Timers::Peer_Timers()
+	{
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	}
+
+	Peer_Timers::~Peer_Timers()
+	{
+		if (wake_fd >= 0)
+			close(wake_fd);
+	}
+
+	void Peer_Timers::wake()
+	{
+		uint64_t one = 1;
+		if (write(wake_fd, &one, sizeof(one)) < 0)
+			std::cerr << "Failed to wake connection thread" << std::endl;
+	}
+
+	static int exchange_handshakes(const Torrent::TorrentData& torrent_data, Peer& peer, int my_socket)
+	{
 		std::string handshake_msg;
-		prepare_handshake(torrent_data.info_hash, torrent_data.is_magnet_download, handshake_msg);
+		prepare_handshake(torrent_data.info_hash, handshake_msg);
 
-		if (send(my_socket, handshake_msg.data(), handshake_msg.size(), 0) < 0)
+		if (send(my_socket, handshake_msg.data(), handshake_msg.size(), MSG_NOSIGNAL) < 0)
 		{
 			std::cerr << "Failed to send data to peer" << std::endl;
 			return -1;
@@ -183,7 +353,7 @@ namespace Network
 
 		std::string handshake_resp(handshake_msg.size(), 0);
 
-		if (recv(my_socket, handshake_resp.data(), handshake_resp.size(), 0) < 0)
+		if (receive_all(my_socket, handshake_resp.data(), handshake_resp.size()) != 0)
 		{
 			std::cerr << "Failed to receive data from peer" << std::endl;
 			return -1;
@@ -193,8 +363,13 @@ namespace Network
 		{
 			peer.peer_id.assign(handshake_resp.end() - 20, handshake_resp.end());			
 			peer.peer_socket = my_socket;
+			peer.supports_fast_extension = is_fast_extension_supported(handshake_resp);
 
-			if (torrent_data.is_magnet_download && Magnet::is_extension_supported(handshake_resp))
+			// with the Fast Extension our availability has to be the very first message
+			if (peer.supports_fast_extension && Upload::send_bitfield(torrent_data, peer) != 0)
+				return -1;
+
+			if (Magnet::is_extension_supported(handshake_resp))
 			{
 				std::cout << "Handshake supported\n";
 				
@@ -203,9 +378,15 @@ namespace Network
 					std::cerr << "Failed to get extension Id from peer" << std::endl;
 					return -1;
 				}
+
+				if (torrent_data.is_magnet_download && peer.magnet_extension_id == 0)
+				{
+					std::cerr << "Peer doesn't support metadata exchange" << std::endl;
+					return -1;
+				}
 			}
 
-			std::cout << "Successfully connected to peer: " << peer_addr_str << "\n";
+			std::cout << "Successfully connected to peer: " << peer.value() << "\n";
 
 			return 0;
 		}
@@ -213,13 +394,35 @@ namespace Network
 		return -1;
 	}
 
+	int receive_peer_id_with_handshake(const Torrent::TorrentData& torrent_data, Peer& peer, int connected_socket)
+	{
+		int my_socket = connected_socket >= 0 ? connected_socket : connect_with_peer(peer.address);
+		if (my_socket < 0)
+		{
+			std::cerr << "Failed to connect to peer" << std::endl;
+			return -1;
+		}
+
+		// a peer that accepts the connection and then never answers would keep us in recv forever
+		auto handshake_timer = Timer::shared_wheel().schedule(std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS), [my_socket]() { shutdown(my_socket, SHUT_RDWR); });
+		int result = exchange_handshakes(torrent_data, peer, my_socket);
+		Timer::shared_wheel().cancel(handshake_timer);
+
+		// the socket only belongs to the peer once the handshake got that far, the timer can't touch it after the cancel
+		if (result != 0 && peer.peer_socket != my_socket)
+			close(my_socket);
+
+		return result;
+	}
+
 	int send_peer_msgs(const int peer_socket, std::vector<Peer_Msg>& peer_msgs)
 	{
 		for (auto& peer_msg : peer_msgs)
 		{
 			std::string msg_to_send = peer_msg.getMessage();
 
-			if (send(peer_socket, msg_to_send.data(), msg_to_send.size(), 0) < 0)
+			// a peer that went away must not kill the process with SIGPIPE
+			if (send(peer_socket, msg_to_send.data(), msg_to_send.size(), MSG_NOSIGNAL) < 0)
 			{
 				std::cerr << "Failed to send data to peer" << std::endl;
 				return -1;
@@ -232,35 +435,126 @@ namespace Network
 		return 0;
 	}
 
-	int receive_peer_msgs(const int peer_socket, std::vector<Peer_Msg>& peer_msgs, int expected_responses)
+	int send_keepalive(const int peer_socket)
 	{
-		peer_msgs.clear();
-		int received_responses = 0;
+		const char keepalive_msg[4] = {0, 0, 0, 0};
 
-		while (received_responses < expected_responses)
+		if (send(peer_socket, keepalive_msg, sizeof(keepalive_msg), MSG_NOSIGNAL) < 0)
 		{
-			Peer_Msg peer_msg;
-			std::vector<char> total_len_bytes(4);
-			read(peer_socket, total_len_bytes.data(), total_len_bytes.size());
+			std::cerr << "Failed to send keep-alive to peer" << std::endl;
+			return -1;
+		}
 
-			auto total_len = Encoder::uint8_to_uint32(total_len_bytes[0], total_len_bytes[1], total_len_bytes[2], total_len_bytes[3]);
-			peer_msg.total_bytes = total_len;
+		return 0;
+	}
 
-			// read message type
-			read(peer_socket, &peer_msg.msg_type, sizeof(peer_msg.msg_type));
-			--total_len;
+	int receive_all(const int peer_socket, char* buffer, size_t len)
+	{
+		size_t bytes_read = 0;
 
-			// receive rest of the msg
-			if (total_len > 0)
-			{
-				std::string actual_msg(total_len, 0);
-				auto bytes_read = recv(peer_socket, actual_msg.data(), actual_msg.size(), 0);
+		while (bytes_read < len)
+		{
+			auto curr_read = recv(peer_socket, buffer + bytes_read, len - bytes_read, 0);
 
-				while (bytes_read != total_len)
-					bytes_read += recv(peer_socket, actual_msg.data() + bytes_read, total_len - bytes_read, 0);
+			if (curr_read <= 0) // peer closed the connection or the socket failed
+				return -1;
+
+			bytes_read += curr_read;
+		}
+
+		return 0;
+	}
 
-				peer_msg.payload = actual_msg;
+	int wait_readable(const int peer_socket, std::chrono::milliseconds timeout, int wake_fd)
+	{
+		pollfd poll_fds[2] = {{peer_socket, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+		int poll_timeout = timeout == std::chrono::milliseconds::max() ? -1 : std::clamp<int64_t>(timeout.count(), 0, INT32_MAX);
+		int ready = poll(poll_fds, wake_fd >= 0 ? 2 : 1, poll_timeout);
+
+		if (ready < 0)
+			return errno == EINTR ? 0 : -1;
+
+		if (wake_fd >= 0 && poll_fds[1].revents != 0)
+		{
+			uint64_t wake_count = 0;
+			if (read(wake_fd, &wake_count, sizeof(wake_count)) < 0 && errno != EAGAIN)
+				return -1;
+
+			return 2;
+		}
+
+		return ready > 0 ? 1 : 0;
+	}
+
+	// Longest msg (length prefix value, msg id included) a peer may send: a PIECE with the largest block we accept,
+	// which also bounds REQUEST and the extension msgs, and a BITFIELD with one bit per piece
+	static uint64_t max_msg_length(uint8_t msg_type, int piece_count)
+	{
+		if (msg_type == Downloader::message_type::BITFIELD && piece_count >= 0)
+			return 1 + (static_cast<uint64_t>(piece_count) + 7) / 8;
+
+		return 1 + 8 + UPLOAD_MAX_BLOCK_SIZE;
+	}
+
+	int receive_peer_msg(const int peer_socket, Peer_Msg& peer_msg, int piece_count)
+	{
+		peer_msg = Peer_Msg{};
+
+		std::vector<char> total_len_bytes(4);
+		if (receive_all(peer_socket, total_len_bytes.data(), total_len_bytes.size()) != 0)
+		{
+			std::cerr << "Failed to receive data from peer" << std::endl;
+			return -1;
+		}
+
+		auto total_len = Encoder::uint8_to_uint32(total_len_bytes[0], total_len_bytes[1], total_len_bytes[2], total_len_bytes[3]);
+		peer_msg.total_bytes = total_len;
+
+		if (total_len == 0)
+			return 0; // keep-alive, there is no message type
+
+		// read message type
+		if (receive_all(peer_socket, reinterpret_cast<char*>(&peer_msg.msg_type), sizeof(peer_msg.msg_type)) != 0)
+		{
+			std::cerr << "Failed to receive data from peer" << std::endl;
+			return -1;
+		}
+		if (total_len > max_msg_length(peer_msg.msg_type, piece_count))
+		{
+			std::cerr << "Peer sent a msg of type " << static_cast<int>(peer_msg.msg_type) << " with " << total_len << " bytes, more than the protocol allows" << std::endl;
+			return -1;
+		}
+
+		--total_len;
+
+		// receive rest of the msg
+		if (total_len > 0)
+		{
+			peer_msg.payload.resize(total_len);
+
+			if (receive_all(peer_socket, peer_msg.payload.data(), peer_msg.payload.size()) != 0)
+			{
+				std::cerr << "Failed to receive data from peer" << std::endl;
+				return -1;
 			}
+		}
+
+		return 0;
+	}
+
+	int receive_peer_msgs(const int peer_socket, std::vector<Peer_Msg>& peer_msgs, int expected_responses)
+	{
+		peer_msgs.clear();
+		int received_responses = 0;
+
+		while (received_responses < expected_responses)
+		{
+			Peer_Msg peer_msg;
+			if (receive_peer_msg(peer_socket, peer_msg) != 0)
+				return -1;
+
+			if (peer_msg.total_bytes == 0)
+				continue; // keep-alives don't count as a response
 
 			peer_msgs.push_back(peer_msg);
 			++received_responses;
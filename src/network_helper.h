@@ -2,9 +2,27 @@
 #ifndef _NETWORK_HELPER_H
 #define _NETWORK_HELPER_H
 
+#include "timer_wheel.h"
+#include "rate_limiter.h"
+
 #include <string>
+#include <string_view>
 #include <vector>
+#include <chrono>
+#include <unordered_set>
+#include <deque>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define PEER_ID "PUNITKOUJAPAVANKOUJA"
+#define TORRENT_LISTEN_PORT 6881 // port announced to trackers and the DHT
+#define FAST_EXTENSION_BIT 0x04  // reserved byte 7 of the handshake (BEP 6)
+#define MAX_SUGGESTED_PIECES 16  // SUGGEST_PIECE hints remembered per peer
+#define CONNECT_TIMEOUT_MS 3000  // instead of the OS default of two minutes and more
+#define HANDSHAKE_TIMEOUT_MS 10000 // both handshakes, and the extension handshake when there is one
 
 namespace Torrent
 {
@@ -15,24 +33,108 @@ namespace Network
 {
 	using UCHAR = unsigned char;
 
+	// IPv4 or IPv6 endpoint kept in binary form so that it can be compared and hashed without string conversions
+	struct Peer_Address
+	{
+		sockaddr_storage storage{};
+
+		static bool from_compact(std::string_view compact, Peer_Address& address); // 6 bytes (IPv4) or 18 bytes (IPv6), port in big endian
+
+		static bool from_string(const std::string& addr_str, Peer_Address& address); // "1.2.3.4:6881" or "[::1]:6881"
+
+		int family() const { return storage.ss_family; }
+
+		uint16_t port() const;
+
+		socklen_t length() const;
+
+		const sockaddr* sock_addr() const { return reinterpret_cast<const sockaddr*>(&storage); }
+
+		std::string to_compact() const;
+
+		std::string to_string() const;
+
+		Peer_Address unmapped() const; // an IPv4-mapped IPv6 address (::ffff:a.b.c.d) as plain IPv4, any other unchanged
+
+		bool operator==(const Peer_Address& other) const;
+	};
+
+	struct Peer_Address_Hash
+	{
+		size_t operator()(const Peer_Address& address) const noexcept;
+	};
+
+	// Timers of a connection fire on the shared timer wheel. They only note what is due and wake the thread that owns
+	// the connection through wake_fd (an eventfd it polls together with the socket), which then acts on it.
+	struct Peer_Timers
+	{
+		int wake_fd = -1;
+		std::mutex timers_mutex;
+		bool is_keepalive_due = false;
+		std::vector<std::pair<int, int>> expired_requests; // (piece index, block) of requests that timed out
+		Timer::Timer_Id keepalive_timer = 0;
+
+		Peer_Timers();
+
+		~Peer_Timers();
+
+		void wake();
+	};
+
 	struct Peer
 	{
 		std::string peer_id;
-		std::string ip_addr;
-		std::string port;
+		Peer_Address address;
 		int peer_socket = 0;
 		int magnet_extension_id = 0;
-
-		Peer(UCHAR u1, UCHAR u2, UCHAR u3, UCHAR u4, unsigned short port);
+		int pex_extension_id = 0; // 0 when the peer doesn't support ut_pex
+		bool supports_extensions = false; // extension handshake done, which also consumed the bitfield
+		bool is_local = false; // found through LSD on the LAN, preferred over remote peers
+		bool supports_fast_extension = false; // both handshakes had the BEP 6 bit set
+		size_t have_cursor = 0; // verified pieces already announced to this peer with HAVE
+		std::chrono::microseconds connect_rtt{0}; // how long the TCP or uTP connect took, 0 if unknown
+		bool is_utp = false; // the last connection went over uTP, the socket is then one end of a socket pair
+
+		// download score of the current connection, smoothed exponentially so one stalled block doesn't dominate
+		double download_rate = 0;     // bytes per second, sampled once per piece
+		double block_latency_ms = 0;  // from REQUEST to its PIECE
+		int scored_pieces = 0;        // samples in download_rate, it means little before a few pieces
+		bool is_snubbed = false;      // no block arrived for PEER_SNUB_TIMEOUT_SEC while we waited for one
+
+		std::shared_ptr<Peer_Timers> timers; // while a download thread holds the connection
+		std::shared_ptr<RateLimit::Token_Bucket> download_bucket; // paces our requests, created on the first one
+
+		// peer wire state (BEP 3), every connection starts out choked and not interested in both directions
+		bool am_choking = true;
+		bool am_interested = false;
+		bool peer_choking = true;
+		bool peer_interested = false;
+
+		// what the remote side told us: its pieces and (BEP 6) what it lets us take while it chokes us
+		bool has_all = false; // HAVE_ALL, bitfield stays empty
+		std::string bitfield;
+		std::unordered_set<int> allowed_fast;
+		std::deque<int> suggested_pieces; // newest last
+
+		// ut_pex state: addresses already advertised to this peer and when we last exchanged messages
+		std::unordered_set<Peer_Address, Peer_Address_Hash> pex_advertised;
+		std::chrono::steady_clock::time_point last_pex_sent{};
+		std::chrono::steady_clock::time_point last_pex_received{};
+
+		explicit Peer(const Peer_Address& address) : address(address) {}
 		Peer() = default;
 
-		std::string value();
+		std::string value() const { return address.to_string(); }
+
+		bool has_piece(int piece_index) const;
+
+		void set_piece(int piece_index); // HAVE, grows the bitfield as needed
 	};
 
 	struct Peer_Msg
 	{
 		uint64_t total_bytes = 0;
-		uint8_t msg_type;
+		uint8_t msg_type = 0;
 		std::string payload;
 
 		std::string getMessage();
@@ -40,19 +142,36 @@ namespace Network
 
 	std::tuple<std::string, std::string> split_domain_and_endpoint(const std::string& tracker_url);
 
-	std::vector<Peer> get_peers(const std::string& info_hash, const std::string& tracker, int length);
+	// compact peer lists: 6 bytes per entry for AF_INET ("peers"), 18 bytes per entry for AF_INET6 ("peers6")
+	std::vector<Peer> process_peers_str(std::string_view encoded_peers, int family = AF_INET);
+
+	void prepare_handshake(const std::string& hashinfo, std::string& handShake);
+
+	bool is_fast_extension_supported(const std::string& handshake);
 
-	std::vector<Peer> process_peers_str(std::string&& encoded_peers);
+	int start_connect(const Peer_Address& peer_addr); // non-blocking connect, returns the socket while it's in progress
 
-	void prepare_handshake(const std::string& hashinfo, bool is_magnet_download, std::string& handShake);
+	int finish_connect(int peer_socket); // after the socket polled writable: 0 if connected (and blocking again), -1 if not
 
-	int connect_with_peer(const std::string& peer_addr);
+	int connect_with_peer(const Peer_Address& peer_addr, std::chrono::milliseconds timeout = std::chrono::milliseconds(CONNECT_TIMEOUT_MS));
 
-	int receive_peer_id_with_handshake(const Torrent::TorrentData& torrent_data, const std::string& peer_addr_str, Peer& peer);
+	// Connects (unless connected_socket is given, e.g. by the Connector) and exchanges the handshakes
+	int receive_peer_id_with_handshake(const Torrent::TorrentData& torrent_data, Peer& peer, int connected_socket = -1);
+
+	int receive_all(const int peer_socket, char* buffer, size_t len);
+
+	// 1 when data is waiting, 2 when wake_fd was signalled, 0 on timeout (milliseconds::max() waits forever), -1 on error
+	int wait_readable(const int peer_socket, std::chrono::milliseconds timeout, int wake_fd = -1);
 
 	int send_peer_msgs(const int peer_socket, std::vector<Peer_Msg>& peer_msgs);
 
-	int receive_peer_msgs(const int peer_socket, std::vector<Peer_Msg>& peer_msgs, int expected_responses);
+	int send_keepalive(const int peer_socket); // a bare zero length prefix, no msg id
+
+	// total_bytes == 0 for a keep-alive. A length prefix over what the msg type allows fails before anything is allocated,
+	// BITFIELD is held to the size piece_count needs when it is known (>= 0)
+	int receive_peer_msg(const int peer_socket, Peer_Msg& peer_msg, int piece_count = -1);
+
+	int receive_peer_msgs(const int peer_socket, std::vector<Peer_Msg>& peer_msgs, int expected_responses); // skips keep-alives
 
 }
 
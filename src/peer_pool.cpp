@@ -0,0 +1,202 @@
+
+#include "peer_pool.h"
+
+#include <algorithm>
+
+namespace Network
+{
+	int Peer_Pool::add_peers(const std::vector<Peer>& new_peers)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		int added = 0;
+
+		for (auto peer : new_peers)
+		{
+			if (!known_addrs.insert(peer.address).second)
+			{
+				// a tracker may have handed out a peer before LSD saw it on the LAN
+				if (peer.is_local)
+				{
+					auto known_it = std::find_if(peers.begin(), peers.end(), [&peer](const Peer& known) { return known.address == peer.address; });
+					known_it->is_local = true;
+				}
+
+				continue;
+			}
+
+			peers.push_back(std::move(peer));
+			candidates.emplace_back();
+			++added;
+		}
+
+		if (added > 0)
+			pool_cv.notify_all();
+
+		return added;
+	}
+
+	Peer& Peer_Pool::operator[](size_t index)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return peers.at(index);
+	}
+
+	size_t Peer_Pool::size() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return peers.size();
+	}
+
+	bool Peer_Pool::empty() const
+	{
+		return size() == 0;
+	}
+
+	bool Peer_Pool::wait_for_peers(size_t known_count, std::chrono::milliseconds timeout)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return pool_cv.wait_for(lock, timeout, [this, known_count]() { return peers.size() > known_count; });
+	}
+
+	void Peer_Pool::set_connected(const Peer_Address& address, bool is_connected)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+
+		if (is_connected)
+			connected_addrs.insert(address);
+		else
+			connected_addrs.erase(address);
+	}
+
+	std::vector<Peer_Address> Peer_Pool::connected_addresses() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return std::vector<Peer_Address>(connected_addrs.begin(), connected_addrs.end());
+	}
+
+	int Peer_Pool::claim(int skipped_index)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		auto now = Clock::now();
+
+		auto is_ready = [this, skipped_index, now](size_t index) {
+			const auto& candidate = candidates[index];
+			return static_cast<int>(index) != skipped_index && !candidate.is_in_use && !candidate.is_banned
+				   && candidate.failures < PEER_MAX_FAILURES && candidate.retry_at <= now;
+		};
+
+		// LAN peers found through LSD transfer at line rate, take a free one before any remote peer
+		for (size_t index = 0; index < peers.size(); ++index)
+		{
+			if (peers[index].is_local && is_ready(index))
+			{
+				candidates[index].is_in_use = true;
+				return index;
+			}
+		}
+
+		// round robin over the rest, so that every known peer gets its turn
+		for (size_t tried = 0; tried < peers.size(); ++tried)
+		{
+			size_t index = next_candidate++ % peers.size();
+
+			if (is_ready(index))
+			{
+				candidates[index].is_in_use = true;
+				return index;
+			}
+		}
+
+		return -1;
+	}
+
+	void Peer_Pool::release(size_t index, std::chrono::seconds retry_after)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		auto& candidate = candidates.at(index);
+
+		candidate.is_in_use = false;
+		candidate.retry_at = Clock::now() + retry_after;
+		candidate.download_rate = 0;
+	}
+
+	void Peer_Pool::release_failed(size_t index)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		auto& candidate = candidates.at(index);
+
+		++candidate.failures;
+		candidate.is_in_use = false;
+		candidate.download_rate = 0;
+
+		int backoff_sec = std::min(PEER_RETRY_BACKOFF_SEC << std::min(candidate.failures - 1, 16), PEER_MAX_BACKOFF_SEC);
+		candidate.retry_at = Clock::now() + std::chrono::seconds(backoff_sec);
+	}
+
+	void Peer_Pool::reset_failures(size_t index)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		candidates.at(index).failures = 0;
+	}
+
+	void Peer_Pool::set_download_rate(size_t index, double bytes_per_sec)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		candidates.at(index).download_rate = bytes_per_sec;
+	}
+
+	double Peer_Pool::fastest_download_rate() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		double fastest = 0;
+
+		for (const auto& candidate : candidates)
+		{
+			if (candidate.is_in_use)
+				fastest = std::max(fastest, candidate.download_rate);
+		}
+
+		return fastest;
+	}
+
+	bool Peer_Pool::add_hash_failure(size_t index)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		auto& candidate = candidates.at(index);
+
+		if (++candidate.hash_failures < PEER_MAX_HASH_FAILURES || candidate.is_banned)
+			return false;
+
+		candidate.is_banned = true;
+		return true;
+	}
+
+	void Peer_Pool::ban(size_t index)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		candidates.at(index).is_banned = true;
+	}
+
+	bool Peer_Pool::is_banned(size_t index) const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		return candidates.at(index).is_banned;
+	}
+
+	void Peer_Pool::mark_tried(size_t index)
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		candidates.at(index).was_tried = true;
+	}
+
+	bool Peer_Pool::has_untried_candidates() const
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		auto now = Clock::now();
+
+		// claimed but not tried means the connection is still being set up for a download thread
+		return std::any_of(candidates.begin(), candidates.end(), [now](const Candidate_State& candidate) {
+			return !candidate.was_tried && !candidate.is_banned && candidate.failures < PEER_MAX_FAILURES && (candidate.is_in_use || candidate.retry_at <= now);
+		});
+	}
+}
@@ -0,0 +1,97 @@
+
+#ifndef _PEER_POOL_H_
+#define _PEER_POOL_H_
+
+#include "network_helper.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_set>
+
+#define PEER_MAX_FAILURES 5         // consecutive failures after which a peer is never tried again
+#define PEER_RETRY_BACKOFF_SEC 5    // doubles with every consecutive failure
+#define PEER_MAX_BACKOFF_SEC 300
+#define PEER_IDLE_BACKOFF_SEC 30    // a peer that had nothing we needed may have picked up pieces by then
+#define PEER_SLOW_BACKOFF_SEC 120   // snubbed or evicted as too slow, other candidates get their chance first
+#define PEER_MAX_HASH_FAILURES 2    // pieces failing their hash check a peer may contribute to before it is banned
+
+namespace Network
+{
+	// Thread-safe set of candidate peers for a torrent.
+	// Peers are de-duplicated by address and are never removed, so references
+	// handed out by operator[] stay valid while other threads keep adding.
+	// It also acts as the connection manager: download threads claim a candidate, connect to it and release it
+	// again, failed peers are backed off exponentially and retired after PEER_MAX_FAILURES in a row.
+	class Peer_Pool
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		int add_peers(const std::vector<Peer>& new_peers); // returns number of peers that were not known yet, known peers only pick up is_local
+
+		Peer& operator[](size_t index);
+
+		size_t size() const;
+
+		bool empty() const;
+
+		// Blocks until the pool holds more than known_count peers, returns false on timeout
+		bool wait_for_peers(size_t known_count, std::chrono::milliseconds timeout);
+
+		// Next candidate to connect to: a free LAN peer first, then the others round robin. Peers in use, backing off
+		// or retired are skipped, as is skipped_index (the peer the caller just gave up on). Returns -1 if none is ready.
+		int claim(int skipped_index = -1);
+
+		// The connection ended without a failure, the peer can be claimed again after retry_after
+		void release(size_t index, std::chrono::seconds retry_after = std::chrono::seconds(0));
+
+		void release_failed(size_t index);
+
+		void reset_failures(size_t index); // the peer delivered a piece
+
+		// Smoothed download rate of the connection to a claimed peer, what slow peers are compared against
+		void set_download_rate(size_t index, double bytes_per_sec);
+
+		double fastest_download_rate() const; // over the peers currently in use
+
+		void mark_tried(size_t index); // a download thread got a connection to the peer
+
+		// The peer contributed to a piece that failed its hash check, returns true when this got it banned
+		bool add_hash_failure(size_t index);
+
+		void ban(size_t index); // never claimed again, for the rest of the session
+
+		bool is_banned(size_t index) const;
+
+		bool has_untried_candidates() const; // no download thread had the peer yet and it isn't retired
+
+		// Tracks which addresses we currently hold a connection to, these are what PEX advertises
+		void set_connected(const Peer_Address& address, bool is_connected);
+
+		std::vector<Peer_Address> connected_addresses() const;
+
+	private:
+		struct Candidate_State
+		{
+			bool is_in_use = false;
+			bool was_tried = false;
+			bool is_banned = false;
+			int failures = 0;
+			int hash_failures = 0;
+			double download_rate = 0;
+			Clock::time_point retry_at{};
+		};
+
+		mutable std::mutex pool_mutex;
+		std::condition_variable pool_cv;
+		std::deque<Peer> peers;
+		std::deque<Candidate_State> candidates; // same index as peers
+		size_t next_candidate = 0;
+		std::unordered_set<Peer_Address, Peer_Address_Hash> known_addrs;
+		std::unordered_set<Peer_Address, Peer_Address_Hash> connected_addrs;
+	};
+}
+
+#endif
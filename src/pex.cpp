@@ -0,0 +1,119 @@
+
+#include "pex.h"
+#include "bencode_helper.h"
+#include "network_helper.h"
+
+#define PEX_FLAG_REACHABLE 0x10 // we connected to the peer, so it accepts incoming connections
+
+namespace PEX
+{
+	int send_pex_msg(Torrent::TorrentData& torrent_data, Network::Peer& peer)
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		if (peer.pex_extension_id == 0 || now - peer.last_pex_sent < std::chrono::seconds(PEX_INTERVAL_SEC))
+			return 0;
+
+		auto connected = torrent_data.peers.connected_addresses();
+		std::unordered_set<Network::Peer_Address, Network::Peer_Address_Hash> connected_set(connected.begin(), connected.end());
+
+		std::string added, added6, added_flags, dropped, dropped6;
+		int added_count = 0, dropped_count = 0;
+
+		for (const auto& address : connected)
+		{
+			if (added_count >= PEX_MAX_PEERS)
+				break;
+
+			if (address == peer.address || peer.pex_advertised.contains(address))
+				continue;
+
+			(address.family() == AF_INET6 ? added6 : added) += address.to_compact();
+			if (address.family() == AF_INET)
+				added_flags.push_back(PEX_FLAG_REACHABLE);
+
+			peer.pex_advertised.insert(address);
+			++added_count;
+		}
+
+		for (auto advertised_it = peer.pex_advertised.begin(); advertised_it != peer.pex_advertised.end();)
+		{
+			if (dropped_count >= PEX_MAX_PEERS || connected_set.contains(*advertised_it))
+			{
+				++advertised_it;
+				continue;
+			}
+
+			(advertised_it->family() == AF_INET6 ? dropped6 : dropped) += advertised_it->to_compact();
+			advertised_it = peer.pex_advertised.erase(advertised_it);
+			++dropped_count;
+		}
+
+		peer.last_pex_sent = now;
+
+		if (added_count == 0 && dropped_count == 0)
+			return 0;
+
+		json pex_dict = json::object();
+		pex_dict["added"] = added;
+		pex_dict["added.f"] = added_flags;
+		pex_dict["added6"] = added6;
+		pex_dict["dropped"] = dropped;
+		pex_dict["dropped6"] = dropped6;
+
+		Network::Peer_Msg peer_msg;
+		peer_msg.msg_type = 20; // extended message
+		peer_msg.payload.push_back(static_cast<char>(peer.pex_extension_id));
+		peer_msg.payload.append(Encoder::json_to_bencode(pex_dict));
+
+		std::vector<Network::Peer_Msg> peer_msgs{peer_msg};
+		return Network::send_peer_msgs(peer.peer_socket, peer_msgs);
+	}
+
+	int handle_pex_msg(Torrent::TorrentData& torrent_data, Network::Peer& peer, const std::string& payload)
+	{
+		// a well behaved peer sends one message a minute, anything faster is dropped rather than processed
+		auto now = std::chrono::steady_clock::now();
+		if (now - peer.last_pex_received < std::chrono::seconds(PEX_INTERVAL_SEC / 2))
+			return 0;
+
+		peer.last_pex_received = now;
+
+		json pex_dict;
+		try
+		{
+			size_t position = 0;
+			pex_dict = Decoder::decode_bencoded_value(payload, position);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Invalid ut_pex msg from peer " << peer.value() << std::endl;
+			return -1;
+		}
+
+		if (!pex_dict.is_object())
+			return -1;
+
+		std::vector<Network::Peer> pex_peers;
+
+		for (auto [key, family] : {std::pair<const char*, int>{"added", AF_INET}, {"added6", AF_INET6}})
+		{
+			if (!pex_dict.contains(key) || !pex_dict[key].is_string())
+				continue;
+
+			auto peers = Network::process_peers_str(pex_dict[key].get<std::string>(), family);
+
+			if (peers.size() > PEX_MAX_PEERS)
+				peers.resize(PEX_MAX_PEERS);
+
+			pex_peers.insert(pex_peers.end(), peers.begin(), peers.end());
+		}
+
+		// dropped peers are only disconnected from the sender, they stay valid candidates for us
+
+		int added = torrent_data.peers.add_peers(pex_peers);
+		std::cout << "PEX from " << peer.value() << ": " << pex_peers.size() << " peer(s), " << added << " new\n";
+
+		return 0;
+	}
+}
@@ -0,0 +1,30 @@
+
+#ifndef _PEX_H_
+#define _PEX_H_
+
+#include <string>
+
+#define PEX_EXTENSION_ID 1       // our local id for ut_pex in the extended handshake
+#define PEX_INTERVAL_SEC 60      // BEP 11: at most one ut_pex message per minute and peer
+#define PEX_MAX_PEERS 50         // added/dropped entries per message
+
+namespace Torrent
+{
+	struct TorrentData;
+}
+
+namespace Network
+{
+	struct Peer;
+}
+
+namespace PEX
+{
+	// Sends the peers we connected to / dropped since the last message to this peer, if a minute has passed
+	int send_pex_msg(Torrent::TorrentData& torrent_data, Network::Peer& peer);
+
+	// Feeds the peers announced in a ut_pex message (payload without the extended message id) into the candidate pool
+	int handle_pex_msg(Torrent::TorrentData& torrent_data, Network::Peer& peer, const std::string& payload);
+}
+
+#endif
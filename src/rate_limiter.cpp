@@ -0,0 +1,91 @@
+
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace RateLimit
+{
+	Token_Bucket::Token_Bucket(Token_Bucket* parent, const std::atomic<int64_t>* shared_rate) : parent(parent), shared_rate(shared_rate)
+	{
+	}
+
+	void Token_Bucket::set_rate(int64_t bytes_per_sec)
+	{
+		own_rate = std::max<int64_t>(bytes_per_sec, 0);
+	}
+
+	int64_t Token_Bucket::rate() const
+	{
+		return shared_rate ? std::max<int64_t>(shared_rate->load(), 0) : own_rate.load();
+	}
+
+	int64_t Token_Bucket::effective_rate() const
+	{
+		int64_t parent_rate = parent ? parent->effective_rate() : 0;
+		int64_t my_rate = rate();
+
+		if (my_rate == 0 || parent_rate == 0)
+			return std::max(my_rate, parent_rate);
+
+		return std::min(my_rate, parent_rate);
+	}
+
+	std::chrono::milliseconds Token_Bucket::delay()
+	{
+		std::chrono::milliseconds my_delay{0};
+
+		std::unique_lock<std::mutex> lock(bucket_mutex);
+		refill(std::chrono::steady_clock::now());
+
+		int64_t bytes_per_sec = rate();
+		if (bytes_per_sec > 0 && tokens < 0)
+			my_delay = std::chrono::milliseconds(static_cast<int64_t>(std::ceil(-tokens * 1000 / bytes_per_sec)));
+
+		lock.unlock();
+
+		return parent ? std::max(my_delay, parent->delay()) : my_delay;
+	}
+
+	void Token_Bucket::consume(int64_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(bucket_mutex);
+		refill(std::chrono::steady_clock::now());
+
+		if (rate() > 0)
+			tokens -= bytes;
+
+		lock.unlock();
+
+		if (parent)
+			parent->consume(bytes);
+	}
+
+	void Token_Bucket::refill(std::chrono::steady_clock::time_point now)
+	{
+		int64_t bytes_per_sec = rate();
+		double elapsed_sec = std::chrono::duration<double>(now - last_refill).count();
+		last_refill = now;
+
+		// an unlimited bucket keeps no debt, lifting a limit takes effect right away
+		if (bytes_per_sec == 0)
+		{
+			tokens = 0;
+			return;
+		}
+
+		tokens = std::min(tokens + bytes_per_sec * elapsed_sec, bytes_per_sec * RATE_LIMIT_BURST_MS / 1000.0);
+	}
+
+	Token_Bucket& global_download()
+	{
+		static Token_Bucket bucket;
+		return bucket;
+	}
+
+	Token_Bucket& global_upload()
+	{
+		static Token_Bucket bucket;
+		return bucket;
+	}
+}
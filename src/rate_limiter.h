@@ -0,0 +1,54 @@
+
+#ifndef _RATE_LIMITER_H_
+#define _RATE_LIMITER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#define RATE_LIMIT_BURST_MS 500 // a bucket holds this much of its rate, what an idle connection may send at once
+
+namespace RateLimit
+{
+	// Token bucket for one direction of traffic, in bytes/s with 0 meaning unlimited. Buckets form a hierarchy
+	// (global, torrent, peer): a transfer has to fit into its own bucket and every parent, and is charged to all of them.
+	// Transfers are paced before they start instead of being cut short, a block may be taken once no bucket on the
+	// way up is in debt and the whole block is charged then, so the rate holds on average at block granularity.
+	// Rates can be changed at any time, the next delay() already uses them.
+	class Token_Bucket
+	{
+	public:
+		// A bucket with a shared_rate follows it instead of its own, one setting covers every peer's bucket
+		explicit Token_Bucket(Token_Bucket* parent = nullptr, const std::atomic<int64_t>* shared_rate = nullptr);
+
+		void set_rate(int64_t bytes_per_sec);
+
+		int64_t rate() const;
+
+		int64_t effective_rate() const; // the tightest limit of this bucket and its parents, 0 if none is limited
+
+		// How long until a transfer may start, zero right away. The longest wait of this bucket and its parents.
+		std::chrono::milliseconds delay();
+
+		void consume(int64_t bytes); // charges this bucket and its parents, they may go into debt
+
+	private:
+		void refill(std::chrono::steady_clock::time_point now); // needs bucket_mutex
+
+		Token_Bucket* parent = nullptr;
+		const std::atomic<int64_t>* shared_rate = nullptr;
+		std::atomic<int64_t> own_rate = 0;
+
+		double tokens = 0; // bytes, negative while in debt
+		std::chrono::steady_clock::time_point last_refill = std::chrono::steady_clock::now();
+		std::mutex bucket_mutex;
+	};
+
+	// process wide limits every torrent's buckets hang off
+	Token_Bucket& global_download();
+
+	Token_Bucket& global_upload();
+}
+
+#endif
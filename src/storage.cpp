@@ -0,0 +1,232 @@
+
+#include "storage.h"
+#include "bencode_helper.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <filesystem>
+
+namespace Storage
+{
+	File_Storage::~File_Storage()
+	{
+		close();
+	}
+
+	int File_Storage::open(const Torrent::TorrentData& torrent_data, int piece_index, bool is_existing)
+	{
+		close();
+
+		piece_length = torrent_data.piece_length;
+		piece_hashes_count = torrent_data.piece_hashes.size();
+
+		if (piece_index >= 0)
+		{
+			int64_t offset = static_cast<int64_t>(piece_index) * piece_length;
+			files.push_back(File_Entry{torrent_data.out_file, offset, std::min<int64_t>(piece_length, torrent_data.length - offset)});
+		}
+		else if (torrent_data.is_multi_file)
+		{
+			std::string base_path = torrent_data.out_file;
+			if (!torrent_data.name.empty())
+				base_path += "/" + torrent_data.name;
+
+			int64_t offset = 0;
+			for (const auto& file_info : torrent_data.files)
+			{
+				std::string file_path = base_path;
+				for (const auto& path_component : file_info.path)
+					file_path += "/" + path_component;
+
+				files.push_back(File_Entry{file_path, offset, file_info.length});
+				offset += file_info.length;
+			}
+		}
+		else
+		{
+			files.push_back(File_Entry{torrent_data.out_file, 0, torrent_data.length});
+		}
+
+		for (auto& file : files)
+		{
+			if (is_existing)
+			{
+				struct stat file_stat{};
+
+				file.fd = ::open(file.path.c_str(), O_RDONLY);
+				if (file.fd < 0 || fstat(file.fd, &file_stat) != 0 || file_stat.st_size < file.length)
+				{
+					std::cerr << "Missing or short file: " << file.path << std::endl;
+					close();
+					return -1;
+				}
+
+				continue;
+			}
+
+			auto parent_path = std::filesystem::path(file.path).parent_path();
+			if (!parent_path.empty())
+				std::filesystem::create_directories(parent_path);
+
+			file.fd = ::open(file.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (file.fd < 0 || ftruncate(file.fd, file.length) != 0)
+			{
+				std::cerr << "Failed to create file: " << file.path << std::endl;
+				close();
+				return -1;
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(have_mutex);
+		have_pieces.assign(piece_hashes_count, false);
+		completed_pieces.clear();
+
+		return 0;
+	}
+
+	void File_Storage::close()
+	{
+		for (auto& file : files)
+		{
+			if (file.fd >= 0)
+				::close(file.fd);
+		}
+
+		files.clear();
+	}
+
+	std::vector<File_Span> File_Storage::map_range(int64_t offset, int64_t length) const
+	{
+		std::vector<File_Span> spans;
+
+		for (const auto& file : files)
+		{
+			int64_t file_end = file.torrent_offset + file.length;
+
+			if (length <= 0)
+				break;
+
+			if (offset >= file_end || offset < file.torrent_offset || file.length == 0)
+				continue;
+
+			int64_t span_length = std::min(length, file_end - offset);
+			spans.push_back(File_Span{file.fd, offset - file.torrent_offset, span_length});
+
+			offset += span_length;
+			length -= span_length;
+		}
+
+		return spans;
+	}
+
+	std::vector<File_Span> File_Storage::map_pieces(int first_piece_index, int64_t length) const
+	{
+		return map_range(static_cast<int64_t>(first_piece_index) * piece_length, length);
+	}
+
+	void File_Storage::mark_pieces(int first_piece_index, int count)
+	{
+		std::unique_lock<std::mutex> lock(have_mutex);
+
+		for (int piece_index = first_piece_index; piece_index < first_piece_index + count; ++piece_index)
+		{
+			if (!have_pieces[piece_index])
+			{
+				have_pieces[piece_index] = true;
+				completed_pieces.push_back(piece_index);
+			}
+		}
+	}
+
+	int File_Storage::check_pieces(const Torrent::TorrentData& torrent_data)
+	{
+		std::string piece_data;
+		int verified_pieces = 0;
+
+		for (size_t piece_index = 0; piece_index < piece_hashes_count; ++piece_index)
+		{
+			int64_t offset = static_cast<int64_t>(piece_index) * piece_length;
+			int64_t length = std::min<int64_t>(piece_length, torrent_data.length - offset);
+
+			piece_data.resize(length);
+			size_t data_offset = 0;
+
+			for (const auto& span : map_range(offset, length))
+			{
+				if (pread(span.fd, piece_data.data() + data_offset, span.length, span.file_offset) != span.length)
+					break;
+
+				data_offset += span.length;
+			}
+
+			if (data_offset != piece_data.size() || Encoder::hash_to_hex(Encoder::SHA_string(piece_data)) != torrent_data.piece_hashes[piece_index])
+				continue;
+
+			std::unique_lock<std::mutex> lock(have_mutex);
+			have_pieces[piece_index] = true;
+			completed_pieces.push_back(piece_index);
+			++verified_pieces;
+		}
+
+		return verified_pieces;
+	}
+
+	std::vector<File_Span> File_Storage::map_block(int piece_index, int begin, int length) const
+	{
+		if (!has_piece(piece_index))
+			return {};
+
+		return map_range(static_cast<int64_t>(piece_index) * piece_length + begin, length);
+	}
+
+	bool File_Storage::has_piece(int piece_index) const
+	{
+		std::unique_lock<std::mutex> lock(have_mutex);
+		return piece_index >= 0 && static_cast<size_t>(piece_index) < have_pieces.size() && have_pieces[piece_index];
+	}
+
+	std::string File_Storage::bitfield() const
+	{
+		std::unique_lock<std::mutex> lock(have_mutex);
+		std::string bits((have_pieces.size() + 7) / 8, 0);
+
+		for (size_t piece_index = 0; piece_index < have_pieces.size(); ++piece_index)
+		{
+			if (have_pieces[piece_index])
+				bits[piece_index / 8] |= static_cast<char>(0x80 >> (piece_index % 8));
+		}
+
+		return bits;
+	}
+
+	std::vector<int> File_Storage::completed_since(size_t cursor) const
+	{
+		std::unique_lock<std::mutex> lock(have_mutex);
+
+		if (cursor >= completed_pieces.size())
+			return {};
+
+		return std::vector<int>(completed_pieces.begin() + cursor, completed_pieces.end());
+	}
+
+	void File_Storage::note_read(int piece_index)
+	{
+		std::unique_lock<std::mutex> lock(have_mutex);
+
+		if (!recent_reads.empty() && recent_reads.back() == piece_index)
+			return;
+
+		std::erase(recent_reads, piece_index);
+		recent_reads.push_back(piece_index);
+
+		if (recent_reads.size() > STORAGE_RECENT_READS)
+			recent_reads.pop_front();
+	}
+
+	std::vector<int> File_Storage::recently_read() const
+	{
+		std::unique_lock<std::mutex> lock(have_mutex);
+		return std::vector<int>(recent_reads.begin(), recent_reads.end());
+	}
+}
@@ -0,0 +1,90 @@
+
+#ifndef _STORAGE_H_
+#define _STORAGE_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <cstdint>
+
+#define STORAGE_RECENT_READS 8 // pieces remembered as recently uploaded
+
+namespace Torrent
+{
+	struct TorrentData;
+}
+
+namespace Storage
+{
+	// A file on disk holding the torrent bytes [torrent_offset, torrent_offset + length)
+	struct File_Entry
+	{
+		std::string path;
+		int64_t torrent_offset = 0;
+		int64_t length = 0;
+		int fd = -1;
+	};
+
+	// Part of a torrent byte range that lives in one file
+	struct File_Span
+	{
+		int fd = -1;
+		int64_t file_offset = 0;
+		int64_t length = 0;
+	};
+
+	// Verified pieces are written straight to their place in the output file(s), so that
+	// they can be served to other peers while the rest of the torrent is still downloading.
+	class File_Storage
+	{
+	public:
+		~File_Storage();
+
+		// piece_index >= 0 maps only that piece to out_file (download_piece), -1 maps the whole torrent.
+		// is_existing opens data that is already on disk (seeding) instead of creating empty files.
+		int open(const Torrent::TorrentData& torrent_data, int piece_index = -1, bool is_existing = false);
+
+		// Hash checks the data on disk and marks the pieces that match as verified, returns their count
+		int check_pieces(const Torrent::TorrentData& torrent_data);
+
+		void close();
+
+		// Where length bytes of consecutive pieces starting at first_piece_index go, the disk thread writes them there
+		std::vector<File_Span> map_pieces(int first_piece_index, int64_t length) const;
+
+		void mark_pieces(int first_piece_index, int count); // written, readable for uploads from now on
+
+		// Where a block of a verified piece lives on disk, empty if the piece isn't verified (uploads sendfile() from these)
+		std::vector<File_Span> map_block(int piece_index, int begin, int length) const;
+
+		std::vector<File_Span> map_range(int64_t offset, int64_t length) const;
+
+		bool has_piece(int piece_index) const;
+
+		int piece_count() const { return static_cast<int>(piece_hashes_count); }
+
+		std::string bitfield() const; // BITFIELD payload, high bit of the first byte is piece 0
+
+		// Indexes of the verified pieces in the order they completed, connections keep a cursor into it to send HAVEs
+		std::vector<int> completed_since(size_t cursor) const;
+
+		// Pieces uploads read from most recently (newest last), they are likely still in the page cache
+		void note_read(int piece_index);
+
+		std::vector<int> recently_read() const;
+
+	private:
+		std::vector<File_Entry> files;
+		int64_t piece_length = 0;
+		size_t piece_hashes_count = 0;
+
+		std::vector<bool> have_pieces;
+		std::vector<int> completed_pieces;
+		std::deque<int> recent_reads;
+		mutable std::mutex have_mutex;
+	};
+}
+
+#endif
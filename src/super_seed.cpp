@@ -0,0 +1,143 @@
+
+#include "super_seed.h"
+
+#include <random>
+
+namespace SuperSeed
+{
+	void Super_Seeder::enable(int piece_count)
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+
+		is_enabled_flag = true;
+		peer_counts.assign(piece_count, 0);
+		offer_counts.assign(piece_count, 0);
+	}
+
+	bool Super_Seeder::is_enabled() const
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+		return is_enabled_flag;
+	}
+
+	void Super_Seeder::add_connection(int connection_id)
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+		connections[connection_id].has_pieces.assign(peer_counts.size(), false);
+	}
+
+	void Super_Seeder::remove_connection(int connection_id)
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		if (connection_it == connections.end())
+			return;
+
+		for (size_t piece_index = 0; piece_index < peer_counts.size(); ++piece_index)
+		{
+			if (connection_it->second.has_pieces[piece_index])
+				--peer_counts[piece_index];
+		}
+
+		connections.erase(connection_it);
+	}
+
+	void Super_Seeder::mark_has(Connection_State& connection, int piece_index)
+	{
+		if (piece_index < 0 || static_cast<size_t>(piece_index) >= peer_counts.size() || connection.has_pieces[piece_index])
+			return;
+
+		connection.has_pieces[piece_index] = true;
+		++peer_counts[piece_index];
+	}
+
+	void Super_Seeder::on_have(int connection_id, int piece_index)
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		if (connection_it != connections.end())
+			mark_has(connection_it->second, piece_index);
+	}
+
+	void Super_Seeder::on_bitfield(int connection_id, const std::string& bitfield)
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		if (connection_it == connections.end())
+			return;
+
+		for (size_t piece_index = 0; piece_index < peer_counts.size() && piece_index / 8 < bitfield.size(); ++piece_index)
+		{
+			if (static_cast<uint8_t>(bitfield[piece_index / 8]) & (0x80 >> (piece_index % 8)))
+				mark_has(connection_it->second, piece_index);
+		}
+	}
+
+	int Super_Seeder::next_offer(int connection_id)
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		if (connection_it == connections.end())
+			return -1;
+
+		auto& connection = connection_it->second;
+
+		if (connection.pending_offer >= 0)
+		{
+			int piece_index = connection.pending_offer;
+			int other_peers = peer_counts[piece_index] - (connection.has_pieces[piece_index] ? 1 : 0);
+
+			// with nobody else around to pass the piece on to, the peer having it is as good as it gets
+			bool is_alone = connections.size() == 1 && connection.has_pieces[piece_index];
+
+			if (other_peers == 0 && !is_alone)
+				return -1;
+
+			connection.pending_offer = -1;
+		}
+
+		// the piece the fewest peers have (and we offered the least), among those this peer lacks
+		int best_piece = -1;
+		int best_score = 0;
+		int ties = 0;
+		static thread_local std::mt19937 rng(std::random_device{}());
+
+		for (size_t piece_index = 0; piece_index < peer_counts.size(); ++piece_index)
+		{
+			if (connection.has_pieces[piece_index] || connection.offered_pieces.contains(piece_index))
+				continue;
+
+			int score = peer_counts[piece_index] * 1024 + offer_counts[piece_index];
+
+			if (best_piece < 0 || score < best_score)
+			{
+				best_piece = piece_index;
+				best_score = score;
+				ties = 1;
+			}
+			else if (score == best_score && rng() % ++ties == 0)
+				best_piece = piece_index; // reservoir sampling, so that peers don't all start with piece 0
+		}
+
+		if (best_piece < 0)
+			return -1;
+
+		connection.pending_offer = best_piece;
+		connection.offered_pieces.insert(best_piece);
+		++offer_counts[best_piece];
+
+		return best_piece;
+	}
+
+	bool Super_Seeder::is_offered(int connection_id, int piece_index) const
+	{
+		std::unique_lock<std::mutex> lock(seeder_mutex);
+
+		auto connection_it = connections.find(connection_id);
+		return connection_it != connections.end() && connection_it->second.offered_pieces.contains(piece_index);
+	}
+}
@@ -0,0 +1,55 @@
+
+#ifndef _SUPER_SEED_H_
+#define _SUPER_SEED_H_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace SuperSeed
+{
+	// Super-seeding (BEP 16) for an initial seed: instead of a bitfield every peer is offered one piece at a time
+	// with HAVE, and the next piece is only revealed once the last one shows up at another peer. The seed's upload
+	// then goes to pieces nobody has yet and the peers spread them among themselves.
+	class Super_Seeder
+	{
+	public:
+		void enable(int piece_count);
+
+		bool is_enabled() const;
+
+		void add_connection(int connection_id);
+
+		void remove_connection(int connection_id);
+
+		// Next piece to announce to this peer, -1 while its previous offer hasn't spread yet
+		int next_offer(int connection_id);
+
+		void on_have(int connection_id, int piece_index);
+
+		void on_bitfield(int connection_id, const std::string& bitfield);
+
+		// Peers may only request pieces that were offered to them
+		bool is_offered(int connection_id, int piece_index) const;
+
+	private:
+		struct Connection_State
+		{
+			std::vector<bool> has_pieces;
+			std::unordered_set<int> offered_pieces;
+			int pending_offer = -1; // last piece offered, waiting to show up at another peer
+		};
+
+		void mark_has(Connection_State& connection, int piece_index); // needs seeder_mutex
+
+		bool is_enabled_flag = false;
+		std::vector<int> peer_counts;  // connected peers that have each piece
+		std::vector<int> offer_counts; // times each piece was offered
+		std::unordered_map<int, Connection_State> connections;
+		mutable std::mutex seeder_mutex;
+	};
+}
+
+#endif
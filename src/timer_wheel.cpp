@@ -0,0 +1,241 @@
+
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace Timer
+{
+	Wheel::Wheel()
+	{
+		for (auto& level : slots)
+			std::fill(std::begin(level), std::end(level), NIL);
+	}
+
+	Wheel::~Wheel()
+	{
+		stop();
+	}
+
+	void Wheel::start()
+	{
+		std::unique_lock<std::mutex> lock(wheel_mutex);
+
+		if (is_running)
+			return;
+
+		is_running = true;
+		wheel_thread = std::thread(&Wheel::timer_loop, this);
+	}
+
+	void Wheel::stop()
+	{
+		std::unique_lock<std::mutex> lock(wheel_mutex);
+
+		if (!is_running)
+			return;
+
+		is_running = false;
+		wheel_cv.notify_all();
+		lock.unlock();
+
+		wheel_thread.join();
+
+		lock.lock();
+		for (int32_t index = 0; index < static_cast<int32_t>(nodes.size()); ++index)
+		{
+			if (nodes[index].list_head)
+			{
+				unlink(index);
+				release(index);
+			}
+		}
+	}
+
+	Timer_Id Wheel::schedule(std::chrono::milliseconds delay, std::function<void()> callback)
+	{
+		std::unique_lock<std::mutex> lock(wheel_mutex);
+
+		int32_t index = 0;
+		if (free_nodes.empty())
+		{
+			index = nodes.size();
+			nodes.emplace_back();
+			nodes.back().generation = 1;
+		}
+		else
+		{
+			index = free_nodes.back();
+			free_nodes.pop_back();
+		}
+
+		// the current tick is partly over already, one more keeps a timer from ever firing before its delay
+		uint64_t ticks = std::max<int64_t>((delay.count() + TIMER_TICK_MS - 1) / TIMER_TICK_MS, 0) + 1;
+		uint64_t max_ticks = (uint64_t(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+		Node& node = nodes[index];
+		node.callback = std::move(callback);
+		node.expires_tick = current_tick + std::min(ticks, max_ticks);
+
+		link(index);
+		++pending;
+
+		return (uint64_t(node.generation) << 32) | static_cast<uint32_t>(index);
+	}
+
+	bool Wheel::cancel(Timer_Id timer_id)
+	{
+		std::unique_lock<std::mutex> lock(wheel_mutex);
+
+		auto index = static_cast<int32_t>(timer_id & 0xffffffff);
+		auto generation = static_cast<uint32_t>(timer_id >> 32);
+
+		if (timer_id == 0 || index >= static_cast<int32_t>(nodes.size()) || nodes[index].generation != generation)
+			return false;
+
+		if (nodes[index].list_head)
+		{
+			unlink(index);
+			release(index);
+			return true;
+		}
+
+		// firing, the node is released (and its generation bumped) once the callback returned
+		wheel_cv.wait(lock, [this, index, generation]() { return nodes[index].generation != generation; });
+		return false;
+	}
+
+	size_t Wheel::size() const
+	{
+		std::unique_lock<std::mutex> lock(wheel_mutex);
+		return pending;
+	}
+
+	void Wheel::link(int32_t index)
+	{
+		Node& node = nodes[index];
+		uint64_t delta = node.expires_tick > current_tick ? node.expires_tick - current_tick : 0;
+
+		// the coarsest level the expiry is still within range of, one slot there spans a full turn of the level below
+		int level = 0;
+		while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t(1) << (TIMER_WHEEL_BITS * (level + 1))))
+			++level;
+
+		uint64_t tick = std::max(node.expires_tick, current_tick);
+		int32_t& head = slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & (SLOTS - 1)];
+
+		node.prev = NIL;
+		node.next = head;
+		node.list_head = &head;
+
+		if (head != NIL)
+			nodes[head].prev = index;
+
+		head = index;
+	}
+
+	void Wheel::unlink(int32_t index)
+	{
+		Node& node = nodes[index];
+
+		if (node.prev != NIL)
+			nodes[node.prev].next = node.next;
+		else
+			*node.list_head = node.next;
+
+		if (node.next != NIL)
+			nodes[node.next].prev = node.prev;
+
+		node.prev = NIL;
+		node.next = NIL;
+		node.list_head = nullptr;
+	}
+
+	void Wheel::release(int32_t index)
+	{
+		Node& node = nodes[index];
+
+		node.callback = nullptr;
+		node.is_firing = false;
+		++node.generation;
+
+		free_nodes.push_back(index);
+		--pending;
+	}
+
+	void Wheel::cascade(int level)
+	{
+		int32_t& head = slots[level][(current_tick >> (TIMER_WHEEL_BITS * level)) & (SLOTS - 1)];
+
+		// every timer of this slot expires within the next turn of the level below, they move down from here
+		while (head != NIL)
+		{
+			int32_t index = head;
+			unlink(index);
+			link(index);
+		}
+	}
+
+	void Wheel::advance(std::vector<int32_t>& expired)
+	{
+		++current_tick;
+
+		for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+		{
+			if ((current_tick & ((uint64_t(1) << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+				break;
+
+			cascade(level);
+		}
+
+		int32_t& head = slots[0][current_tick & (SLOTS - 1)];
+
+		while (head != NIL)
+		{
+			int32_t index = head;
+			unlink(index);
+			nodes[index].is_firing = true;
+			expired.push_back(index);
+		}
+	}
+
+	void Wheel::timer_loop()
+	{
+		auto next_tick_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(TIMER_TICK_MS);
+		std::unique_lock<std::mutex> lock(wheel_mutex);
+
+		while (is_running)
+		{
+			wheel_cv.wait_until(lock, next_tick_at, [this]() { return !is_running; });
+
+			// catch up on every tick that passed, a late wake-up fires the timers late but never skips them
+			std::vector<int32_t> expired;
+			while (is_running && std::chrono::steady_clock::now() >= next_tick_at)
+			{
+				advance(expired);
+				next_tick_at += std::chrono::milliseconds(TIMER_TICK_MS);
+			}
+
+			for (int32_t index : expired)
+			{
+				// schedule() may grow the slab while the callback runs, it is moved out of the node first
+				std::function<void()> callback = std::move(nodes[index].callback);
+
+				lock.unlock();
+				callback();
+				lock.lock();
+
+				release(index);
+				wheel_cv.notify_all();
+			}
+		}
+	}
+
+	Wheel& shared_wheel()
+	{
+		static Wheel wheel;
+		static std::once_flag started;
+
+		std::call_once(started, []() { wheel.start(); });
+		return wheel;
+	}
+}
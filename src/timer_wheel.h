@@ -0,0 +1,87 @@
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8 // 256 slots per level: 2.56s, 11min, 46h and 497 days of range at 10ms ticks
+
+namespace Timer
+{
+	using Timer_Id = uint64_t; // 0 is never handed out, it can stand for "no timer"
+
+	// Hierarchical timer wheel (Varghese & Lauck) shared by all connections. A timer sits in the slot of the
+	// coarsest level its expiry fits into and cascades down a level each time the level below wraps around, so
+	// insert and cancel are O(1) and tens of thousands of pending timers cost no more per tick than a few.
+	// Timers live in a slab of nodes linked by index, ids carry a generation so a stale id cancels nothing.
+	// Callbacks run on the wheel's thread and have to be short, connections use them to flag work and wake up.
+	class Wheel
+	{
+	public:
+		Wheel();
+
+		~Wheel();
+
+		void start();
+
+		void stop(); // pending timers are dropped without firing
+
+		Timer_Id schedule(std::chrono::milliseconds delay, std::function<void()> callback);
+
+		// Returns false when the timer already fired. If its callback is running right now this waits for it
+		// to return, so whatever the callback touches can be released once cancel returned.
+		bool cancel(Timer_Id timer_id);
+
+		size_t size() const; // pending timers
+
+	private:
+		static constexpr int32_t NIL = -1;
+		static constexpr size_t SLOTS = size_t(1) << TIMER_WHEEL_BITS;
+
+		struct Node
+		{
+			std::function<void()> callback;
+			uint64_t expires_tick = 0;
+			uint32_t generation = 0;
+			int32_t prev = NIL;
+			int32_t next = NIL;
+			int32_t* list_head = nullptr; // the slot the node is linked into, nullptr while free or firing
+			bool is_firing = false;       // unlinked, its callback is about to run or running
+		};
+
+		void link(int32_t index);
+
+		void unlink(int32_t index);
+
+		void release(int32_t index);
+
+		void cascade(int level);
+
+		void advance(std::vector<int32_t>& expired);
+
+		void timer_loop();
+
+		std::vector<Node> nodes;
+		std::vector<int32_t> free_nodes;
+		int32_t slots[TIMER_WHEEL_LEVELS][SLOTS];
+		uint64_t current_tick = 0;
+		size_t pending = 0;
+
+		mutable std::mutex wheel_mutex;
+		std::condition_variable wheel_cv;
+		bool is_running = false;
+		std::thread wheel_thread;
+	};
+
+	Wheel& shared_wheel(); // started on first use
+}
+
+#endif
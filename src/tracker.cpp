@@ -0,0 +1,542 @@
+
+#include "tracker.h"
+#include "bencode_helper.h"
+#include "dht.h"
+#include "lsd.h"
+#include "lib/http/httplib.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <unordered_set>
+
+#define UDP_TRACKER_PROTOCOL_ID 0x41727101980LL
+
+namespace Tracker
+{
+	enum udp_action
+	{
+		CONNECT = 0,
+		ANNOUNCE,
+		SCRAPE,
+		ERROR
+	};
+
+	std::vector<std::string> get_announce_urls(const Torrent::TorrentData& torrent_data)
+	{
+		std::vector<std::string> urls;
+		std::unordered_set<std::string> seen_urls;
+		std::mt19937 rng(std::random_device{}());
+
+		auto tiers = torrent_data.announce_list;
+		if (tiers.empty() && !torrent_data.tracker.empty())
+			tiers.push_back({torrent_data.tracker});
+
+		for (auto& tier : tiers)
+		{
+			std::shuffle(tier.begin(), tier.end(), rng); // BEP 12: trackers within a tier are tried in random order
+
+			for (auto& url : tier)
+			{
+				if (!url.empty() && seen_urls.insert(url).second)
+					urls.push_back(url);
+			}
+		}
+
+		return urls;
+	}
+
+	Announce_Params get_announce_params(const Torrent::TorrentData& torrent_data, const std::string& event)
+	{
+		Announce_Params params;
+
+		params.info_hash = torrent_data.info_hash;
+		params.uploaded = torrent_data.uploaded;
+		params.downloaded = torrent_data.downloaded;
+		params.left = torrent_data.length > 0 ? torrent_data.length - torrent_data.verified : 999; // magnet links don't know the length yet
+		params.event = event;
+
+		return params;
+	}
+
+	Announce_Response announce(const std::string& tracker, const Announce_Params& params, std::chrono::milliseconds timeout)
+	{
+		if (tracker.starts_with("udp://"))
+			return udp_announce(tracker, params, timeout);
+
+		return http_announce(tracker, params, timeout);
+	}
+
+	Announce_Response http_announce(const std::string& tracker, const Announce_Params& announce_params, std::chrono::milliseconds timeout)
+	{
+		Announce_Response response;
+
+		httplib::Params params{
+			{"peer_id", PEER_ID},
+			{"port", std::to_string(TORRENT_LISTEN_PORT)},
+			{"uploaded", std::to_string(announce_params.uploaded)},
+			{"downloaded", std::to_string(announce_params.downloaded)},
+			{"left", std::to_string(announce_params.left)},
+			{"compact", "1"}
+		};
+
+		if (!announce_params.event.empty())
+			params.emplace("event", announce_params.event);
+
+		auto domain_and_endpoint = Network::split_domain_and_endpoint(tracker);
+		httplib::Headers headers{};
+
+		auto encoded_info_hash = Encoder::encode_info_hash(Encoder::hash_to_hex(announce_params.info_hash));
+		auto endpoint = std::get<1>(domain_and_endpoint);
+		endpoint += (endpoint.find('?') == std::string::npos ? "?" : "&");
+
+		httplib::Client client(std::get<0>(domain_and_endpoint));
+		client.set_connection_timeout(timeout);
+		client.set_read_timeout(timeout);
+		client.set_follow_location(true);
+
+		// By moving the info hash here we can avoid the url encoding of the query parameter.
+		auto resp = client.Get(endpoint + "info_hash=" + encoded_info_hash, params, headers);
+
+		if (!resp)
+		{
+			response.failure_reason = "Failed to connect to tracker";
+			return response;
+		}
+
+		auto resp_json = Decoder::decode_bencoded_value(resp->body);
+
+		if (!resp_json.is_object())
+		{
+			response.failure_reason = "Invalid tracker response";
+			return response;
+		}
+
+		if (resp_json.contains("failure reason") && !resp_json["failure reason"].empty())
+		{
+			response.failure_reason = resp_json["failure reason"].is_string() ? resp_json["failure reason"].get<std::string>() : "Invalid failure reason";
+			return response;
+		}
+
+		if (resp_json.contains("interval") && resp_json["interval"].is_number_integer())
+			response.interval = resp_json["interval"].get<int>();
+
+		if (resp_json.contains("min interval") && resp_json["min interval"].is_number_integer())
+			response.min_interval = resp_json["min interval"].get<int>();
+
+		if (resp_json.contains("peers") && resp_json["peers"].is_string())
+		{
+			response.peers = Network::process_peers_str(resp_json["peers"].get<std::string>());
+		}
+		else if (resp_json.contains("peers") && resp_json["peers"].is_array())
+		{
+			// non-compact form: list of {"ip", "port"} dictionaries
+			for (const auto& peer_dict : resp_json["peers"])
+			{
+				if (!peer_dict.is_object() || !peer_dict.contains("ip") || !peer_dict.contains("port"))
+					continue;
+
+				// an entry of the wrong types would throw out of the announce thread, it is skipped like a missing one
+				if (!peer_dict["ip"].is_string() || !peer_dict["port"].is_number_integer())
+					continue;
+
+				int64_t port = peer_dict["port"].get<int64_t>();
+				if (port <= 0 || port > 65535)
+					continue;
+
+				auto ip = peer_dict["ip"].get<std::string>();
+				if (ip.find(':') != std::string::npos)
+					ip = "[" + ip + "]";
+
+				Network::Peer_Address address;
+				if (Network::Peer_Address::from_string(ip + ":" + std::to_string(port), address))
+					response.peers.emplace_back(address);
+			}
+		}
+
+		// BEP 7: IPv6 peers in compact form
+		if (resp_json.contains("peers6") && resp_json["peers6"].is_string())
+		{
+			auto peers6 = Network::process_peers_str(resp_json["peers6"].get<std::string>(), AF_INET6);
+			response.peers.insert(response.peers.end(), peers6.begin(), peers6.end());
+		}
+
+		response.success = true;
+		return response;
+	}
+
+	static void append_uint64(std::string& buffer, uint64_t value)
+	{
+		for (int shift = 56; shift >= 0; shift -= 8)
+			buffer.push_back(static_cast<char>(value >> shift & 0xFF));
+	}
+
+	static void append_uint32(std::string& buffer, uint32_t value)
+	{
+		auto bytes = Encoder::uint32_to_uint8(value);
+		buffer.append(bytes.begin(), bytes.end());
+	}
+
+	static uint32_t read_uint32(const std::string& buffer, size_t offset)
+	{
+		return Encoder::uint8_to_uint32(buffer[offset], buffer[offset + 1], buffer[offset + 2], buffer[offset + 3]);
+	}
+
+	static int udp_transact(int udp_socket, const std::string& request, std::string& response, size_t min_len)
+	{
+		if (send(udp_socket, request.data(), request.size(), 0) < 0)
+			return -1;
+
+		response.assign(2048, 0);
+		auto bytes_read = recv(udp_socket, response.data(), response.size(), 0);
+
+		if (bytes_read < 8)
+			return -1;
+
+		response.resize(bytes_read);
+
+		// transaction id (offset 12 in both connect and announce requests) has to match, the action is checked by the caller
+		if (response.compare(4, 4, request, 12, 4) != 0)
+			return -1;
+
+		if (read_uint32(response, 0) == udp_action::ERROR || response.size() < min_len)
+			return -1;
+
+		return 0;
+	}
+
+	Announce_Response udp_announce(const std::string& tracker, const Announce_Params& params, std::chrono::milliseconds timeout)
+	{
+		Announce_Response response;
+
+		// udp://host:port[/announce]
+		auto host_port = tracker.substr(std::string("udp://").size());
+		host_port = host_port.substr(0, host_port.find('/'));
+		auto colon_index = host_port.rfind(':');
+
+		if (colon_index == std::string::npos)
+		{
+			response.failure_reason = "Missing port in udp tracker url";
+			return response;
+		}
+
+		auto host = host_port.substr(0, colon_index);
+		auto port = host_port.substr(colon_index + 1);
+
+		if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		addrinfo* addr_result = nullptr;
+
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addr_result) != 0 || addr_result == nullptr)
+		{
+			response.failure_reason = "Failed to resolve udp tracker";
+			return response;
+		}
+
+		int udp_socket = socket(addr_result->ai_family, addr_result->ai_socktype, addr_result->ai_protocol);
+		if (udp_socket < 0 || connect(udp_socket, addr_result->ai_addr, addr_result->ai_addrlen) < 0)
+		{
+			freeaddrinfo(addr_result);
+			if (udp_socket >= 0)
+				close(udp_socket);
+
+			response.failure_reason = "Failed to connect to udp tracker";
+			return response;
+		}
+		int tracker_family = addr_result->ai_family;
+		freeaddrinfo(addr_result);
+
+		auto timeout_us = std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+		timeval tv{static_cast<time_t>(timeout_us / 1000000), static_cast<suseconds_t>(timeout_us % 1000000)};
+		setsockopt(udp_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		std::mt19937 rng(std::random_device{}());
+
+		// BEP 15: obtain a connection id first
+		std::string connect_req;
+		append_uint64(connect_req, UDP_TRACKER_PROTOCOL_ID);
+		append_uint32(connect_req, udp_action::CONNECT);
+		append_uint32(connect_req, rng());
+
+		std::string connect_resp;
+		if (udp_transact(udp_socket, connect_req, connect_resp, 16) != 0 || read_uint32(connect_resp, 0) != udp_action::CONNECT)
+		{
+			close(udp_socket);
+			response.failure_reason = "No connect response from udp tracker";
+			return response;
+		}
+
+		std::string announce_req = connect_resp.substr(8, 8); // connection id
+		append_uint32(announce_req, udp_action::ANNOUNCE);
+		append_uint32(announce_req, rng());
+		announce_req.append(params.info_hash);
+		announce_req.append(PEER_ID);
+		append_uint64(announce_req, params.downloaded);
+		append_uint64(announce_req, params.left);
+		append_uint64(announce_req, params.uploaded);
+		append_uint32(announce_req, params.event == "completed" ? 1 : params.event == "started" ? 2 : params.event == "stopped" ? 3 : 0);
+		append_uint32(announce_req, 0);    // ip address
+		append_uint32(announce_req, rng()); // key
+		append_uint32(announce_req, static_cast<uint32_t>(-1)); // num_want
+		announce_req.push_back(static_cast<char>(TORRENT_LISTEN_PORT >> 8));
+		announce_req.push_back(static_cast<char>(TORRENT_LISTEN_PORT & 0xFF));
+
+		std::string announce_resp;
+		if (udp_transact(udp_socket, announce_req, announce_resp, 20) != 0 || read_uint32(announce_resp, 0) != udp_action::ANNOUNCE)
+		{
+			close(udp_socket);
+			response.failure_reason = "No announce response from udp tracker";
+			return response;
+		}
+		close(udp_socket);
+
+		response.interval = read_uint32(announce_resp, 8);
+		// BEP 15: trackers reached over IPv6 answer with 18 byte IPv6 entries
+		response.peers = Network::process_peers_str(std::string_view(announce_resp).substr(20), tracker_family);
+		response.success = true;
+
+		return response;
+	}
+
+	Announcer::~Announcer()
+	{
+		stop();
+	}
+
+	int Announcer::announce_to_all(Torrent::TorrentData& torrent_data, std::chrono::milliseconds timeout)
+	{
+		auto urls = get_announce_urls(torrent_data);
+
+		if (torrent_data.lsd)
+		{
+			lsd = torrent_data.lsd;
+			lsd_info_hash = torrent_data.info_hash;
+			lsd->add_torrent(lsd_info_hash, &torrent_data.peers, TORRENT_LISTEN_PORT);
+		}
+
+		if (urls.empty() && !torrent_data.dht)
+		{
+			std::cerr << "Warning: No tracker, skipping peer discovery" << std::endl;
+			return -1;
+		}
+
+		std::unique_lock<std::mutex> lock(announce_mutex);
+		pending_announces += urls.size();
+
+		for (const auto& url : urls)
+			announce_threads.emplace_back(&Announcer::tracker_loop, this, &torrent_data, url, timeout);
+
+		if (torrent_data.dht)
+		{
+			++pending_announces;
+			announce_threads.emplace_back(&Announcer::dht_loop, this, &torrent_data);
+		}
+
+		announce_cv.wait(lock, [this]() { return received_peers || pending_announces == 0; });
+
+		return received_peers ? 0 : -1;
+	}
+
+	void Announcer::tracker_loop(Torrent::TorrentData* torrent_data, std::string url, std::chrono::milliseconds timeout)
+	{
+		std::string event = "started";
+		bool is_first_announce = true;
+		bool is_started = false;
+		bool sent_completed = false;
+		bool is_final_announce = false;
+		int failures = 0;
+		uint64_t seen_peer_requests = 0;
+
+		while (true)
+		{
+			Announce_Response response;
+
+			// a tracker is untrusted input, whatever its response throws is one failed announce and not the end of the process
+			try
+			{
+				response = announce(url, get_announce_params(*torrent_data, event), timeout);
+			}
+			catch (const std::exception& e)
+			{
+				response = Announce_Response();
+				response.failure_reason = std::string("Invalid tracker response: ") + e.what();
+			}
+			catch (...)
+			{
+				response = Announce_Response();
+				response.failure_reason = "Invalid tracker response";
+			}
+
+			auto last_announce = std::chrono::steady_clock::now();
+
+			std::chrono::seconds interval(DEFAULT_ANNOUNCE_INTERVAL_SEC);
+			std::chrono::seconds min_interval(DEFAULT_MIN_ANNOUNCE_INTERVAL_SEC);
+
+			if (response.success)
+			{
+				int added = torrent_data->peers.add_peers(response.peers);
+				std::cout << "Tracker " << url << " returned " << response.peers.size() << " peer(s), " << added << " new\n";
+
+				is_started = true;
+				sent_completed = sent_completed || event == "completed";
+				event.clear();
+				failures = 0;
+
+				if (response.interval > 0)
+					interval = std::chrono::seconds(response.interval);
+				if (response.min_interval > 0)
+					min_interval = std::chrono::seconds(response.min_interval);
+			}
+			else
+			{
+				std::cerr << "Tracker request to " << url << " failed with err: " << response.failure_reason << std::endl;
+
+				// back off 15s, 30s, 60s ... up to the default interval, a failed started/completed event is retried
+				interval = std::min(std::chrono::seconds(15 << std::min(failures, 7)), interval);
+				min_interval = interval;
+				++failures;
+			}
+
+			std::unique_lock<std::mutex> lock(announce_mutex);
+
+			if (is_first_announce)
+			{
+				is_first_announce = false;
+				--pending_announces;
+				received_peers = received_peers || !response.peers.empty();
+				announce_cv.notify_all();
+			}
+
+			while (true)
+			{
+				// checked before is_stopping so that a finished download still reports completed on shutdown
+				if (is_completed && !sent_completed && is_started && event.empty())
+				{
+					event = "completed";
+					break;
+				}
+
+				if (is_stopping)
+					break;
+
+				auto next_announce = last_announce + interval;
+				if (peer_requests != seen_peer_requests)
+					next_announce = std::min(next_announce, last_announce + min_interval);
+
+				if (std::chrono::steady_clock::now() >= next_announce)
+					break;
+
+				announce_cv.wait_until(lock, next_announce);
+			}
+
+			seen_peer_requests = peer_requests;
+
+			if (is_stopping)
+			{
+				// one last try at an owed completed event, then on to stopped even if it failed
+				if (event != "completed" || is_final_announce)
+					break;
+
+				is_final_announce = true;
+			}
+		}
+
+		if (is_started)
+		{
+			// bounded so that shutdown isn't held up by a dead tracker
+			announce(url, get_announce_params(*torrent_data, "stopped"), std::min(timeout, std::chrono::milliseconds(2000)));
+		}
+	}
+
+	void Announcer::dht_loop(Torrent::TorrentData* torrent_data)
+	{
+		bool is_first_lookup = true;
+		uint64_t seen_peer_requests = 0;
+
+		while (true)
+		{
+			auto peers = torrent_data->dht->get_peers(torrent_data->info_hash, TORRENT_LISTEN_PORT);
+			auto last_lookup = std::chrono::steady_clock::now();
+
+			int added = torrent_data->peers.add_peers(peers);
+			std::cout << "DHT returned " << peers.size() << " peer(s), " << added << " new\n";
+
+			std::unique_lock<std::mutex> lock(announce_mutex);
+
+			if (is_first_lookup)
+			{
+				is_first_lookup = false;
+				--pending_announces;
+				received_peers = received_peers || !peers.empty();
+				announce_cv.notify_all();
+			}
+
+			// same cadence rules as a tracker: a fixed interval, brought forward when the downloader runs out of peers
+			while (!is_stopping)
+			{
+				auto next_lookup = last_lookup + std::chrono::seconds(DHT_ANNOUNCE_INTERVAL_SEC);
+				if (peer_requests != seen_peer_requests)
+					next_lookup = std::min(next_lookup, last_lookup + std::chrono::seconds(DEFAULT_MIN_ANNOUNCE_INTERVAL_SEC));
+
+				if (std::chrono::steady_clock::now() >= next_lookup)
+					break;
+
+				announce_cv.wait_until(lock, next_lookup);
+			}
+
+			seen_peer_requests = peer_requests;
+
+			if (is_stopping)
+				break;
+		}
+	}
+
+	void Announcer::wait_for_announces()
+	{
+		std::unique_lock<std::mutex> lock(announce_mutex);
+		announce_cv.wait(lock, [this]() { return pending_announces == 0; });
+	}
+
+	void Announcer::announce_completed()
+	{
+		std::unique_lock<std::mutex> lock(announce_mutex);
+		is_completed = true;
+		announce_cv.notify_all();
+	}
+
+	void Announcer::request_peers()
+	{
+		std::unique_lock<std::mutex> lock(announce_mutex);
+		++peer_requests;
+		announce_cv.notify_all();
+	}
+
+	void Announcer::stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(announce_mutex);
+			is_stopping = true;
+			announce_cv.notify_all();
+		}
+
+		for (auto& thread : announce_threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+
+		announce_threads.clear();
+
+		if (lsd)
+		{
+			lsd->remove_torrent(lsd_info_hash);
+			lsd.reset();
+		}
+	}
+}
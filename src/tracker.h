@@ -0,0 +1,100 @@
+
+#ifndef _TRACKER_H_
+#define _TRACKER_H_
+
+#include "network_helper.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#define TRACKER_TIMEOUT_MS 10000
+#define DEFAULT_ANNOUNCE_INTERVAL_SEC 1800
+#define DEFAULT_MIN_ANNOUNCE_INTERVAL_SEC 60
+#define DHT_ANNOUNCE_INTERVAL_SEC 900
+
+namespace Torrent
+{
+	struct TorrentData;
+}
+
+namespace LSD
+{
+	class Service;
+}
+
+namespace Tracker
+{
+	struct Announce_Params
+	{
+		std::string info_hash;
+		int64_t uploaded = 0;
+		int64_t downloaded = 0;
+		int64_t left = 0;
+		std::string event; // "started", "completed", "stopped" or empty for regular announces
+	};
+
+	struct Announce_Response
+	{
+		bool success = false;
+		int interval = 0;
+		int min_interval = 0;
+		std::vector<Network::Peer> peers;
+		std::string failure_reason;
+	};
+
+	// Flattens the BEP 12 tiers (shuffled within each tier) into a list of unique announce urls
+	std::vector<std::string> get_announce_urls(const Torrent::TorrentData& torrent_data);
+
+	Announce_Params get_announce_params(const Torrent::TorrentData& torrent_data, const std::string& event);
+
+	Announce_Response announce(const std::string& tracker, const Announce_Params& params, std::chrono::milliseconds timeout);
+
+	Announce_Response http_announce(const std::string& tracker, const Announce_Params& params, std::chrono::milliseconds timeout);
+
+	Announce_Response udp_announce(const std::string& tracker, const Announce_Params& params, std::chrono::milliseconds timeout);
+
+	// Announces to every tracker of a torrent (and the DHT and LSD, when enabled) concurrently and merges the returned peers
+	// into torrent_data.peers. Each tracker then keeps being re-announced in the background at the interval it asked for.
+	class Announcer
+	{
+	public:
+		~Announcer(); // sends event=stopped to every tracker that saw event=started
+
+		// Returns as soon as one tracker answered with peers (or all of them failed),
+		// the remaining trackers keep merging their peers in the background.
+		int announce_to_all(Torrent::TorrentData& torrent_data, std::chrono::milliseconds timeout);
+
+		// Blocks until every tracker answered (or failed) its first announce
+		void wait_for_announces();
+
+		void announce_completed();
+
+		// Asks for an early re-announce because we ran out of usable peers, 'min interval' is still honoured
+		void request_peers();
+
+		void stop();
+
+	private:
+		void tracker_loop(Torrent::TorrentData* torrent_data, std::string url, std::chrono::milliseconds timeout);
+
+		void dht_loop(Torrent::TorrentData* torrent_data);
+
+		std::vector<std::thread> announce_threads;
+		std::mutex announce_mutex;
+		std::condition_variable announce_cv;
+		int pending_announces = 0;
+		bool received_peers = false;
+		bool is_completed = false;
+		bool is_stopping = false;
+		uint64_t peer_requests = 0;
+
+		// LSD runs its own announce loop, we only (un)register the torrent with it
+		std::shared_ptr<LSD::Service> lsd;
+		std::string lsd_info_hash;
+	};
+}
+
+#endif
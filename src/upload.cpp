@@ -0,0 +1,547 @@
+
+#include "upload.h"
+#include "bencode_helper.h"
+#include "downloader.h"
+#include "listener.h"
+
+#include <algorithm>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <thread>
+#include <unordered_set>
+
+#define UPLOAD_POLL_INTERVAL_MS 500 // how quickly freshly verified pieces are announced
+#define UPLOAD_MAX_BATCH 32          // requests answered together under one TCP_CORK
+
+namespace Upload
+{
+	int send_haves(const Torrent::TorrentData& torrent_data, Network::Peer& peer)
+	{
+		auto completed_pieces = torrent_data.storage.completed_since(peer.have_cursor);
+		if (completed_pieces.empty())
+			return 0;
+
+		std::vector<Network::Peer_Msg> peer_msgs;
+
+		for (auto piece_index : completed_pieces)
+		{
+			auto index_bytes = Encoder::uint32_to_uint8(piece_index);
+
+			Network::Peer_Msg peer_msg;
+			peer_msg.msg_type = Downloader::message_type::HAVE;
+			peer_msg.payload.insert(peer_msg.payload.end(), index_bytes.begin(), index_bytes.end());
+			peer_msgs.push_back(peer_msg);
+		}
+
+		peer.have_cursor += completed_pieces.size();
+		return Network::send_peer_msgs(peer.peer_socket, peer_msgs);
+	}
+
+	int send_bitfield(const Torrent::TorrentData& torrent_data, Network::Peer& peer)
+	{
+		peer.have_cursor = torrent_data.storage.completed_since(0).size();
+
+		Network::Peer_Msg peer_msg;
+		peer_msg.msg_type = Downloader::message_type::BITFIELD;
+
+		if (peer.supports_fast_extension && peer.have_cursor == 0)
+			peer_msg.msg_type = Downloader::message_type::HAVE_NONE;
+		else if (peer.supports_fast_extension && peer.have_cursor == static_cast<size_t>(torrent_data.storage.piece_count()))
+			peer_msg.msg_type = Downloader::message_type::HAVE_ALL;
+		else if (peer.have_cursor > 0)
+			peer_msg.payload = torrent_data.storage.bitfield();
+		else
+			return 0; // the bitfield is optional while we have nothing yet, the HAVEs sent later cover those pieces
+
+		std::vector<Network::Peer_Msg> peer_msgs{peer_msg};
+		return Network::send_peer_msgs(peer.peer_socket, peer_msgs);
+	}
+
+	struct Block_Request
+	{
+		uint32_t piece_index = 0;
+		uint32_t begin = 0;
+		uint32_t length = 0;
+	};
+
+	static int parse_request(const Torrent::TorrentData& torrent_data, const Network::Peer& peer, const Network::Peer_Msg& peer_msg, Block_Request& request)
+	{
+		if (peer_msg.payload.size() != 12)
+			return -1;
+
+		request.piece_index = Encoder::uint8_to_uint32(peer_msg.payload[0], peer_msg.payload[1], peer_msg.payload[2], peer_msg.payload[3]);
+		request.begin = Encoder::uint8_to_uint32(peer_msg.payload[4], peer_msg.payload[5], peer_msg.payload[6], peer_msg.payload[7]);
+		request.length = Encoder::uint8_to_uint32(peer_msg.payload[8], peer_msg.payload[9], peer_msg.payload[10], peer_msg.payload[11]);
+
+		// the last piece is usually shorter than piece_length
+		int64_t piece_offset = static_cast<int64_t>(request.piece_index) * torrent_data.piece_length;
+		int64_t piece_size = std::min<int64_t>(torrent_data.piece_length, torrent_data.length - piece_offset);
+
+		if (request.length == 0 || request.length > UPLOAD_MAX_BLOCK_SIZE || static_cast<int64_t>(request.begin) + request.length > piece_size)
+		{
+			std::cerr << "Invalid request from peer " << peer.value() << std::endl;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	static int send_all(int peer_socket, const char* data, size_t len, int flags)
+	{
+		while (len > 0)
+		{
+			auto sent = send(peer_socket, data, len, flags | MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				return -1;
+
+			data += sent;
+			len -= sent;
+		}
+
+		return 0;
+	}
+
+	static int sendfile_all(int peer_socket, const Storage::File_Span& span)
+	{
+		off_t file_offset = span.file_offset;
+		int64_t remaining = span.length;
+
+		while (remaining > 0)
+		{
+			auto sent = sendfile(peer_socket, span.fd, &file_offset, remaining);
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				return -1;
+
+			remaining -= sent;
+		}
+
+		return 0;
+	}
+
+	// PIECE responses go out without copying the block through user space: the 13 byte header with MSG_MORE,
+	// then the block with sendfile() from the output file. TCP_CORK packs a batch into full segments.
+	static int send_blocks(Torrent::TorrentData& torrent_data, Network::Peer& peer, int choker_id, const std::vector<Block_Request>& requests)
+	{
+		// adjacent requests are read ahead as one range, most peers ask for consecutive blocks of a piece
+		for (size_t first = 0; first < requests.size();)
+		{
+			size_t last = first;
+			while (last + 1 < requests.size() && requests[last + 1].piece_index == requests[first].piece_index
+				   && requests[last + 1].begin == requests[last].begin + requests[last].length)
+				++last;
+
+			uint32_t range_len = requests[last].begin + requests[last].length - requests[first].begin;
+			for (const auto& span : torrent_data.storage.map_block(requests[first].piece_index, requests[first].begin, range_len))
+				posix_fadvise(span.fd, span.file_offset, span.length, POSIX_FADV_WILLNEED);
+
+			first = last + 1;
+		}
+
+		int enable = 1, disable = 0;
+		setsockopt(peer.peer_socket, IPPROTO_TCP, TCP_CORK, &enable, sizeof(enable));
+
+		int result = 0;
+
+		for (const auto& request : requests)
+		{
+			auto spans = torrent_data.storage.map_block(request.piece_index, request.begin, request.length);
+			if (spans.empty())
+			{
+				std::cerr << "Peer " << peer.value() << " requested piece " << request.piece_index << " which we don't have" << std::endl;
+				result = -1;
+				break;
+			}
+
+			std::string header;
+			auto len_bytes = Encoder::uint32_to_uint8(9 + request.length);
+			auto index_bytes = Encoder::uint32_to_uint8(request.piece_index);
+			auto begin_bytes = Encoder::uint32_to_uint8(request.begin);
+
+			header.insert(header.end(), len_bytes.begin(), len_bytes.end());
+			header.push_back(Downloader::message_type::PIECE);
+			header.insert(header.end(), index_bytes.begin(), index_bytes.end());
+			header.insert(header.end(), begin_bytes.begin(), begin_bytes.end());
+
+			if (send_all(peer.peer_socket, header.data(), header.size(), MSG_MORE) != 0)
+			{
+				result = -1;
+				break;
+			}
+
+			for (const auto& span : spans)
+			{
+				if (sendfile_all(peer.peer_socket, span) != 0)
+				{
+					result = -1;
+					break;
+				}
+			}
+
+			if (result != 0)
+				break;
+
+			torrent_data.uploaded += request.length;
+			torrent_data.choker.record_upload(choker_id, request.length);
+			torrent_data.storage.note_read(request.piece_index);
+		}
+
+		setsockopt(peer.peer_socket, IPPROTO_TCP, TCP_CORK, &disable, sizeof(disable));
+		return result;
+	}
+
+	// Sends CHOKE / UNCHOKE when the choker changed its mind about this peer
+	static int sync_choke_state(Torrent::TorrentData& torrent_data, Network::Peer& peer, int choker_id)
+	{
+		bool should_choke = torrent_data.choker.is_choked(choker_id);
+		if (should_choke == peer.am_choking)
+			return 0;
+
+		peer.am_choking = should_choke;
+
+		Network::Peer_Msg choke_msg;
+		choke_msg.msg_type = peer.am_choking ? Downloader::message_type::CHOKE : Downloader::message_type::UNCHOKE;
+
+		std::vector<Network::Peer_Msg> choke_msgs{choke_msg};
+		return Network::send_peer_msgs(peer.peer_socket, choke_msgs);
+	}
+
+	// HAVE, SUGGEST_PIECE and ALLOWED_FAST only carry a piece index
+	static int send_index_msg(Network::Peer& peer, uint8_t msg_type, int piece_index)
+	{
+		auto index_bytes = Encoder::uint32_to_uint8(piece_index);
+
+		Network::Peer_Msg peer_msg;
+		peer_msg.msg_type = msg_type;
+		peer_msg.payload.insert(peer_msg.payload.end(), index_bytes.begin(), index_bytes.end());
+
+		std::vector<Network::Peer_Msg> peer_msgs{peer_msg};
+		return Network::send_peer_msgs(peer.peer_socket, peer_msgs);
+	}
+
+	static int send_rejects(Network::Peer& peer, const std::vector<Block_Request>& rejects)
+	{
+		std::vector<Network::Peer_Msg> peer_msgs;
+
+		for (const auto& request : rejects)
+		{
+			Network::Peer_Msg peer_msg;
+			peer_msg.msg_type = Downloader::message_type::REJECT_REQUEST;
+
+			for (auto value : {request.piece_index, request.begin, request.length})
+			{
+				auto value_bytes = Encoder::uint32_to_uint8(value);
+				peer_msg.payload.insert(peer_msg.payload.end(), value_bytes.begin(), value_bytes.end());
+			}
+
+			peer_msgs.push_back(peer_msg);
+		}
+
+		return Network::send_peer_msgs(peer.peer_socket, peer_msgs);
+	}
+
+	// The canonical BEP 6 set, derived from the peer's /24 and the info hash so that reconnecting doesn't earn new pieces
+	static std::unordered_set<int> allowed_fast_set(const Torrent::TorrentData& torrent_data, const Network::Peer& peer)
+	{
+		std::unordered_set<int> allowed_fast;
+		size_t piece_count = torrent_data.storage.piece_count();
+		std::string compact = peer.address.to_compact();
+		std::string ip;
+
+		// only defined for IPv4, the listener already turned v4-mapped addresses into plain ones
+		if (peer.address.family() == AF_INET)
+			ip = compact.substr(0, 4);
+
+		if (ip.empty() || piece_count == 0)
+			return allowed_fast;
+
+		std::string hash = ip.substr(0, 3) + '\0' + torrent_data.info_hash;
+		size_t count = std::min<size_t>(UPLOAD_ALLOWED_FAST_COUNT, piece_count);
+
+		while (allowed_fast.size() < count)
+		{
+			hash = Encoder::SHA_string(hash);
+
+			for (size_t offset = 0; offset + 4 <= hash.size() && allowed_fast.size() < count; offset += 4)
+				allowed_fast.insert(Encoder::uint8_to_uint32(hash[offset], hash[offset + 1], hash[offset + 2], hash[offset + 3]) % piece_count);
+		}
+
+		return allowed_fast;
+	}
+
+	// What we tell the peer we have: every verified piece, or while super-seeding one offered piece at a time
+	static int send_availability(Torrent::TorrentData& torrent_data, Network::Peer& peer, int connection_id)
+	{
+		if (!torrent_data.super_seeder.is_enabled())
+			return send_haves(torrent_data, peer);
+
+		int piece_index = torrent_data.super_seeder.next_offer(connection_id);
+		return piece_index < 0 ? 0 : send_index_msg(peer, Downloader::message_type::HAVE, piece_index);
+	}
+
+	// Answers the requests of the peer until it goes idle or the connection fails
+	static void serve_requests(Torrent::TorrentData& torrent_data, Network::Peer& peer, int choker_id, const std::unordered_set<int>& allowed_fast)
+	{
+		bool is_super_seeding = torrent_data.super_seeder.is_enabled();
+		RateLimit::Token_Bucket upload_bucket(&torrent_data.upload_bucket, &torrent_data.peer_upload_limit);
+
+		auto last_activity = std::chrono::steady_clock::now();
+		std::vector<Block_Request> requests;
+		std::vector<Block_Request> rejects;
+		std::unordered_set<int> suggested;
+
+		while (true)
+		{
+			if (send_availability(torrent_data, peer, choker_id) != 0 || sync_choke_state(torrent_data, peer, choker_id) != 0)
+				break;
+
+			// pieces other peers just downloaded from us are still in the page cache, so they are the cheapest to serve next
+			if (peer.supports_fast_extension && !is_super_seeding && peer.peer_interested)
+			{
+				bool is_failed = false;
+
+				for (auto piece_index : torrent_data.storage.recently_read())
+				{
+					if (peer.has_piece(piece_index) || !suggested.insert(piece_index).second)
+						continue;
+
+					if (send_index_msg(peer, Downloader::message_type::SUGGEST_PIECE, piece_index) != 0)
+					{
+						is_failed = true;
+						break;
+					}
+				}
+
+				if (is_failed)
+					break;
+			}
+
+			// requests the upload limit held back go out as soon as it allows, not with the next msg of the peer
+			int poll_timeout = UPLOAD_POLL_INTERVAL_MS;
+			if (!requests.empty())
+				poll_timeout = std::min<int64_t>(upload_bucket.delay().count(), UPLOAD_POLL_INTERVAL_MS);
+
+			pollfd poll_fd{peer.peer_socket, POLLIN, 0};
+			int ready = poll(&poll_fd, 1, poll_timeout);
+
+			if (ready < 0)
+				break;
+
+			if (ready == 0 && requests.empty())
+			{
+				if (std::chrono::steady_clock::now() - last_activity > std::chrono::seconds(UPLOAD_IDLE_TIMEOUT_SEC))
+					break;
+
+				continue;
+			}
+
+			// read everything that already arrived, so that a pipeline of requests is answered as one batch
+			bool is_failed = false;
+
+			if (ready > 0)
+			{
+				do
+				{
+					Network::Peer_Msg peer_msg;
+					if (Network::receive_peer_msg(peer.peer_socket, peer_msg, torrent_data.storage.piece_count()) != 0)
+					{
+						is_failed = true;
+						break;
+					}
+
+					if (peer_msg.total_bytes > 0 && peer_msg.msg_type == Downloader::message_type::REQUEST)
+					{
+						Block_Request request;
+						if (parse_request(torrent_data, peer, peer_msg, request) != 0)
+						{
+							is_failed = true;
+							break;
+						}
+
+						if (is_super_seeding && !torrent_data.super_seeder.is_offered(choker_id, request.piece_index))
+						{
+							std::cerr << "Peer " << peer.value() << " requested piece " << request.piece_index << " which wasn't offered to it" << std::endl;
+							rejects.push_back(request);
+						}
+						else
+						{
+							requests.push_back(request);
+						}
+					}
+					else if (peer_msg.total_bytes > 0 && peer_msg.msg_type == Downloader::message_type::CANCEL)
+					{
+						Block_Request cancelled;
+						if (parse_request(torrent_data, peer, peer_msg, cancelled) == 0)
+						{
+							auto cancelled_count = std::erase_if(requests, [&cancelled](const Block_Request& request) {
+								return request.piece_index == cancelled.piece_index && request.begin == cancelled.begin && request.length == cancelled.length;
+							});
+
+							// a fast peer expects either the block or a reject for every request
+							if (cancelled_count > 0)
+								rejects.push_back(cancelled);
+						}
+					}
+					else if (peer_msg.total_bytes > 0 && (peer_msg.msg_type == Downloader::message_type::INTERESTED || peer_msg.msg_type == Downloader::message_type::NOT_INTERESTED))
+					{
+						Downloader::handle_peer_state_msg(peer, peer_msg);
+						torrent_data.choker.set_interested(choker_id, peer.peer_interested);
+
+						if (sync_choke_state(torrent_data, peer, choker_id) != 0)
+						{
+							is_failed = true;
+							break;
+						}
+					}
+					else if (peer_msg.total_bytes > 0 && Downloader::handle_peer_state_msg(peer, peer_msg))
+					{
+						// HAVE, BITFIELD, HAVE_ALL and HAVE_NONE keep track of what the peer has
+						if (is_super_seeding && peer_msg.msg_type == Downloader::message_type::HAVE && peer_msg.payload.size() == 4)
+							torrent_data.super_seeder.on_have(choker_id, Encoder::uint8_to_uint32(peer_msg.payload[0], peer_msg.payload[1], peer_msg.payload[2], peer_msg.payload[3]));
+						else if (is_super_seeding && peer_msg.msg_type == Downloader::message_type::BITFIELD)
+							torrent_data.super_seeder.on_bitfield(choker_id, peer_msg.payload);
+						else if (is_super_seeding && peer_msg.msg_type == Downloader::message_type::HAVE_ALL)
+							torrent_data.super_seeder.on_bitfield(choker_id, std::string((torrent_data.storage.piece_count() + 7) / 8, '\xFF'));
+					}
+					// keep-alive and extended msgs need no answer
+
+					poll_fd.revents = 0;
+				} while (requests.size() < UPLOAD_MAX_BATCH && poll(&poll_fd, 1, 0) > 0);
+			}
+
+			if (is_failed)
+				break;
+
+			last_activity = std::chrono::steady_clock::now();
+
+			// choked peers only get their Allowed Fast pieces, requests that arrived before a choke are dropped
+			// (fast peers get a reject for them), everyone else re-requests after the unchoke
+			std::erase_if(requests, [&](const Block_Request& request) {
+				bool is_servable = (!peer.am_choking || allowed_fast.contains(request.piece_index)) && torrent_data.storage.has_piece(request.piece_index);
+
+				if (!is_servable)
+					rejects.push_back(request);
+
+				return !is_servable;
+			});
+
+			if (peer.supports_fast_extension && !rejects.empty() && send_rejects(peer, rejects) != 0)
+				break;
+
+			rejects.clear();
+
+			// the upload limit paces the PIECE msgs, the requests it holds back stay queued and can still be cancelled
+			size_t allowed = 0;
+			while (allowed < requests.size() && upload_bucket.delay().count() == 0)
+				upload_bucket.consume(requests[allowed++].length);
+
+			if (allowed > 0 && send_blocks(torrent_data, peer, choker_id, std::vector<Block_Request>(requests.begin(), requests.begin() + allowed)) != 0)
+				break;
+
+			requests.erase(requests.begin(), requests.begin() + allowed);
+		}
+	}
+
+	void serve_peer(Torrent::TorrentData& torrent_data, Network::Peer& peer)
+	{
+		bool is_super_seeding = torrent_data.super_seeder.is_enabled();
+
+		// a super-seed reveals nothing up front, its pieces are offered one HAVE at a time
+		if (is_super_seeding)
+		{
+			peer.have_cursor = torrent_data.storage.completed_since(0).size();
+
+			Network::Peer_Msg have_none_msg;
+			have_none_msg.msg_type = Downloader::message_type::HAVE_NONE;
+
+			std::vector<Network::Peer_Msg> peer_msgs{have_none_msg};
+			if (peer.supports_fast_extension && Network::send_peer_msgs(peer.peer_socket, peer_msgs) != 0)
+				return;
+		}
+		else if (send_bitfield(torrent_data, peer) != 0)
+		{
+			return;
+		}
+
+		// fast peers may take a few pieces before their first unchoke, which gets new peers something to trade quickly
+		std::unordered_set<int> allowed_fast;
+
+		if (peer.supports_fast_extension && !is_super_seeding)
+		{
+			allowed_fast = allowed_fast_set(torrent_data, peer);
+
+			for (auto piece_index : allowed_fast)
+			{
+				if (torrent_data.storage.has_piece(piece_index) && send_index_msg(peer, Downloader::message_type::ALLOWED_FAST, piece_index) != 0)
+					return;
+			}
+		}
+
+		// every connection starts choked, the choker hands out the upload slots
+		int choker_id = torrent_data.choker.add_connection(peer.address);
+
+		if (is_super_seeding)
+			torrent_data.super_seeder.add_connection(choker_id);
+
+		// a throw ends this connection only, the choker and super seeder still have to forget it
+		try
+		{
+			serve_requests(torrent_data, peer, choker_id, allowed_fast);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Stopped serving peer " << peer.value() << ": " << e.what() << std::endl;
+		}
+
+		torrent_data.choker.remove_connection(choker_id);
+
+		if (is_super_seeding)
+			torrent_data.super_seeder.remove_connection(choker_id);
+	}
+
+	int seed_torrent(Torrent::TorrentData& torrent_data, bool is_super_seeding, const std::atomic<bool>& is_running)
+	{
+		if (!torrent_data.listener)
+		{
+			std::cerr << "Can't seed without a listening socket" << std::endl;
+			return -1;
+		}
+
+		if (torrent_data.storage.open(torrent_data, -1, true) != 0)
+			return -1;
+
+		int verified_pieces = torrent_data.storage.check_pieces(torrent_data);
+		std::cout << "Hash check: " << verified_pieces << "/" << torrent_data.piece_hashes.size() << " pieces ok\n";
+
+		if (verified_pieces != static_cast<int>(torrent_data.piece_hashes.size()))
+		{
+			std::cerr << "Data doesn't match the torrent, refusing to seed" << std::endl;
+			return -1;
+		}
+
+		torrent_data.verified = torrent_data.length;
+
+		if (is_super_seeding)
+			torrent_data.super_seeder.enable(verified_pieces);
+
+		torrent_data.choker.start(&torrent_data);
+		torrent_data.listener->add_torrent(&torrent_data);
+
+		std::cout << (is_super_seeding ? "Super-seeding" : "Seeding") << " on port " << torrent_data.listener->port() << ", interrupt to stop\n";
+
+		while (is_running)
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		torrent_data.listener->remove_torrent(torrent_data.info_hash);
+		torrent_data.choker.stop();
+		torrent_data.storage.close();
+
+		std::cout << "Stopped seeding, uploaded " << torrent_data.uploaded << " bytes\n";
+		return 0;
+	}
+}
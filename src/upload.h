@@ -0,0 +1,39 @@
+
+#ifndef _UPLOAD_H_
+#define _UPLOAD_H_
+
+#include <string>
+#include <atomic>
+
+#define UPLOAD_MAX_BLOCK_SIZE (128 * 1024) // larger requests are a protocol violation
+#define UPLOAD_IDLE_TIMEOUT_SEC 120       // peers send a keep-alive at least every two minutes
+#define UPLOAD_ALLOWED_FAST_COUNT 10      // pieces a fast peer may request while choked (BEP 6)
+
+namespace Torrent
+{
+	struct TorrentData;
+}
+
+namespace Network
+{
+	struct Peer;
+}
+
+namespace Upload
+{
+	// Sends our BITFIELD, or to fast peers HAVE_ALL / HAVE_NONE, and moves the HAVE cursor past the pieces it covered
+	int send_bitfield(const Torrent::TorrentData& torrent_data, Network::Peer& peer);
+
+	// Sends a HAVE for every piece that verified since the last call on this connection
+	int send_haves(const Torrent::TorrentData& torrent_data, Network::Peer& peer);
+
+	// Serves an incoming connection after the handshake: sends our bitfield, (un)chokes as the choker decides,
+	// answers REQUESTs from verified pieces and keeps broadcasting HAVEs until either side closes the socket.
+	// Fast peers also get Allowed Fast pieces, a REJECT for every request we won't serve and SUGGESTs for cached pieces.
+	void serve_peer(Torrent::TorrentData& torrent_data, Network::Peer& peer);
+
+	// Hash checks the existing data at torrent_data.out_file and serves it to incoming peers until is_running goes false
+	int seed_torrent(Torrent::TorrentData& torrent_data, bool is_super_seeding, const std::atomic<bool>& is_running);
+}
+
+#endif
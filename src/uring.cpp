@@ -0,0 +1,170 @@
+
+#include "uring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Uring
+{
+	Ring::~Ring()
+	{
+		close();
+	}
+
+	int Ring::open(unsigned entries)
+	{
+		close();
+
+		io_uring_params params{};
+		ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+		if (ring_fd < 0)
+			return -1;
+
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+			cq_ring_size = 0;
+		}
+
+		sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ring == MAP_FAILED)
+		{
+			sq_ring = nullptr;
+			close();
+			return -1;
+		}
+
+		cq_ring = sq_ring;
+		if (cq_ring_size > 0)
+		{
+			cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+			if (cq_ring == MAP_FAILED)
+			{
+				cq_ring = nullptr;
+				close();
+				return -1;
+			}
+		}
+
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		void* mapped_sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (mapped_sqes == MAP_FAILED)
+		{
+			close();
+			return -1;
+		}
+
+		sqes = static_cast<io_uring_sqe*>(mapped_sqes);
+
+		char* sq = static_cast<char*>(sq_ring);
+		sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		sq_entries = params.sq_entries;
+		sqe_tail = published = *sq_tail;
+
+		char* cq = static_cast<char*>(cq_ring);
+		cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+
+		return 0;
+	}
+
+	void Ring::close()
+	{
+		if (sqes)
+			munmap(sqes, sqes_size);
+
+		if (cq_ring && cq_ring != sq_ring)
+			munmap(cq_ring, cq_ring_size);
+
+		if (sq_ring)
+			munmap(sq_ring, sq_ring_size);
+
+		if (ring_fd >= 0)
+			::close(ring_fd);
+
+		ring_fd = -1;
+		sq_ring = cq_ring = nullptr;
+		sqes = nullptr;
+	}
+
+	io_uring_sqe* Ring::get_sqe()
+	{
+		unsigned head = std::atomic_ref<unsigned>(*sq_head).load(std::memory_order_acquire);
+		if (sqe_tail - head >= sq_entries)
+			return nullptr;
+
+		io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+		++sqe_tail;
+
+		std::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	int Ring::submit_and_wait(unsigned wait_nr)
+	{
+		unsigned to_submit = sqe_tail - published;
+
+		for (; published != sqe_tail; ++published)
+			sq_array[published & sq_mask] = published & sq_mask;
+
+		// the kernel reads the SQEs once it sees the tail move past them
+		std::atomic_ref<unsigned>(*sq_tail).store(sqe_tail, std::memory_order_release);
+
+		int submitted = 0;
+		do
+		{
+			++syscall_count;
+			submitted = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		}
+		// an interrupted wait already submitted everything, another enter only goes back to waiting
+		while (submitted < 0 && errno == EINTR);
+
+		return submitted < 0 ? -errno : submitted;
+	}
+
+	bool Ring::pop_cqe(io_uring_cqe& cqe)
+	{
+		unsigned head = *cq_head;
+		if (head == std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire))
+			return false;
+
+		cqe = cqes[head & cq_mask];
+		std::atomic_ref<unsigned>(*cq_head).store(head + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	int Ring::register_buffer_slots(unsigned count)
+	{
+		io_uring_rsrc_register slots{};
+		slots.nr = count;
+		slots.flags = IORING_RSRC_REGISTER_SPARSE;
+
+		++syscall_count;
+		return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS2, &slots, sizeof(slots)) < 0 ? -1 : 0;
+	}
+
+	int Ring::update_buffer_slots(unsigned first_slot, const std::vector<iovec>& buffers)
+	{
+		io_uring_rsrc_update2 update{};
+		update.offset = first_slot;
+		update.data = reinterpret_cast<uint64_t>(buffers.data());
+		update.nr = buffers.size();
+
+		++syscall_count;
+		return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0 ? -1 : 0;
+	}
+}
@@ -0,0 +1,71 @@
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+namespace Uring
+{
+	// Minimal io_uring (Linux 5.1+) on the raw syscalls, there is no liburing to build against. One submission and one
+	// completion queue shared with the kernel through mmap(): SQEs are filled in place, published with a single tail store
+	// and handed over by one io_uring_enter() however many there are, completions are read off the CQ without a syscall.
+	// Not thread safe, one thread drives the ring.
+	class Ring
+	{
+	public:
+		~Ring();
+
+		int open(unsigned entries); // -1 where io_uring is missing or disabled (old kernel, seccomp, io_uring_disabled)
+
+		void close();
+
+		bool is_open() const { return ring_fd >= 0; }
+
+		io_uring_sqe* get_sqe(); // zeroed, nullptr while the submission queue is full
+
+		// Submits the SQEs got since the last call and waits until wait_nr completions are ready, returns the number
+		// submitted or -errno
+		int submit_and_wait(unsigned wait_nr);
+
+		bool pop_cqe(io_uring_cqe& cqe); // false when no completion is ready
+
+		// count empty fixed buffer slots (Linux 5.13+), WRITE_FIXED needs the buffer registered in one of them first
+		int register_buffer_slots(unsigned count);
+
+		// Fills slots from first_slot on, an iovec with a null base empties its slot
+		int update_buffer_slots(unsigned first_slot, const std::vector<iovec>& buffers);
+
+		uint64_t syscalls() const { return syscall_count; } // io_uring_enter and io_uring_register calls
+
+	private:
+		int ring_fd = -1;
+
+		void* sq_ring = nullptr;
+		void* cq_ring = nullptr;
+		size_t sq_ring_size = 0;
+		size_t cq_ring_size = 0; // 0 when the CQ shares the SQ's mapping (IORING_FEAT_SINGLE_MMAP)
+		io_uring_sqe* sqes = nullptr;
+		size_t sqes_size = 0;
+
+		unsigned* sq_head = nullptr;
+		unsigned* sq_tail = nullptr;
+		unsigned* sq_array = nullptr;
+		unsigned sq_mask = 0;
+		unsigned sq_entries = 0;
+		unsigned sqe_tail = 0;   // SQEs handed out by get_sqe()
+		unsigned published = 0;  // SQEs the kernel can see
+
+		unsigned* cq_head = nullptr;
+		unsigned* cq_tail = nullptr;
+		io_uring_cqe* cqes = nullptr;
+		unsigned cq_mask = 0;
+
+		uint64_t syscall_count = 0;
+	};
+}
+
+#endif
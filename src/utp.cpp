@@ -0,0 +1,991 @@
+
+#include "utp.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define UTP_DATAGRAM_SIZE 2048
+#define UTP_LOOP_INTERVAL_MS 100    // longest poll() wait, timers are checked at least this often
+#define UTP_SOCKET_BUFFER (4 * 1024 * 1024) // bursts of small datagrams arrive faster than one batch is handled
+
+namespace Utp
+{
+	static void put_u16(std::string& out, uint16_t value)
+	{
+		out.push_back(static_cast<char>(value >> 8));
+		out.push_back(static_cast<char>(value & 0xff));
+	}
+
+	static void put_u32(std::string& out, uint32_t value)
+	{
+		put_u16(out, static_cast<uint16_t>(value >> 16));
+		put_u16(out, static_cast<uint16_t>(value & 0xffff));
+	}
+
+	static uint16_t get_u16(const uint8_t* data)
+	{
+		return static_cast<uint16_t>((data[0] << 8) | data[1]);
+	}
+
+	static uint32_t get_u32(const uint8_t* data)
+	{
+		return (uint32_t(get_u16(data)) << 16) | get_u16(data + 2);
+	}
+
+	// sequence numbers wrap around, a comes before b if b is less than half the space ahead of it
+	static bool is_before(uint16_t a, uint16_t b)
+	{
+		uint16_t distance = b - a;
+		return distance != 0 && distance < 0x8000;
+	}
+
+	static bool make_socket_pair(int& local_socket, int& app_socket)
+	{
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+		{
+			std::cerr << "uTP socket pair failed: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		// only our end is non-blocking, the peer code expects a socket that blocks like a TCP one
+		fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+
+		local_socket = pair[0];
+		app_socket = pair[1];
+		return true;
+	}
+
+	Utp_Socket::~Utp_Socket()
+	{
+		stop();
+	}
+
+	int Utp_Socket::start(uint16_t port)
+	{
+		if (is_running)
+			return 0;
+
+		// IPv4 only like the DHT, a socket of the other family can't send to these addresses
+		udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (udp_socket < 0)
+		{
+			std::cerr << "uTP socket failed: " << strerror(errno) << std::endl;
+			return -1;
+		}
+
+		sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+
+		if (bind(udp_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+		{
+			addr.sin_port = 0;
+			if (bind(udp_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+			{
+				std::cerr << "uTP bind failed: " << strerror(errno) << std::endl;
+				close(udp_socket);
+				udp_socket = -1;
+				return -1;
+			}
+		}
+
+		socklen_t addr_len = sizeof(addr);
+		getsockname(udp_socket, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+		bound_port = ntohs(addr.sin_port);
+
+		int buffer_size = UTP_SOCKET_BUFFER;
+		setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+		setsockopt(udp_socket, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+		receive_buffers.resize(UTP_BATCH * UTP_DATAGRAM_SIZE);
+
+		is_running = true;
+		utp_thread = std::thread(&Utp_Socket::utp_loop, this);
+
+		return 0;
+	}
+
+	void Utp_Socket::stop()
+	{
+		if (!is_running)
+			return;
+
+		is_running = false;
+		utp_thread.join();
+
+		std::unique_lock<std::mutex> lock(utp_mutex);
+
+		for (auto& [key, connection] : connections)
+		{
+			send_reset(connection.address, connection.send_id);
+			close(connection.local_socket);
+
+			if (connection.state == SYN_SENT)
+				failed_connects.insert(connection.app_socket);
+		}
+
+		flush_datagrams();
+		connections.clear();
+		app_sockets.clear();
+
+		close(udp_socket);
+		udp_socket = -1;
+
+		utp_cv.notify_all();
+	}
+
+	int Utp_Socket::start_connect(const Network::Peer_Address& address)
+	{
+		if (!is_running || address.family() != AF_INET)
+			return -1;
+
+		int local_socket = -1, app_socket = -1;
+		if (!make_socket_pair(local_socket, app_socket))
+			return -1;
+
+		std::unique_lock<std::mutex> lock(utp_mutex);
+
+		uint16_t recv_id = 0;
+		std::string key;
+		do
+		{
+			recv_id = static_cast<uint16_t>(random());
+			key = connection_key(address, recv_id);
+		} while (connections.contains(key));
+
+		Connection& connection = connections[key];
+		connection.address = address;
+		connection.local_socket = local_socket;
+		connection.app_socket = app_socket;
+		connection.recv_id = recv_id;
+		connection.send_id = recv_id + 1;
+		connection.state = SYN_SENT;
+		connection.started_at = Clock::now();
+		connection.last_received = connection.started_at;
+
+		app_sockets[app_socket] = key;
+		failed_connects.erase(app_socket); // the number may have belonged to an earlier connect
+
+		// the SYN is in flight like any packet, it is resent until the peer's STATE acks it
+		Packet& syn = connection.in_flight.emplace_back();
+		syn.type = ST_SYN;
+		syn.seq_nr = connection.seq_nr++;
+		send_packet(connection, syn);
+
+		flush_datagrams();
+
+		return app_socket;
+	}
+
+	int Utp_Socket::connect_state(int app_socket)
+	{
+		std::unique_lock<std::mutex> lock(utp_mutex);
+
+		if (failed_connects.erase(app_socket))
+			return -1;
+
+		auto it = app_sockets.find(app_socket);
+		if (it == app_sockets.end())
+			return -1;
+
+		return connections.at(it->second).state == SYN_SENT ? 0 : 1;
+	}
+
+	void Utp_Socket::abort_connect(int app_socket)
+	{
+		std::unique_lock<std::mutex> lock(utp_mutex);
+
+		failed_connects.erase(app_socket);
+
+		auto it = app_sockets.find(app_socket);
+		if (it == app_sockets.end())
+			return;
+
+		std::string key = it->second;
+		Connection& connection = connections.at(key);
+
+		if (connection.state != SYN_SENT)
+			send_reset(connection.address, connection.send_id);
+
+		remove_connection(key, false);
+		flush_datagrams();
+	}
+
+	int Utp_Socket::connect(const Network::Peer_Address& address, std::chrono::milliseconds timeout)
+	{
+		int app_socket = start_connect(address);
+		if (app_socket < 0)
+			return -1;
+
+		std::unique_lock<std::mutex> lock(utp_mutex);
+		utp_cv.wait_for(lock, timeout, [this, app_socket]() {
+			auto it = app_sockets.find(app_socket);
+			return !is_running || it == app_sockets.end() || connections.at(it->second).state != SYN_SENT;
+		});
+		lock.unlock();
+
+		if (connect_state(app_socket) == 1)
+			return app_socket;
+
+		abort_connect(app_socket);
+		close(app_socket);
+		return -1;
+	}
+
+	void Utp_Socket::set_accept_handler(std::function<void(int app_socket, const Network::Peer_Address& address)> handler)
+	{
+		std::unique_lock<std::mutex> lock(utp_mutex);
+		accept_handler = std::move(handler);
+	}
+
+	void Utp_Socket::set_impairment(std::chrono::milliseconds delay, double loss_rate)
+	{
+		std::unique_lock<std::mutex> lock(utp_mutex);
+		impairment_delay = delay;
+		impairment_loss = loss_rate;
+	}
+
+	Stats Utp_Socket::stats() const
+	{
+		std::unique_lock<std::mutex> lock(utp_mutex);
+
+		Stats current = counters;
+		current.connections = connections.size();
+		return current;
+	}
+
+	void Utp_Socket::utp_loop()
+	{
+		std::vector<pollfd> poll_fds;
+		std::vector<std::string> poll_keys; // connection of poll_fds[index + 1]
+		std::vector<std::pair<Network::Peer_Address, int>> accepted;
+		std::vector<std::pair<std::string, bool>> finished; // (key, has failed)
+
+		while (is_running)
+		{
+			std::unique_lock<std::mutex> lock(utp_mutex);
+			auto now = Clock::now();
+
+			poll_fds.assign(1, pollfd{udp_socket, POLLIN, 0});
+			poll_keys.clear();
+
+			auto wake_at = now + std::chrono::milliseconds(UTP_LOOP_INTERVAL_MS);
+			for (auto& [key, connection] : connections)
+			{
+				short events = 0;
+
+				// the peer code's data is only picked up while it can go out, the socket pair buffers the rest
+				if (connection.state == CONNECTED && !connection.is_app_closed &&
+					connection.bytes_in_flight + UTP_MAX_PAYLOAD <= std::min<size_t>(connection.window, connection.peer_window))
+					events |= POLLIN;
+
+				if (!connection.received.empty())
+					events |= POLLOUT;
+
+				if (events != 0)
+				{
+					poll_fds.push_back(pollfd{connection.local_socket, events, 0});
+					poll_keys.push_back(key);
+				}
+
+				if (!connection.in_flight.empty())
+					wake_at = std::min(wake_at, connection.rto_deadline);
+			}
+
+			if (!delayed.empty())
+				wake_at = std::min(wake_at, delayed.front().due_at);
+
+			lock.unlock();
+
+			int timeout_ms = std::chrono::ceil<std::chrono::milliseconds>(std::max(wake_at - now, Clock::duration::zero())).count();
+			if (poll(poll_fds.data(), poll_fds.size(), timeout_ms) < 0 && errno != EINTR)
+			{
+				std::cerr << "uTP poll failed: " << strerror(errno) << std::endl;
+				std::this_thread::sleep_for(std::chrono::milliseconds(UTP_LOOP_INTERVAL_MS));
+				continue;
+			}
+
+			lock.lock();
+
+			accepted.clear();
+			if (poll_fds[0].revents != 0)
+				receive_datagrams(accepted);
+
+			for (size_t index = 1; index < poll_fds.size(); ++index)
+			{
+				auto it = connections.find(poll_keys[index - 1]);
+				if (it == connections.end() || poll_fds[index].revents == 0)
+					continue;
+
+				if (poll_fds[index].revents & POLLOUT)
+					deliver(it->second);
+
+				if (poll_fds[index].revents & (POLLIN | POLLHUP | POLLERR))
+					read_app_data(it->second);
+			}
+
+			now = Clock::now();
+			finished.clear();
+
+			for (auto& [key, connection] : connections)
+			{
+				// acks made room in the window, it is filled before the ack for what came in goes out
+				if (connection.has_new_acks)
+				{
+					connection.has_new_acks = false;
+					read_app_data(connection);
+				}
+
+				if (check_timeouts(connection, now))
+				{
+					send_reset(connection.address, connection.send_id);
+					finished.emplace_back(key, true);
+				}
+				else if (is_finished(connection))
+					finished.emplace_back(key, false);
+				else if (connection.needs_ack)
+					send_state(connection); // one per batch of received datagrams instead of one per packet
+			}
+
+			for (auto& [key, has_failed] : finished)
+				remove_connection(key, has_failed);
+
+			while (!delayed.empty() && delayed.front().due_at <= now)
+			{
+				outgoing.push_back(std::move(delayed.front()));
+				delayed.pop_front();
+			}
+
+			flush_datagrams();
+
+			auto handler = accept_handler;
+			lock.unlock();
+
+			for (auto& [address, app_socket] : accepted)
+			{
+				if (handler)
+					handler(app_socket, address);
+				else
+					close(app_socket);
+			}
+		}
+	}
+
+	void Utp_Socket::receive_datagrams(std::vector<std::pair<Network::Peer_Address, int>>& accepted)
+	{
+		mmsghdr messages[UTP_BATCH];
+		iovec buffers[UTP_BATCH];
+		sockaddr_storage senders[UTP_BATCH];
+
+		while (true)
+		{
+			for (int index = 0; index < UTP_BATCH; ++index)
+			{
+				buffers[index].iov_base = receive_buffers.data() + index * UTP_DATAGRAM_SIZE;
+				buffers[index].iov_len = UTP_DATAGRAM_SIZE;
+
+				messages[index] = mmsghdr{};
+				messages[index].msg_hdr.msg_name = &senders[index];
+				messages[index].msg_hdr.msg_namelen = sizeof(senders[index]);
+				messages[index].msg_hdr.msg_iov = &buffers[index];
+				messages[index].msg_hdr.msg_iovlen = 1;
+			}
+
+			int count = recvmmsg(udp_socket, messages, UTP_BATCH, MSG_DONTWAIT, nullptr);
+			if (count <= 0)
+				break;
+
+			counters.packets_received += count;
+
+			for (int index = 0; index < count; ++index)
+			{
+				Network::Peer_Address sender;
+				std::memcpy(&sender.storage, &senders[index], std::min<size_t>(messages[index].msg_hdr.msg_namelen, sizeof(sender.storage)));
+
+				handle_packet(sender, static_cast<const uint8_t*>(buffers[index].iov_base), messages[index].msg_len, accepted);
+			}
+
+			if (count < UTP_BATCH)
+				break;
+		}
+	}
+
+	void Utp_Socket::handle_packet(const Network::Peer_Address& sender, const uint8_t* data, size_t len, std::vector<std::pair<Network::Peer_Address, int>>& accepted)
+	{
+		// version 1 is the only one there is, anything else isn't uTP
+		if (len < UTP_HEADER_SIZE || (data[0] & 0x0f) != 1)
+			return;
+
+		Header header;
+		header.type = data[0] >> 4;
+		header.extension = data[1];
+		header.connection_id = get_u16(data + 2);
+		header.timestamp_us = get_u32(data + 4);
+		header.timestamp_diff_us = get_u32(data + 8);
+		header.wnd_size = get_u32(data + 12);
+		header.seq_nr = get_u16(data + 16);
+		header.ack_nr = get_u16(data + 18);
+
+		if (header.type > ST_SYN)
+			return;
+
+		// extensions are chained (next type, length, data), selective ACK is type 1 and the rest is skipped
+		size_t offset = UTP_HEADER_SIZE;
+		const uint8_t* sack = nullptr;
+		size_t sack_len = 0;
+
+		for (uint8_t extension = header.extension; extension != 0;)
+		{
+			if (offset + 2 > len)
+				return;
+
+			uint8_t next = data[offset];
+			uint8_t extension_len = data[offset + 1];
+			offset += 2;
+
+			if (offset + extension_len > len)
+				return;
+
+			if (extension == 1)
+			{
+				sack = data + offset;
+				sack_len = extension_len;
+			}
+
+			offset += extension_len;
+			extension = next;
+		}
+
+		if (header.type == ST_SYN)
+		{
+			handle_syn(sender, header, accepted);
+			return;
+		}
+
+		std::string key = connection_key(sender, header.connection_id);
+		auto it = connections.find(key);
+
+		// a RESET may carry the id of the packet it answers, which is the id we send with
+		if (it == connections.end() && header.type == ST_RESET)
+		{
+			it = std::find_if(connections.begin(), connections.end(), [&](const auto& entry) {
+				return entry.second.address == sender && entry.second.send_id == header.connection_id;
+			});
+		}
+
+		if (it == connections.end())
+		{
+			if (header.type != ST_RESET)
+				send_reset(sender, header.connection_id);
+
+			return;
+		}
+
+		Connection& connection = it->second;
+		connection.last_received = Clock::now();
+		connection.reply_us = now_us() - header.timestamp_us;
+		connection.peer_window = header.wnd_size;
+
+		if (header.type == ST_RESET)
+		{
+			remove_connection(it->first, true);
+			return;
+		}
+
+		if (connection.state == SYN_SENT)
+		{
+			if (header.ack_nr != connection.in_flight.front().seq_nr)
+				return;
+
+			// the peer's first packet is its STATE, which takes no sequence number: its data starts at the same one
+			connection.state = CONNECTED;
+			connection.ack_nr = header.seq_nr - 1;
+
+			utp_cv.notify_all();
+		}
+
+		handle_acks(connection, header, sack, sack_len);
+
+		if (header.type == ST_DATA || header.type == ST_FIN)
+			receive_payload(connection, header, std::string(reinterpret_cast<const char*>(data) + offset, len - offset));
+	}
+
+	void Utp_Socket::handle_syn(const Network::Peer_Address& sender, const Header& header, std::vector<std::pair<Network::Peer_Address, int>>& accepted)
+	{
+		std::string key = connection_key(sender, header.connection_id + 1);
+
+		auto it = connections.find(key);
+		if (it != connections.end())
+		{
+			send_state(it->second); // our STATE got lost, the SYN was resent
+			return;
+		}
+
+		int local_socket = -1, app_socket = -1;
+		if (!accept_handler || sender.family() != AF_INET || !make_socket_pair(local_socket, app_socket))
+		{
+			send_reset(sender, header.connection_id);
+			return;
+		}
+
+		Connection& connection = connections[key];
+		connection.address = sender;
+		connection.local_socket = local_socket;
+		connection.app_socket = app_socket;
+		connection.recv_id = header.connection_id + 1;
+		connection.send_id = header.connection_id;
+		connection.state = CONNECTED;
+		connection.started_at = Clock::now();
+		connection.last_received = connection.started_at;
+		connection.seq_nr = static_cast<uint16_t>(random());
+		connection.ack_nr = header.seq_nr;
+		connection.reply_us = now_us() - header.timestamp_us;
+		connection.peer_window = header.wnd_size;
+
+		app_sockets[app_socket] = key;
+
+		send_state(connection);
+		accepted.emplace_back(sender, app_socket);
+	}
+
+	void Utp_Socket::handle_acks(Connection& connection, const Header& header, const uint8_t* sack, size_t sack_len)
+	{
+		auto now = Clock::now();
+		size_t acked_bytes = 0;
+		bool is_new_ack = false;
+
+		// Karn: only packets sent once give an unambiguous round trip
+		auto acked = [&](Packet& packet) {
+			acked_bytes += packet.payload.size();
+			connection.bytes_in_flight -= packet.payload.size();
+
+			if (packet.transmissions != 1)
+				return;
+
+			double sample_ms = std::chrono::duration<double, std::milli>(now - packet.sent_at).count();
+			if (connection.rtt_ms == 0)
+			{
+				connection.rtt_ms = sample_ms;
+				connection.rtt_var_ms = sample_ms / 2;
+			}
+			else
+			{
+				connection.rtt_var_ms += (std::abs(connection.rtt_ms - sample_ms) - connection.rtt_var_ms) / 4;
+				connection.rtt_ms += (sample_ms - connection.rtt_ms) / 8;
+			}
+
+			connection.rto_ms = std::clamp(static_cast<int>(connection.rtt_ms + 4 * connection.rtt_var_ms), UTP_MIN_RTO_MS, UTP_MAX_RTO_MS);
+		};
+
+		// everything up to ack_nr arrived
+		while (!connection.in_flight.empty() && !is_before(header.ack_nr, connection.in_flight.front().seq_nr))
+		{
+			if (!connection.in_flight.front().is_acked)
+				acked(connection.in_flight.front());
+
+			connection.in_flight.pop_front();
+			is_new_ack = true;
+		}
+
+		// bit n of the selective ACK stands for ack_nr + 2 + n, ack_nr + 1 is missing or there would be no mask
+		int sacked_after_front = 0;
+		if (sack && !connection.in_flight.empty())
+		{
+			for (size_t bit = 0; bit < sack_len * 8; ++bit)
+			{
+				if (!(sack[bit / 8] & (1 << (bit % 8))))
+					continue;
+
+				uint16_t index = static_cast<uint16_t>(header.ack_nr + 2 + bit) - connection.in_flight.front().seq_nr;
+				if (index >= connection.in_flight.size())
+					continue;
+
+				++sacked_after_front;
+
+				Packet& packet = connection.in_flight[index];
+				if (!packet.is_acked)
+				{
+					packet.is_acked = true;
+					acked(packet);
+				}
+			}
+		}
+
+		if (is_new_ack)
+		{
+			connection.duplicate_acks = 0;
+			connection.timeouts = 0;
+			connection.rto_deadline = now + std::chrono::milliseconds(connection.rto_ms);
+		}
+		else if (header.type == ST_STATE && header.ack_nr == connection.last_ack_nr && !connection.in_flight.empty())
+			++connection.duplicate_acks;
+
+		connection.last_ack_nr = header.ack_nr;
+
+		// three packets made it past the oldest one in flight, it is lost rather than late
+		if (!connection.in_flight.empty() && (connection.duplicate_acks >= 3 || sacked_after_front >= 3) &&
+			connection.fast_resent_seq != connection.in_flight.front().seq_nr)
+		{
+			connection.fast_resent_seq = connection.in_flight.front().seq_nr;
+			++counters.fast_resends;
+
+			if (now - connection.window_cut_at > std::chrono::duration<double, std::milli>(connection.rtt_ms))
+			{
+				connection.window = std::max(connection.window / 2, double(UTP_MIN_WINDOW));
+				connection.window_cut_at = now;
+			}
+
+			send_packet(connection, connection.in_flight.front());
+		}
+
+		if (acked_bytes > 0)
+		{
+			update_window(connection, acked_bytes, header.timestamp_diff_us);
+			connection.has_new_acks = true;
+		}
+	}
+
+	void Utp_Socket::receive_payload(Connection& connection, const Header& header, std::string payload)
+	{
+		connection.needs_ack = true;
+
+		// 0 for the next packet expected, duplicates wrap around to large distances
+		uint16_t distance = header.seq_nr - static_cast<uint16_t>(connection.ack_nr + 1);
+		if (distance >= UTP_REORDER_LIMIT)
+			return;
+
+		if (header.type == ST_FIN)
+			connection.fin_seq = header.seq_nr;
+		else if (connection.fin_seq >= 0 && is_before(connection.fin_seq, header.seq_nr))
+			return;
+
+		if (distance > 0)
+		{
+			if (connection.out_of_order.emplace(header.seq_nr, payload).second)
+				connection.out_of_order_bytes += payload.size();
+
+			return;
+		}
+
+		connection.received += payload;
+		++connection.ack_nr;
+
+		// the packets that only waited for this one
+		for (auto it = connection.out_of_order.find(connection.ack_nr + 1); it != connection.out_of_order.end(); it = connection.out_of_order.find(connection.ack_nr + 1))
+		{
+			connection.received += it->second;
+			connection.out_of_order_bytes -= it->second.size();
+			connection.out_of_order.erase(it);
+			++connection.ack_nr;
+		}
+
+		deliver(connection);
+	}
+
+	void Utp_Socket::update_window(Connection& connection, size_t acked_bytes, uint32_t delay_us)
+	{
+		// the peer measured how long our packet took, clocks aren't synchronized so only the part above the lowest
+		// delay seen recently means anything: that is the time the packet spent queued somewhere on the path
+		if (delay_us != 0)
+		{
+			int64_t minute = std::chrono::duration_cast<std::chrono::minutes>(Clock::now().time_since_epoch()).count();
+
+			if (connection.base_delays.empty() || connection.base_delays.back().first != minute)
+				connection.base_delays.emplace_back(minute, delay_us);
+			else
+				connection.base_delays.back().second = std::min(connection.base_delays.back().second, delay_us);
+
+			while (connection.base_delays.size() > UTP_BASE_DELAY_MINUTES)
+				connection.base_delays.pop_front();
+		}
+
+		double queuing_delay_us = 0;
+		if (delay_us != 0)
+		{
+			uint32_t base_delay = delay_us;
+			for (auto& [minute, lowest] : connection.base_delays)
+				base_delay = std::min(base_delay, lowest);
+
+			queuing_delay_us = delay_us - base_delay;
+		}
+
+		// LEDBAT: grows by up to UTP_GAIN_BYTES_PER_RTT while below the target delay, shrinks in proportion above it
+		double off_target = (UTP_TARGET_DELAY_US - queuing_delay_us) / UTP_TARGET_DELAY_US;
+		double window_share = std::min<double>(acked_bytes, connection.window) / std::max<double>(connection.window, acked_bytes);
+
+		connection.window = std::clamp(connection.window + UTP_GAIN_BYTES_PER_RTT * off_target * window_share, double(UTP_MIN_WINDOW), double(UTP_MAX_WINDOW));
+	}
+
+	void Utp_Socket::read_app_data(Connection& connection)
+	{
+		if (connection.state != CONNECTED || connection.is_app_closed)
+			return;
+
+		while (true)
+		{
+			// with nothing in flight one packet goes out regardless, its ack brings the peer's current window
+			size_t window = std::min<size_t>(connection.window, connection.peer_window);
+			if (!connection.in_flight.empty() && connection.bytes_in_flight + UTP_MAX_PAYLOAD > window)
+				break;
+
+			std::string payload(UTP_MAX_PAYLOAD, '\0');
+			ssize_t bytes_read = recv(connection.local_socket, payload.data(), payload.size(), MSG_DONTWAIT);
+
+			if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				break;
+
+			if (bytes_read <= 0)
+			{
+				// the peer code closed or shut down its end, the FIN goes out after everything it wrote before
+				connection.is_app_closed = true;
+				connection.state = FIN_SENT;
+
+				Packet& fin = connection.in_flight.emplace_back();
+				fin.type = ST_FIN;
+				fin.seq_nr = connection.seq_nr++;
+				send_packet(connection, fin);
+				break;
+			}
+
+			payload.resize(bytes_read);
+			connection.bytes_in_flight += bytes_read;
+
+			Packet& packet = connection.in_flight.emplace_back();
+			packet.seq_nr = connection.seq_nr++;
+			packet.payload = std::move(payload);
+			send_packet(connection, packet);
+		}
+	}
+
+	void Utp_Socket::deliver(Connection& connection)
+	{
+		while (!connection.received.empty())
+		{
+			ssize_t sent = send(connection.local_socket, connection.received.data(), connection.received.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				return;
+
+			if (sent < 0)
+			{
+				connection.received.clear(); // the peer code is gone, nobody reads this anymore
+				break;
+			}
+
+			connection.received.erase(0, sent);
+		}
+
+		if (!connection.is_eof_delivered && connection.fin_seq >= 0 && !is_before(connection.ack_nr, connection.fin_seq))
+		{
+			shutdown(connection.local_socket, SHUT_WR);
+			connection.is_eof_delivered = true;
+		}
+	}
+
+	bool Utp_Socket::check_timeouts(Connection& connection, Clock::time_point now)
+	{
+		if (connection.state == SYN_SENT && now - connection.started_at > std::chrono::milliseconds(CONNECT_TIMEOUT_MS))
+			return true;
+
+		if (now - connection.last_received > std::chrono::seconds(UTP_IDLE_TIMEOUT_SEC))
+			return true;
+
+		if (connection.in_flight.empty() || now < connection.rto_deadline)
+			return false;
+
+		if (++connection.timeouts > UTP_MAX_TIMEOUTS)
+			return true;
+
+		// the path is congested or gone, start over from the smallest window and back off
+		connection.window = UTP_MIN_WINDOW;
+		connection.rto_ms = std::min(connection.rto_ms * 2, UTP_MAX_RTO_MS);
+		connection.rto_deadline = now + std::chrono::milliseconds(connection.rto_ms);
+
+		send_packet(connection, connection.in_flight.front());
+		return false;
+	}
+
+	void Utp_Socket::send_packet(Connection& connection, Packet& packet)
+	{
+		auto now = Clock::now();
+
+		if (packet.transmissions > 0)
+			++counters.retransmissions;
+		else if (connection.in_flight.size() == 1)
+			connection.rto_deadline = now + std::chrono::milliseconds(connection.rto_ms); // nothing was in flight, the timer starts
+
+		++packet.transmissions;
+		packet.sent_at = now;
+
+		queue_datagram(connection.address, encode(connection, packet.type, packet.seq_nr, packet.payload));
+	}
+
+	void Utp_Socket::send_state(Connection& connection)
+	{
+		connection.needs_ack = false;
+		queue_datagram(connection.address, encode(connection, ST_STATE, connection.seq_nr, ""));
+	}
+
+	void Utp_Socket::send_reset(const Network::Peer_Address& address, uint16_t connection_id)
+	{
+		std::string datagram;
+		datagram.push_back(static_cast<char>((ST_RESET << 4) | 1));
+		datagram.push_back(0);
+		put_u16(datagram, connection_id);
+		put_u32(datagram, now_us());
+		put_u32(datagram, 0);
+		put_u32(datagram, 0);
+		put_u16(datagram, 0);
+		put_u16(datagram, 0);
+
+		queue_datagram(address, std::move(datagram));
+	}
+
+	void Utp_Socket::queue_datagram(const Network::Peer_Address& address, std::string datagram)
+	{
+		if (impairment_loss > 0 && std::uniform_real_distribution<double>(0, 1)(random) < impairment_loss)
+		{
+			++counters.dropped;
+			return;
+		}
+
+		if (impairment_delay.count() > 0)
+		{
+			delayed.push_back(Datagram{address, std::move(datagram), Clock::now() + impairment_delay});
+			return;
+		}
+
+		outgoing.push_back(Datagram{address, std::move(datagram), {}});
+	}
+
+	void Utp_Socket::flush_datagrams()
+	{
+		mmsghdr messages[UTP_BATCH];
+		iovec buffers[UTP_BATCH];
+
+		for (size_t first = 0; first < outgoing.size(); first += UTP_BATCH)
+		{
+			size_t count = std::min<size_t>(UTP_BATCH, outgoing.size() - first);
+
+			for (size_t index = 0; index < count; ++index)
+			{
+				Datagram& datagram = outgoing[first + index];
+
+				buffers[index].iov_base = datagram.data.data();
+				buffers[index].iov_len = datagram.data.size();
+
+				messages[index] = mmsghdr{};
+				messages[index].msg_hdr.msg_name = const_cast<sockaddr*>(datagram.address.sock_addr());
+				messages[index].msg_hdr.msg_namelen = datagram.address.length();
+				messages[index].msg_hdr.msg_iov = &buffers[index];
+				messages[index].msg_hdr.msg_iovlen = 1;
+			}
+
+			// what the kernel doesn't take is lost like on the way, retransmission covers it
+			size_t sent = 0;
+			while (sent < count)
+			{
+				int result = sendmmsg(udp_socket, messages + sent, count - sent, MSG_DONTWAIT);
+				if (result <= 0)
+					break;
+
+				sent += result;
+			}
+
+			counters.packets_sent += sent;
+		}
+
+		outgoing.clear();
+	}
+
+	std::string Utp_Socket::encode(const Connection& connection, uint8_t type, uint16_t seq_nr, const std::string& payload)
+	{
+		// packets that arrived after a missing one are reported in a selective ACK of the 32 packets past it
+		std::string sack;
+		if (!connection.out_of_order.empty() && type != ST_SYN)
+		{
+			sack.assign(4, '\0');
+			for (int bit = 0; bit < 32; ++bit)
+			{
+				if (connection.out_of_order.contains(static_cast<uint16_t>(connection.ack_nr + 2 + bit)))
+					sack[bit / 8] |= static_cast<char>(1 << (bit % 8));
+			}
+		}
+
+		std::string datagram;
+		datagram.reserve(UTP_HEADER_SIZE + 2 + sack.size() + payload.size());
+
+		datagram.push_back(static_cast<char>((type << 4) | 1));
+		datagram.push_back(sack.empty() ? 0 : 1);
+		put_u16(datagram, type == ST_SYN ? connection.recv_id : connection.send_id);
+		put_u32(datagram, now_us());
+		put_u32(datagram, connection.reply_us);
+		put_u32(datagram, advertised_window(connection));
+		put_u16(datagram, seq_nr);
+		put_u16(datagram, connection.ack_nr);
+
+		if (!sack.empty())
+		{
+			datagram.push_back(0); // no further extension
+			datagram.push_back(static_cast<char>(sack.size()));
+			datagram += sack;
+		}
+
+		datagram += payload;
+		return datagram;
+	}
+
+	uint32_t Utp_Socket::advertised_window(const Connection& connection) const
+	{
+		size_t buffered = connection.received.size() + connection.out_of_order_bytes;
+		return buffered >= UTP_RECV_BUFFER ? 0 : UTP_RECV_BUFFER - buffered;
+	}
+
+	bool Utp_Socket::is_finished(const Connection& connection) const
+	{
+		// our FIN was acked, and the peer's arrived or the peer code doesn't read anymore
+		return connection.state == FIN_SENT && connection.in_flight.empty() && (connection.is_eof_delivered || connection.received.empty());
+	}
+
+	void Utp_Socket::remove_connection(const std::string& key, bool has_failed)
+	{
+		auto it = connections.find(key);
+		if (it == connections.end())
+			return;
+
+		Connection& connection = it->second;
+
+		if (connection.state == SYN_SENT && has_failed)
+			failed_connects.insert(connection.app_socket);
+
+		// the socket number may have been reused by a newer connect already
+		auto app_it = app_sockets.find(connection.app_socket);
+		if (app_it != app_sockets.end() && app_it->second == key)
+			app_sockets.erase(app_it);
+
+		close(connection.local_socket); // the peer code reads EOF
+		connections.erase(it);
+
+		utp_cv.notify_all();
+	}
+
+	std::string Utp_Socket::connection_key(const Network::Peer_Address& address, uint16_t recv_id)
+	{
+		return address.to_string() + "/" + std::to_string(recv_id);
+	}
+
+	uint32_t Utp_Socket::now_us()
+	{
+		return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count());
+	}
+}
@@ -0,0 +1,240 @@
+
+#ifndef _UTP_H_
+#define _UTP_H_
+
+#include "network_helper.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define UTP_HEADER_SIZE 20
+#define UTP_MAX_PAYLOAD 1400             // per packet, header and SACK included this stays below common path MTUs
+#define UTP_BATCH 32                     // datagrams per recvmmsg / sendmmsg call
+#define UTP_TARGET_DELAY_US 100000       // LEDBAT target: the queuing delay we are willing to add to the path
+#define UTP_GAIN_BYTES_PER_RTT 3000      // window growth per RTT at zero queuing delay
+#define UTP_MIN_WINDOW (2 * UTP_MAX_PAYLOAD)
+#define UTP_MAX_WINDOW (1024 * 1024)
+#define UTP_RECV_BUFFER (1024 * 1024)    // advertised receive window, received data the peer code hasn't read yet counts against it
+#define UTP_BASE_DELAY_MINUTES 10        // the base delay is the lowest delay seen over this many minutes
+#define UTP_MIN_RTO_MS 500
+#define UTP_MAX_RTO_MS 8000
+#define UTP_MAX_TIMEOUTS 6               // retransmission timeouts in a row before the connection is given up
+#define UTP_IDLE_TIMEOUT_SEC 150         // nothing received for this long, peer wire keep-alives come every two minutes
+#define UTP_REORDER_LIMIT 1024           // packets ahead of the next expected one that are buffered
+
+namespace Utp
+{
+	enum packet_type
+	{
+		ST_DATA = 0,
+		ST_FIN,
+		ST_STATE,
+		ST_RESET,
+		ST_SYN
+	};
+
+	struct Stats
+	{
+		uint64_t packets_sent = 0;
+		uint64_t packets_received = 0;
+		uint64_t retransmissions = 0;
+		uint64_t dropped = 0;      // by the loss set_impairment() induces
+		uint64_t fast_resends = 0; // retransmissions after three duplicate or selective ACKs instead of a timeout
+		size_t connections = 0;
+	};
+
+	// uTP (BEP 29) endpoint on one UDP socket shared by all its connections. Each connection is handed to the peer code as
+	// the local end of a socket pair, so send(), recv(), poll(), sendfile() and shutdown() work on it exactly like on a TCP
+	// socket and the peer wire code doesn't care which transport it runs on; closing that end sends a FIN.
+	// A single thread moves the data: datagrams in and out are batched with recvmmsg / sendmmsg, each connection sends
+	// within a LEDBAT window that shrinks as soon as its packets queue up anywhere on the path (so it yields to TCP and to
+	// our own other traffic), and losses are repaired from selective ACKs before a retransmission timeout is needed.
+	class Utp_Socket
+	{
+	public:
+		~Utp_Socket();
+
+		int start(uint16_t port); // the port may be taken, any port works for outgoing connections then
+
+		void stop(); // resets every connection
+
+		uint16_t port() const { return bound_port; }
+
+		// Sends a SYN and returns the socket the peer code uses, -1 on error. connect_state() tells when the peer answered.
+		int start_connect(const Network::Peer_Address& address);
+
+		// 1 once connected, 0 while the SYN is unanswered, -1 when the connect failed (the caller closes the socket)
+		int connect_state(int app_socket);
+
+		void abort_connect(int app_socket); // a connect nobody waits for anymore, the caller closes the socket
+
+		// start_connect() and the wait for its outcome, the socket on success and -1 otherwise
+		int connect(const Network::Peer_Address& address, std::chrono::milliseconds timeout);
+
+		// Connections peers open to us, the handler owns the socket and must return quickly (it runs on the uTP thread)
+		void set_accept_handler(std::function<void(int app_socket, const Network::Peer_Address& address)> handler);
+
+		// Delays every datagram we send by delay and drops a loss_rate share of them, for testing on loopback
+		void set_impairment(std::chrono::milliseconds delay, double loss_rate);
+
+		Stats stats() const;
+
+	private:
+		using Clock = std::chrono::steady_clock;
+
+		enum connection_state
+		{
+			SYN_SENT = 0,
+			CONNECTED,
+			FIN_SENT, // our FIN is out, the peer may still be sending
+		};
+
+		struct Header
+		{
+			uint8_t type = ST_DATA;
+			uint8_t extension = 0;
+			uint16_t connection_id = 0;
+			uint32_t timestamp_us = 0;
+			uint32_t timestamp_diff_us = 0;
+			uint32_t wnd_size = 0;
+			uint16_t seq_nr = 0;
+			uint16_t ack_nr = 0;
+		};
+
+		struct Packet
+		{
+			uint8_t type = ST_DATA;
+			uint16_t seq_nr = 0;
+			std::string payload;
+			Clock::time_point sent_at;
+			int transmissions = 0;
+			bool is_acked = false; // selectively, the packets before it are still missing
+		};
+
+		struct Connection
+		{
+			Network::Peer_Address address;
+			int local_socket = -1; // our end of the socket pair
+			int app_socket = -1;   // the end the peer code got
+			uint16_t recv_id = 0;  // connection id of the packets the peer sends us
+			uint16_t send_id = 0;
+			int state = SYN_SENT;
+			Clock::time_point started_at;
+			Clock::time_point last_received;
+
+			// sending: every packet stays in flight until it is acked, the oldest first
+			uint16_t seq_nr = 1; // of our next packet
+			std::deque<Packet> in_flight;
+			size_t bytes_in_flight = 0;
+			bool is_app_closed = false; // the peer code closed or shut down its end, our FIN follows the data
+			uint16_t last_ack_nr = 0;
+			int duplicate_acks = 0;
+			int32_t fast_resent_seq = -1; // a packet is resent early once per loss
+
+			// receiving
+			uint16_t ack_nr = 0; // last packet received in order
+			std::map<uint16_t, std::string> out_of_order; // seq_nr -> payload
+			size_t out_of_order_bytes = 0;
+			int32_t fin_seq = -1;
+			std::string received; // in order, waiting for room in the socket pair
+			bool is_eof_delivered = false;
+			bool needs_ack = false;
+			uint32_t reply_us = 0; // one way delay of the peer's last packet, echoed in ours
+
+			// LEDBAT and retransmission
+			double window = UTP_MIN_WINDOW * 2; // bytes
+			uint32_t peer_window = UTP_MAX_PAYLOAD;
+			std::deque<std::pair<int64_t, uint32_t>> base_delays; // (minute, lowest delay sample in it)
+			double rtt_ms = 0;
+			double rtt_var_ms = 0;
+			int rto_ms = 1000;
+			Clock::time_point rto_deadline;
+			Clock::time_point window_cut_at; // losses within one round trip are one congestion event
+			int timeouts = 0;
+			bool has_new_acks = false; // the window moved, more of the peer code's data may go out
+		};
+
+		void utp_loop();
+
+		void receive_datagrams(std::vector<std::pair<Network::Peer_Address, int>>& accepted); // needs utp_mutex
+
+		void handle_packet(const Network::Peer_Address& sender, const uint8_t* data, size_t len, std::vector<std::pair<Network::Peer_Address, int>>& accepted);
+
+		void handle_syn(const Network::Peer_Address& sender, const Header& header, std::vector<std::pair<Network::Peer_Address, int>>& accepted);
+
+		void handle_acks(Connection& connection, const Header& header, const uint8_t* sack, size_t sack_len);
+
+		void receive_payload(Connection& connection, const Header& header, std::string payload);
+
+		void update_window(Connection& connection, size_t acked_bytes, uint32_t delay_us);
+
+		void read_app_data(Connection& connection); // packets what the peer code wrote while the window has room
+
+		void deliver(Connection& connection); // writes received data to the socket pair
+
+		bool check_timeouts(Connection& connection, Clock::time_point now); // true when the connection has to be given up
+
+		void send_packet(Connection& connection, Packet& packet);
+
+		void send_state(Connection& connection);
+
+		void send_reset(const Network::Peer_Address& address, uint16_t connection_id);
+
+		void queue_datagram(const Network::Peer_Address& address, std::string datagram);
+
+		void flush_datagrams(); // sendmmsg, needs utp_mutex
+
+		std::string encode(const Connection& connection, uint8_t type, uint16_t seq_nr, const std::string& payload);
+
+		uint32_t advertised_window(const Connection& connection) const;
+
+		bool is_finished(const Connection& connection) const;
+
+		void remove_connection(const std::string& key, bool has_failed); // needs utp_mutex
+
+		static std::string connection_key(const Network::Peer_Address& address, uint16_t recv_id);
+
+		static uint32_t now_us();
+
+		int udp_socket = -1;
+		uint16_t bound_port = 0;
+
+		std::unordered_map<std::string, Connection> connections; // (address, recv_id) -> connection
+		std::unordered_map<int, std::string> app_sockets;        // app socket -> connection key
+		std::unordered_set<int> failed_connects;                 // app sockets of connects that failed
+		std::function<void(int, const Network::Peer_Address&)> accept_handler;
+
+		struct Datagram
+		{
+			Network::Peer_Address address;
+			std::string data;
+			Clock::time_point due_at;
+		};
+
+		std::vector<uint8_t> receive_buffers; // UTP_BATCH datagrams
+		std::vector<Datagram> outgoing;
+		std::deque<Datagram> delayed; // held back by the impairment
+		std::chrono::milliseconds impairment_delay{0};
+		double impairment_loss = 0;
+		std::mt19937 random{std::random_device{}()};
+
+		Stats counters;
+		mutable std::mutex utp_mutex;
+		std::condition_variable utp_cv; // connect outcomes
+		std::atomic<bool> is_running = false;
+		std::thread utp_thread;
+	};
+}
+
+#endif
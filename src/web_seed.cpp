@@ -0,0 +1,126 @@
+
+#include "web_seed.h"
+#include "bencode_helper.h"
+#include "lib/http/httplib.h"
+
+namespace WebSeed
+{
+	// "http://host:port/some/path" -> {"http://host:port", "/some/path"}
+	static std::pair<std::string, std::string> split_url(const std::string& url)
+	{
+		auto scheme_end = url.find("://");
+		auto path_start = url.find('/', scheme_end == std::string::npos ? 0 : scheme_end + 3);
+
+		if (path_start == std::string::npos)
+			return {url, "/"};
+
+		return {url.substr(0, path_start), url.substr(path_start)};
+	}
+
+	std::vector<File_Span> map_range(const Torrent::TorrentData& torrent_data, const std::string& base_url, int64_t offset, int64_t length)
+	{
+		std::vector<File_Span> spans;
+
+		if (!torrent_data.is_multi_file)
+		{
+			std::string url = base_url.ends_with('/') ? base_url + torrent_data.name : base_url;
+			spans.push_back(File_Span{url, offset, length});
+			return spans;
+		}
+
+		std::string dir_url = base_url.ends_with('/') ? base_url : base_url + "/";
+		dir_url += torrent_data.name;
+
+		int64_t file_start = 0;
+
+		for (const auto& file_info : torrent_data.files)
+		{
+			int64_t file_end = file_start + file_info.length;
+
+			if (length > 0 && offset < file_end && file_info.length > 0)
+			{
+				int64_t span_length = std::min<int64_t>(length, file_end - offset);
+
+				std::string url = dir_url;
+				for (const auto& path_component : file_info.path)
+					url += "/" + path_component;
+
+				spans.push_back(File_Span{url, offset - file_start, span_length});
+
+				offset += span_length;
+				length -= span_length;
+			}
+
+			file_start = file_end;
+		}
+
+		return spans;
+	}
+
+	Web_Seed::Web_Seed(const std::string& base_url) : base_url(base_url)
+	{
+		auto timeout = std::chrono::milliseconds(WEB_SEED_TIMEOUT_MS);
+
+		host = split_url(base_url).first;
+		client = std::make_unique<httplib::Client>(host);
+		client->set_keep_alive(true);
+		client->set_connection_timeout(timeout);
+		client->set_read_timeout(timeout);
+		client->set_follow_location(true);
+	}
+
+	Web_Seed::~Web_Seed() = default;
+
+	int Web_Seed::fetch_range(const Torrent::TorrentData& torrent_data, int64_t offset, int64_t length, std::string& data)
+	{
+		data.clear();
+		data.reserve(length);
+
+		for (const auto& span : map_range(torrent_data, base_url, offset, length))
+		{
+			if (fetch_span(span, data) != 0)
+				return -1;
+		}
+
+		return static_cast<int64_t>(data.size()) == length ? 0 : -1;
+	}
+
+	int Web_Seed::fetch_span(const File_Span& span, std::string& data)
+	{
+		auto [span_host, path] = split_url(span.url);
+
+		if (span_host != host)
+		{
+			std::cerr << "Web seed file " << span.url << " is not on " << host << std::endl;
+			return -1;
+		}
+
+		httplib::Headers headers{
+			{"Range", "bytes=" + std::to_string(span.offset) + "-" + std::to_string(span.offset + span.length - 1)}
+		};
+
+		auto resp = client->Get(path, headers);
+
+		if (!resp)
+		{
+			std::cerr << "Failed to connect to web seed " << host << std::endl;
+			return -1;
+		}
+
+		if (resp->status == 206 && static_cast<int64_t>(resp->body.size()) == span.length)
+		{
+			data.append(resp->body);
+			return 0;
+		}
+
+		// a server without range support sends the whole file
+		if (resp->status == 200 && static_cast<int64_t>(resp->body.size()) >= span.offset + span.length)
+		{
+			data.append(resp->body, span.offset, span.length);
+			return 0;
+		}
+
+		std::cerr << "Web seed " << span.url << " answered with status " << resp->status << std::endl;
+		return -1;
+	}
+}
@@ -0,0 +1,60 @@
+
+#ifndef _WEB_SEED_H_
+#define _WEB_SEED_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#define WEB_SEED_TIMEOUT_MS 15000
+#define WEB_SEED_MAX_RUN_BYTES (4 * 1024 * 1024) // contiguous pieces fetched with a single range request
+#define WEB_SEED_MAX_FAILURES 5
+
+namespace Torrent
+{
+	struct TorrentData;
+}
+
+namespace httplib
+{
+	class Client;
+}
+
+namespace WebSeed
+{
+	// Part of a torrent byte range that falls into one file
+	struct File_Span
+	{
+		std::string url;     // full url of the file on the web seed
+		int64_t offset = 0;  // offset inside that file
+		int64_t length = 0;
+	};
+
+	// BEP 19: single file torrents use the url as is (or url + name when it ends with '/'),
+	// multi file torrents append name/path... to the url
+	std::vector<File_Span> map_range(const Torrent::TorrentData& torrent_data, const std::string& base_url, int64_t offset, int64_t length);
+
+	// An HTTP mirror from the torrent's url-list, requests go over one keep-alive connection
+	class Web_Seed
+	{
+	public:
+		explicit Web_Seed(const std::string& base_url);
+
+		~Web_Seed();
+
+		// Fetches [offset, offset + length) of the torrent into data using Range requests, one per file the range touches
+		int fetch_range(const Torrent::TorrentData& torrent_data, int64_t offset, int64_t length, std::string& data);
+
+		const std::string& url() const { return base_url; }
+
+	private:
+		int fetch_span(const File_Span& span, std::string& data);
+
+		std::string base_url;
+		std::string host; // scheme://host[:port] the client is connected to
+		std::unique_ptr<httplib::Client> client;
+	};
+}
+
+#endif